@@ -15,6 +15,7 @@
 #include "UtilityLibLite.h"
 #include "parse.h"
 #include "symtable.h"
+#include "vector.h"
 #include "script.h"
 #include "config.h"
 
@@ -283,13 +284,17 @@ void formatResult(Variant v, STRPTR varName, STRPTR out, int max)
 		break;
 
 	case TYPE_ARRAY:
+	case TYPE_VECTOR:
 		{
+			VariantBuf item;
 			int i, items;
 			if (max > 0)
 				*out ++ = '[', max --;
 			for (i = 0, items = VAR_LENGTH(v) - 1; i <= items; i ++)
 			{
-				formatResult(v->array + i, (STRPTR) -1, out, max);
+				if (v->type == TYPE_VECTOR) VectorGet(v, i, &item);
+				else item = v->array[i];
+				formatResult(&item, (STRPTR) -1, out, max);
 				while (*out) out ++, max --;
 				if (i == items || max == 0) break;
 				switch (max) {
@@ -311,7 +316,7 @@ void formatResult(Variant v, STRPTR varName, STRPTR out, int max)
 /* try to convert arg to double */
 static double GetArg64(Variant v, int idx, int count)
 {
-	if (idx > count) return 0; v += idx;
+	if (idx >= count) return 0; v += idx;
 	switch (v->type) {
 	case TYPE_FLOAT: return v->real32;
 	case TYPE_DBL:   return v->real64;
@@ -324,7 +329,7 @@ static double GetArg64(Variant v, int idx, int count)
 
 static float GetArg32(Variant v, int idx, int count)
 {
-	if (idx > count) return 0; v += idx;
+	if (idx >= count) return 0; v += idx;
 	switch (v->type) {
 	case TYPE_FLOAT: return v->real32;
 	case TYPE_DBL:   return v->real64;
@@ -335,6 +340,245 @@ static float GetArg32(Variant v, int idx, int count)
 	}
 }
 
+/* builtin functions: index in this table is the id stored in the byte code */
+static STRPTR builtinNames[] = {
+	"sin", "cos", "tan", "asin", "acos", "atan", "pow", "exp", "log", "sqrt", "floor", "ceil", "round",
+	"i64", "i32", "f64", "f32", "zeros",
+	"sum", "prod", "min", "max", "argmin", "argmax", "dot", "mean", "norm"
+};
+
+#define BUILTIN_VECTOR     13     /* first builtin that returns a typed array */
+#define BUILTIN_REDUCE     18     /* first builtin that reduces an array to a scalar */
+static uint8_t builtinHash[64]; /* id+1, linear probing */
+
+static int builtinHashName(STRPTR name)
+{
+	uint32_t hash;
+	for (hash = 0; *name; hash = hash * 31 + tolower(*name), name ++);
+	return hash & (DIM(builtinHash) - 1);
+}
+
+/* builtin called by <name>: user programs with the same name take precedence, -1 if not a builtin */
+int builtinResolve(STRPTR name)
+{
+	int func = builtinFind(name);
+	return func >= 0 && scriptIsProgram(name) ? -1 : func;
+}
+
+/* get id of builtin function <name> or -1 if there are none */
+int builtinFind(STRPTR name)
+{
+	int slot, id;
+	if (builtinHash[builtinHashName(builtinNames[0])] == 0)
+	{
+		for (id = 0; id < DIM(builtinNames); id ++)
+		{
+			for (slot = builtinHashName(builtinNames[id]); builtinHash[slot]; slot = (slot + 1) & (DIM(builtinHash) - 1));
+			builtinHash[slot] = id + 1;
+		}
+	}
+	for (slot = builtinHashName(name); (id = builtinHash[slot]) > 0; slot = (slot + 1) & (DIM(builtinHash) - 1))
+		if (strcasecmp(builtinNames[id-1], name) == 0)
+			return id - 1;
+
+	return -1;
+}
+
+/* i64(), i32(), f64(), f32(): convert array or scalar to given type (same order as TYPE_INT - TYPE_FLOAT) */
+static void builtinVector(int func, Variant v, int argc)
+{
+	VariantBuf arg = *v, item;
+	int        type = func - BUILTIN_VECTOR, count, i;
+
+	if (argc == 0)
+	{
+		v->type = TYPE_ERR;
+		v->int32 = PERR_MissingOperand;
+		return;
+	}
+	switch (type) {
+	case 4: /* zeros(count) */
+		arg.real64 = GetArg64(v, 0, argc);
+		if (! (0 <= arg.real64 && arg.real64 <= VAR_MAXLENGTH))
+		{
+			v->type = TYPE_ERR;
+			v->int32 = PERR_InvalidOperation;
+			return;
+		}
+		if (! VectorAlloc(v, appcfg.use64b ? TYPE_DBL : TYPE_FLOAT, arg.real64))
+			goto error_case;
+		break;
+	default:
+		switch (arg.type) {
+		case TYPE_ARRAY:
+			if (! VectorAlloc(v, type, count = VAR_LENGTH(&arg)))
+				goto error_case;
+			for (i = 0; i < count; i ++)
+				VectorSet(v, i, arg.array + i);
+			break;
+		case TYPE_VECTOR:
+			if (! VectorAlloc(v, type, count = VAR_LENGTH(&arg)))
+				goto error_case;
+			for (i = 0; i < count; i ++)
+				VectorGet(&arg, i, &item), VectorSet(v, i, &item);
+			break;
+		default: /* scalar: convert it through a one item vector */
+			{
+				int64_t    mem;
+				VariantBuf one = {.type = TYPE_VECTOR, .lengthFree = 1 | VAR_SETITEM(type), .vector = &mem};
+				VectorSet(&one, 0, &arg);
+				VectorGet(&one, 0, v);
+			}
+		}
+	}
+	return;
+
+	error_case:
+	v->type = TYPE_ERR;
+	v->int32 = PERR_NoMem;
+}
+
+/* sum(), prod(), min(), max(), argmin(), argmax(), mean(), norm(): of one array, or of the list of arguments */
+static void builtinReduce(int func, Variant v, int argc)
+{
+	static uint8_t ops[] = {VEC_SUM, VEC_PROD, VEC_MIN, VEC_MAX, VEC_ARGMIN, VEC_ARGMAX, VEC_DOT, VEC_SUM, VEC_DOT};
+	VariantBuf arg1, arg2;
+	int        type, count, error;
+
+	func -= BUILTIN_REDUCE;
+	if (argc == 0 || (func == 6 && argc != 2))
+	{
+		v->type = TYPE_ERR;
+		v->int32 = PERR_MissingOperand;
+		return;
+	}
+	if (func == 6) /* dot(a, b) */
+	{
+		arg1 = v[0];
+		arg2 = v[1];
+	}
+	else if (argc == 1 && (v->type == TYPE_ARRAY || v->type == TYPE_VECTOR))
+	{
+		arg1 = arg2 = v[0];
+	}
+	else /* arguments are already laid out as an array */
+	{
+		arg1.type = TYPE_ARRAY;
+		arg1.lengthFree = argc;
+		arg1.array = v;
+		arg2 = arg1;
+	}
+	/* arguments are owned by caller, converted arrays are owned by us */
+	VAR_BORROW(&arg1);
+	VAR_BORROW(&arg2);
+
+	type  = NumberType(&arg1);
+	count = NumberType(&arg2);
+	error = PERR_InvalidOperation;
+	if (type < 0 || count < 0)
+		goto error_case;
+	type  = WidestType(type, count);
+	count = VAR_LENGTH(&arg1);
+	if (func == 6 && VAR_LENGTH(&arg2) != count)
+		goto error_case;
+	if (count == 0 && 2 <= func && func <= 7)
+		/* min/max/mean of nothing */
+		goto error_case;
+
+	error = PERR_NoMem;
+	if (! VectorConvert(&arg1, type))
+		goto error_case;
+	if (func == 6 && ! VectorConvert(&arg2, type))
+		goto error_case;
+
+	vecReduce(ops[func], type, arg1.vector, func == 6 ? arg2.vector : arg1.vector, count, v);
+
+	switch (func) {
+	case 0: case 1: case 6: /* sum, prod, dot */
+		if (type == TYPE_FLOAT)
+			v->real32 = v->real64, v->type = TYPE_FLOAT;
+		break;
+	case 4: case 5: /* argmin, argmax */
+		if (! appcfg.use64b)
+			v->int32 = v->int64, v->type = TYPE_INT32;
+		break;
+	case 7: /* mean */
+	case 8: /* norm */
+		switch (v->type) {
+		case TYPE_INT:   v->real64 = v->int64; break;
+		case TYPE_INT32: v->real64 = v->int32; break;
+		default:         break;
+		}
+		v->real64 = func == 7 ? v->real64 / count : sqrt(v->real64);
+		if (appcfg.use64b) v->type = TYPE_DBL;
+		else v->real32 = v->real64, v->type = TYPE_FLOAT;
+	}
+	error = 0;
+
+	error_case:
+	VarRelease(&arg1);
+	if (func == 6) VarRelease(&arg2);
+	if (error)
+	{
+		/* v[0] might still be the array passed as argument */
+		memset(v, 0, sizeof *v);
+		v->type = TYPE_ERR;
+		v->int32 = error;
+	}
+}
+
+/* call builtin <func> with argc arguments from v: result will be stored in v[0] */
+void builtinCall(int func, Variant v, int argc)
+{
+	if (func >= BUILTIN_REDUCE)
+		builtinReduce(func, v, argc);
+	else if (func >= BUILTIN_VECTOR)
+		builtinVector(func, v, argc);
+	else if (appcfg.use64b)
+	{
+		double arg = GetArg64(v, 0, argc);
+		v->type = TYPE_DBL;
+		switch (func) {
+		case  0: v->real64 = sin(arg); break;
+		case  1: v->real64 = cos(arg); break;
+		case  2: v->real64 = tan(arg); break;
+		case  3: v->real64 = asin(arg); break;
+		case  4: v->real64 = acos(arg); break;
+		case  5: v->real64 = atan(arg); break;
+		case  6: v->real64 = pow(arg, GetArg64(v, 1, argc)); break;
+		case  7: v->real64 = exp(arg); break;
+		case  8: v->real64 = log(arg); break;
+		case  9: v->real64 = sqrt(arg); break;
+		case 10: v->real64 = floor(arg); break;
+		case 11: v->real64 = ceil(arg); break;
+		case 12: v->real64 = round(arg); break;
+		default: v->int32 = PERR_UnknownFunction; v->type = TYPE_ERR;
+		}
+	}
+	else /* use 32bit math functions instead */
+	{
+		float arg = GetArg32(v, 0, argc);
+		/* this is mostly to check the limit of 32bit floating point precision */
+		v->type = TYPE_FLOAT;
+		switch (func) {
+		case  0: v->real32 = sinf(arg); break;
+		case  1: v->real32 = cosf(arg); break;
+		case  2: v->real32 = tanf(arg); break;
+		case  3: v->real32 = asinf(arg); break;
+		case  4: v->real32 = acosf(arg); break;
+		case  5: v->real32 = atanf(arg); break;
+		case  6: v->real32 = powf(arg, GetArg32(v, 1, argc)); break;
+		case  7: v->real32 = expf(arg); break;
+		case  8: v->real32 = logf(arg); break;
+		case  9: v->real32 = sqrtf(arg); break;
+		case 10: v->real32 = floorf(arg); break;
+		case 11: v->real32 = ceilf(arg); break;
+		case 12: v->real32 = roundf(arg); break;
+		default: v->int32 = PERR_UnknownFunction; v->type = TYPE_ERR;
+		}
+	}
+}
+
 Bool IsNull(Variant arg);
 
 /* callback from ParseExpression */
@@ -343,56 +587,17 @@ void parseExpr(STRPTR name, Variant v, int store, APTR data)
 	ParseExprData expr = data;
 	if (store < 0) /* function call */
 	{
+		int func = builtinResolve(name);
 		store = -store-1;
-		if (scriptExecute(name, store, v))
+		if (func >= 0)
 		{
-			/* a program with that name exists */
+			builtinCall(func, v, store);
 			return;
 		}
-		int func = FindInList("sin,cos,tan,asin,acos,atan,pow,exp,log,sqrt,floor,ceil,round", name, 0);
-		if (appcfg.use64b)
-		{
-			double arg = GetArg64(v, 0, store);
-			v->type = TYPE_DBL;
-			switch (func) {
-			case  0: v->real64 = sin(arg); break;
-			case  1: v->real64 = cos(arg); break;
-			case  2: v->real64 = tan(arg); break;
-			case  3: v->real64 = acos(arg); break;
-			case  4: v->real64 = asin(arg); break;
-			case  5: v->real64 = atan(arg); break;
-			case  6: v->real64 = pow(arg, GetArg64(v, 1, store)); break;
-			case  7: v->real64 = exp(arg); break;
-			case  8: v->real64 = log(arg); break;
-			case  9: v->real64 = sqrt(arg); break;
-			case 10: v->real64 = floor(arg); break;
-			case 11: v->real64 = ceil(arg); break;
-			case 12: v->real64 = round(arg); break;
-			default: v->int32 = PERR_UnknownFunction; v->type = TYPE_ERR;
-			}
-		}
-		else /* use 32bit math functions instead */
-		{
-			float arg = GetArg32(v, 0, store);
-			/* this is mostly to check the limit of 32bit floating point precision */
-			v->type = TYPE_FLOAT;
-			switch (func) {
-			case  0: v->real32 = sinf(arg); break;
-			case  1: v->real32 = cosf(arg); break;
-			case  2: v->real32 = tanf(arg); break;
-			case  3: v->real32 = acosf(arg); break;
-			case  4: v->real32 = asinf(arg); break;
-			case  5: v->real32 = atanf(arg); break;
-			case  6: v->real32 = powf(arg, GetArg32(v, 1, store)); break;
-			case  7: v->real32 = expf(arg); break;
-			case  8: v->real32 = logf(arg); break;
-			case  9: v->real32 = sqrtf(arg); break;
-			case 10: v->real32 = floorf(arg); break;
-			case 11: v->real32 = ceilf(arg); break;
-			case 12: v->real32 = roundf(arg); break;
-			default: v->int32 = PERR_UnknownFunction; v->type = TYPE_ERR;
-			}
-		}
+		if (expr && expr->track)
+			expr->track(expr->trackData, name, NULL, TRACK_CALL);
+		if (! scriptExecute(name, store, v, NULL))
+			v->int32 = PERR_UnknownFunction, v->type = TYPE_ERR;
 	}
 	else if (name == NULL)
 	{
@@ -410,10 +615,12 @@ void parseExpr(STRPTR name, Variant v, int store, APTR data)
 		/* print result, check if already stored */
 		Result var = expr->assignTo ? symTableFindByName(&symbols, expr->assignTo) : symTableFindByValue(&symbols, v);
 
+		/* reusing a temp var that has the same value is not a dependency */
+		Bool reuse = var && ! expr->assignTo;
 		if (var)
 		{
 			/* already stored */
-			symTableAssign(var, v);
+			symTableAssign(&symbols, var, v);
 			if (var->frame == tagFrame)
 				/* already printed */
 				return;
@@ -441,6 +648,8 @@ void parseExpr(STRPTR name, Variant v, int store, APTR data)
 
 		if (var)
 		{
+			if (expr->track && ! reuse)
+				expr->track(expr->trackData, var->name, &var->bin, TRACK_WRITE);
 			/* this will mark the variable as already printed: don't do it twice */
 			var->frame = tagFrame;
 			expr->cb(&var->bin, var->name);
@@ -450,77 +659,102 @@ void parseExpr(STRPTR name, Variant v, int store, APTR data)
 	else /* get variable content */
 	{
 		Result var;
-		int constant = FindInList("pi,e,ln2,time,now", name, 0);
 
-		if (constant < 0)
+		if (data == NULL)
 		{
-			if (data == NULL)
-			{
-				/* trying to fold constant expression: this is a user-defined var name: not constant */
+			/* trying to fold constant expression: user-defined var names and clock are not constant */
+			if (FindInList("time,now", name, 0) >= 0 || ! constantGet(name, v))
 				v->type = TYPE_ERR;
-				return;
-			}
-			if (expr->cb == NULL)
-			{
-				/* graph mode: assign all var to this value */
-				*v = expr->res;
-				return;
-			}
+		}
+		else if (constantGet(name, v))
+		{
+			if (expr->track && FindInList("time,now", name, 0) >= 0)
+				expr->track(expr->trackData, name, NULL, TRACK_VOLATILE);
+			return;
+		}
+		else if (expr->cb == NULL)
+		{
+			/* graph mode: assign all var to this value */
+			*v = expr->res;
+		}
+		else
+		{
 			var = symTableFindByName(&symbols, name);
+			if (expr->track)
+				expr->track(expr->trackData, name, v, store ? TRACK_WRITE : TRACK_READ);
 			if (store == 0)
 			{
 				/* non-existant variable == integer 0 */
 				if (var)
 				{
+					/* refcounted: reading a variable does not copy its content */
 					memcpy(v, &var->bin, sizeof *v);
-					if (v->type == TYPE_ARRAY || v->type == TYPE_STR)
-						v->lengthFree &= 0x0fffffff;
+					VarRetain(v);
 				}
 				else memset(v, 0, sizeof *v);
 			}
-			else
+			else if (store == 1)
 			{
 				if (var == NULL)
 					var = symTableAdd(&symbols, name, v);
 				else
-					symTableAssign(var, v);
+					symTableAssign(&symbols, var, v);
 				var->frame = tagFrame;
 				expr->cb(v, var->name);
 			}
 		}
-		else if (appcfg.use64b)
-		{
-			switch (constant) {
-			case 0: v->real64 = M_PI;  v->type = TYPE_DBL; break;
-			case 1: v->real64 = M_E;   v->type = TYPE_DBL; break;
-			case 2: v->real64 = M_LN2; v->type = TYPE_DBL; break;
-			case 3: /* time, now */
-			/* time64 is a Microsoft msvcrt function :-/ */
-			case 4: v->int64 = _time64(0); v->type = TYPE_INT; break;
-			}
-			v->unit = 0;
+	}
+}
+
+/* builtin constants: also used by programs */
+Bool constantGet(STRPTR name, Variant v)
+{
+	int constant = FindInList("pi,e,ln2,time,now", name, 0);
+
+	if (constant < 0)
+		return False;
+
+	if (appcfg.use64b)
+	{
+		switch (constant) {
+		case 0: v->real64 = M_PI;  v->type = TYPE_DBL; break;
+		case 1: v->real64 = M_E;   v->type = TYPE_DBL; break;
+		case 2: v->real64 = M_LN2; v->type = TYPE_DBL; break;
+		case 3: /* time, now */
+		/* time64 is a Microsoft msvcrt function :-/ */
+		case 4: v->int64 = _time64(0); v->type = TYPE_INT; break;
 		}
-		else /* 32bit constants */
-		{
-			switch (constant) {
-			case 0: v->real32 = M_PI;  v->type = TYPE_FLOAT; break;
-			case 1: v->real32 = M_E;   v->type = TYPE_FLOAT; break;
-			case 2: v->real32 = M_LN2; v->type = TYPE_FLOAT; break;
-			case 3: /* time, now */
-			case 4: v->int32  = time(0); v->type = TYPE_INT32; break;
-			}
-			v->unit = 0;
+	}
+	else /* 32bit constants */
+	{
+		switch (constant) {
+		case 0: v->real32 = M_PI;  v->type = TYPE_FLOAT; break;
+		case 1: v->real32 = M_E;   v->type = TYPE_FLOAT; break;
+		case 2: v->real32 = M_LN2; v->type = TYPE_FLOAT; break;
+		case 3: /* time, now */
+		case 4: v->int32  = time(0); v->type = TYPE_INT32; break;
 		}
 	}
+	v->unit = 0;
+	return True;
 }
 
-/* ParseExpression() front end */
-int evalExpr(STRPTR expr, ParseExprData data)
+/* result saved from a previous session: display it as if evalExpr() had produced it */
+void restoreResult(STRPTR varName, Variant v, ParseExprData data)
 {
-	/* used to check if a variable has already been "printed" */
+	if (varName[0] == 0)
+	{
+		/* no variable assigned */
+		data->cb(v, "");
+		return;
+	}
 	tagFrame ++;
+	data->assignTo = varName;
+	parseExpr(NULL, v, 0, data);
+}
 
-	int error = ParseExpression(expr, parseExpr, data);
+static int evalError(int error, ParseExprData data)
+{
 	if (error == 0)
 		return 1;
 
@@ -532,3 +766,384 @@ int evalExpr(STRPTR expr, ParseExprData data)
 	}
 	return 0;
 }
+
+/* ParseExpression() front end */
+int evalExpr(STRPTR expr, ParseExprData data)
+{
+	/* used to check if a variable has already been "printed" */
+	tagFrame ++;
+
+	return evalError(ParseExpression(expr, parseExpr, data), data);
+}
+
+#define IS_IDENT(chr)     ((chr) == '_' || (chr) == '$' || (chr) >= 128 || isalnum(chr))
+
+/* user programs are folded at compile time if their arguments are constant: their calls must be seen */
+static Bool evalBuiltinCallsOnly(DATA8 expr)
+{
+	DATA8 start, next;
+	TEXT  name[16];
+
+	while (*expr)
+	{
+		if (! IS_IDENT(*expr)) { expr ++; continue; }
+		for (start = expr; IS_IDENT(*expr); expr ++);
+		for (next = expr; isspace(*next); next ++);
+		if (isdigit(*start) || *next != '(') continue;
+		if (expr - start >= sizeof name) return False;
+		CopyString(name, start, expr - start + 1);
+		if (builtinResolve(name) < 0) return False;
+	}
+	return True;
+}
+
+/* get byte code of <expr> in <code>: False if it has to be parsed by ParseExpression() instead */
+static Bool evalCompile(STRPTR expr, ExprCode code)
+{
+	uint32_t key = scriptShadowCrc();
+	DATA8    eof;
+
+	key = crc32(key, (DATA8) &appcfg.use64b, sizeof appcfg.use64b);
+	key = crc32(key, (DATA8) expr, -1);
+	if (key == code->key)
+		return code->bc.size > 0;
+
+	code->key = key;
+	code->bc.size = code->bc.units = 0;
+	/* keywords, ';', syntax errors or units: not something byte code will evaluate like ParseExpression() */
+	if (evalBuiltinCallsOnly((DATA8) expr) && ParseExpression(expr, ByteCodeGenExpr, &code->bc) == 0 &&
+	    code->bc.exp[0] == 0 && code->bc.units == 0 && (eof = ByteCodeAdd(&code->bc, 1)))
+	{
+		eof[0] = 255;
+		if (ByteCodeIsEager(code->bc.code))
+			return True;
+	}
+	code->bc.size = 0;
+	return False;
+}
+
+/* parseExpr() for byte code: errors are values, not a return code */
+static void parseExprCode(STRPTR name, Variant v, int store, APTR data)
+{
+	ParseExprData expr = data;
+	VariantBuf    res;
+
+	if (store == 2)
+		/* string append: done by the assignment that follows */
+		return;
+	if (name)
+		parseExpr(name, v, store, data);
+	else if (v->type == TYPE_ERR)
+		expr->res = *v;
+	else /* final result: parseExpr() can overwrite it, but value stack owns it */
+		res = *v, parseExpr(NULL, &res, 0, data);
+}
+
+/* same as evalExpr(), but <expr> is only parsed again if it has changed (<code> can be NULL) */
+int evalExprCode(STRPTR expr, ExprCode code, ParseExprData data)
+{
+	DATA8 end;
+
+	if (code == NULL || ! evalCompile(expr, code))
+		return evalExpr(expr, data);
+
+	tagFrame ++;
+	data->res.type = TYPE_VOID;
+	ByteCodeExe(code->bc.code, &end, False, parseExprCode, data);
+
+	return evalError(data->res.type == TYPE_ERR ? data->res.int32 : 0, data);
+}
+
+/*
+ * rows of the list evaluated by several threads: workers only read the global symbol table, what they
+ * would have written is logged in the job and applied by evalReplay() from the main thread, in list order.
+ */
+#define EVAL_THREADS     4
+
+typedef struct EvalThread_t *   EvalThread;
+
+struct EvalThread_t
+{
+	ProgContext ctx;             /* call stack of user programs */
+	SymTable_t  locals;          /* variables assigned by the current job */
+	EvalJob     job;
+	int         failed;          /* out of memory: job will be evaluated by main thread */
+	Semaphore   done;
+};
+
+static struct
+{
+	struct EvalThread_t threads[EVAL_THREADS];
+	EvalJob    jobs;
+	int        count, next;
+	ULONG      end;
+	SymTable_t written;          /* variables assigned by evalReplay() since last evalJobs() */
+	TrackVar   track;            /* of ParseExprData being replayed */
+	APTR       trackData;
+
+}	evalQueue;
+
+void addOutputToList(STRPTR line);
+
+static EvalEvent evalLog(EvalThread thread, int type, STRPTR name, Variant v)
+{
+	EvalJob   job = thread->job;
+	EvalEvent event;
+
+	if (job->count == job->max)
+	{
+		int max = job->max + 16;
+		event = realloc(job->events, max * sizeof *event);
+		if (event == NULL) goto fail;
+		job->events = event;
+		job->max = max;
+	}
+	event = job->events + job->count;
+	memset(event, 0, sizeof *event);
+	event->type = type;
+	if (type == EVAL_OUTPUT)
+	{
+		if ((event->name = strdup(name)) == NULL) goto fail;
+	}
+	else if (name)
+	{
+		/* interned: valid until the end of the program */
+		int atom = AtomIntern(name, MIN((int) strlen(name), MAX_VAR_NAME - 1));
+		if (atom < 0) goto fail;
+		event->name = AtomName(atom);
+	}
+	if (v && ! VarCopy(&event->value, v)) goto fail;
+	job->count ++;
+	return event;
+
+	fail:
+	thread->failed = 1;
+	return NULL;
+}
+
+static void evalTrack(EvalThread thread, STRPTR name, Variant v, int access)
+{
+	EvalEvent event = evalLog(thread, EVAL_TRACK, name, access == TRACK_WRITE ? v : NULL);
+	if (event) event->access = access;
+}
+
+/* lines PRINTed by user programs */
+static void evalOutput(APTR ud, STRPTR line)
+{
+	evalLog(ud, EVAL_OUTPUT, line, NULL);
+}
+
+/* same as parseExpr(), but for worker threads */
+static void parseExprJob(STRPTR name, Variant v, int store, APTR data)
+{
+	EvalThread thread = data;
+	Result     var;
+
+	if (store < 0) /* function call */
+	{
+		int func = builtinResolve(name);
+		store = -store-1;
+		if (func >= 0)
+		{
+			builtinCall(func, v, store);
+			return;
+		}
+		evalTrack(thread, name, NULL, TRACK_CALL);
+		if (! scriptExecute(name, store, v, thread->ctx))
+			v->int32 = PERR_UnknownFunction, v->type = TYPE_ERR;
+	}
+	else if (name == NULL)
+	{
+		/* byte code: errors are values */
+		if (v->type == TYPE_ERR)
+			thread->job->error = v->int32;
+		else if (v->type != TYPE_VOID)
+			evalLog(thread, EVAL_PRINT, NULL, v);
+	}
+	else if (constantGet(name, v))
+	{
+		if (FindInList("time,now", name, 0) >= 0)
+			evalTrack(thread, name, NULL, TRACK_VOLATILE);
+	}
+	else if (store == 0)
+	{
+		evalTrack(thread, name, NULL, TRACK_READ);
+		/* variables assigned by this row first */
+		var = symTableFindByName(&thread->locals, name);
+		if (var == NULL)
+			var = symTableFindByName(&symbols, name);
+		if (var)
+		{
+			memcpy(v, &var->bin, sizeof *v);
+			VarRetain(v);
+		}
+		else memset(v, 0, sizeof *v);
+	}
+	else if (store == 1)
+	{
+		var = symTableFindByName(&thread->locals, name);
+		if (var == NULL)
+			var = symTableAdd(&thread->locals, name, v);
+		else
+			symTableAssign(&thread->locals, var, v);
+		if (var == NULL)
+			thread->failed = 1;
+		evalLog(thread, EVAL_STORE, name, v);
+	}
+	/* else store == 2: string append, done by the assignment that follows */
+}
+
+static void evalWorker(APTR arg)
+{
+	EvalThread thread = arg;
+	EvalJob    job;
+	int        i;
+
+	while ((i = __sync_fetch_and_add(&evalQueue.next, 1)) < evalQueue.count)
+	{
+		/* first job is always evaluated: caller must make some progress */
+		if (i > 0 && TimeMS() >= evalQueue.end)
+			break;
+		job = thread->job = evalQueue.jobs + i;
+		thread->failed = 0;
+		scriptReset(thread->ctx);
+		if (job->code)
+		{
+			DATA8 end;
+			job->error = 0;
+			ByteCodeExe(job->code->bc.code, &end, False, parseExprJob, thread);
+		}
+		else job->error = ParseExpression(job->expr, parseExprJob, thread);
+		if (thread->failed)
+			evalFreeJob(job), job->error = -1;
+		symTableFree(&thread->locals);
+	}
+	if (thread->done)
+		SemAdd(thread->done, 1);
+}
+
+/* evaluate <jobs> concurrently until <end> (TimeMS()): jobs not done will have <error> set to -1, use evalFreeJob() on all */
+void evalJobs(EvalJob jobs, int count, ULONG end)
+{
+	EvalThread thread;
+	Semaphore  done;
+	int        nb, i;
+
+	/* everything that is initialized on first use */
+	scriptPrecompile();
+	ParseInit();
+	vecInit();
+	builtinFind("");
+	crc32(0, (DATA8) "", 0);
+
+	for (i = 0; i < count; i ++)
+	{
+		jobs[i].events = NULL, jobs[i].error = -1, jobs[i].count = jobs[i].max = 0;
+		/* workers only read byte code */
+		if (jobs[i].code && ! evalCompile(jobs[i].expr, jobs[i].code))
+			jobs[i].code = NULL;
+	}
+
+	for (nb = 0, thread = evalQueue.threads; nb < MIN(count, EVAL_THREADS); nb ++, thread ++)
+		if (thread->ctx == NULL && (thread->ctx = scriptNewContext(evalOutput, thread)) == NULL)
+			break;
+
+	symTableFree(&evalQueue.written);
+	evalQueue.jobs  = jobs;
+	evalQueue.count = count;
+	evalQueue.next  = 0;
+	evalQueue.end   = end;
+	if (nb == 0) return;
+
+	done = nb > 1 ? SemInit(0) : NULL;
+	/* first worker is this thread, others get the same stack reserve (see MAX_C_STACK) */
+	for (i = 1; i < nb; i ++)
+	{
+		thread = evalQueue.threads + i;
+		thread->done = done;
+		if (ThreadCreate(evalWorker, thread) == 0)
+			thread->done = NULL, SemAdd(done, 1);
+	}
+	evalQueue.threads[0].done = NULL;
+	evalWorker(evalQueue.threads);
+
+	if (done)
+	{
+		for (i = 1; i < nb; i ++)
+			SemWait(done);
+		SemClose(done);
+	}
+}
+
+/* <job> has read a variable assigned by a job replayed before: it has to be evaluated again */
+Bool evalStale(EvalJob job)
+{
+	EvalEvent event, eof;
+
+	for (event = job->events, eof = event + job->count; event < eof; event ++)
+	{
+		if (event->type == EVAL_TRACK && event->access == TRACK_READ &&
+		    symTableFindByName(&evalQueue.written, event->name))
+			return True;
+	}
+	return False;
+}
+
+static void evalTrackReplay(APTR ud, STRPTR name, Variant written, int access)
+{
+	static VariantBuf none;
+
+	if (access == TRACK_WRITE && symTableFindByName(&evalQueue.written, name) == NULL)
+		symTableAdd(&evalQueue.written, name, &none);
+	if (evalQueue.track)
+		evalQueue.track(evalQueue.trackData, name, written, access);
+}
+
+/* apply what a worker has logged, as if evalExpr() had been called with <data> */
+int evalReplay(EvalJob job, ParseExprData data)
+{
+	EvalEvent  event, eof;
+	VariantBuf value;
+
+	evalQueue.track = data->track;
+	evalQueue.trackData = data->trackData;
+	data->track = evalTrackReplay;
+	tagFrame ++;
+
+	for (event = job->events, eof = event + job->count; event < eof; event ++)
+	{
+		/* reference is kept by event: parseExpr() can overwrite the variant */
+		value = event->value;
+		switch (event->type) {
+		case EVAL_TRACK:
+			evalTrackReplay(NULL, event->name, &value, event->access);
+			break;
+		case EVAL_STORE:
+			parseExpr(event->name, &value, 1, data);
+			break;
+		case EVAL_PRINT:
+			parseExpr(NULL, &value, 0, data);
+			break;
+		case EVAL_OUTPUT:
+			addOutputToList(event->name);
+		}
+	}
+	data->track = evalQueue.track;
+	return evalError(job->error, data);
+}
+
+void evalFreeJob(EvalJob job)
+{
+	EvalEvent event, eof;
+
+	for (event = job->events, eof = event + job->count; event < eof; event ++)
+	{
+		if (event->type == EVAL_OUTPUT)
+			free(event->name);
+		else
+			VarRelease(&event->value);
+	}
+	free(job->events);
+	job->events = NULL;
+	job->count = job->max = 0;
+}
@@ -10,65 +10,396 @@
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
+#include <ctype.h>
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "UtilityLibLite.h"
 #include "config.h"
+#include "lz.h"
 
 
 struct Config_t *  config;
 struct ConfigApp_t appcfg;
 
-static uint8_t configHeader[] = "CONFIG v1.0____\n";
+static uint8_t configHeader[] = "CONFIG v2.0____\n";
 
-void configRead(STRPTR path)
+/*
+ * v1: chunk header is 2 bytes size (BE) + 14 bytes name.
+ * v2: chunk header is 8 bytes size (BE) + 16 bytes name, followed by an index of all chunks (CHUNK_INDEX),
+ *     itself followed by 8 bytes: the offset of the header of that index. This is what configSave() writes.
+ *     During the session, chunks modified are appended after that (configFlush()), each record being
+ *     followed by the same 8 bytes: a partially written record will be ignored.
+ *     Chunk size with CHUNK_PACKED set: content is 4 bytes uncompressed size (BE) + LZ stream (see lz.c).
+ */
+#define CHUNK_HDR        24
+#define CHUNK_INDEX      "*INDEX"
+#define CHUNK_DELETED    0xffffffffffffffffULL
+#define CHUNK_PACKED     0x4000000000000000ULL
+#define INDEX_ENTRY      32
+
+static uint64_t configGetU64(DATA8 mem)
 {
-	FILE * in = fopen(path, "rb");
-	int length = strlen(path);
+	uint64_t val;
+	int      i;
+	for (i = 0, val = 0; i < 8; i ++)
+		val = (val << 8) | mem[i];
+	return val;
+}
 
-	if (in)
+static void configSetU64(DATA8 mem, uint64_t val)
+{
+	int i;
+	for (i = 7; i >= 0; i --, val >>= 8)
+		mem[i] = val;
+}
+
+/*
+ * config file is mapped read-only in memory: chunks are used from there until they are modified, at
+ * which point they are copied on the heap (configAddChunk() or configEndChunk()).
+ */
+static DATA8 configMap(STRPTR path, int * size)
+{
+	DATA8 mem = NULL;
+	#ifdef WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	*size = GetFileSize(file, NULL);
+	if (*size > 0)
+	{
+		HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (map)
+		{
+			mem = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(map);
+		}
+	}
+	CloseHandle(file);
+	#else
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < 0x7fffffff)
 	{
-		int size;
-		fseek(in, 0, SEEK_END); size = ftell(in);
-		fseek(in, 0, SEEK_SET);
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mem == MAP_FAILED) mem = NULL;
+		*size = st.st_size;
+	}
+	close(fd);
+	#endif
+	return mem;
+}
 
-		config = malloc(sizeof *config + size + length);
-		memset(config, 0, sizeof *config);
-		config->content = (DATA8) (config+1) + length;
-		config->size = size;
-		ListNew(&config->chunks);
-		strcpy(config->path, path);
+static void configUnmap(void)
+{
+	if (config->content == NULL) return;
+	#ifdef WIN32
+	UnmapViewOfFile(config->content);
+	#else
+	munmap(config->content, config->size);
+	#endif
+	config->content = NULL;
+	config->size = 0;
+}
+
+static inline Bool configIsMapped(DATA8 mem)
+{
+	return config->content <= mem && mem < config->content + config->size;
+}
+
+static uint32_t configHashName(STRPTR name)
+{
+	uint32_t hash;
+	for (hash = 5381; *name; name ++)
+		hash = hash * 33 + tolower(*name);
+	return hash;
+}
+
+static void configHashAdd(ConfigChunk chunk)
+{
+	ConfigChunk * bucket;
+
+	if (config->nbChunks >= config->nbBuckets)
+	{
+		/* grow table: rehash everything from list */
+		int max = config->nbBuckets < 16 ? 16 : config->nbBuckets * 2;
+		ConfigChunk * buckets = calloc(max, sizeof *buckets);
+		ConfigChunk   list;
+		if (buckets)
+		{
+			free(config->buckets);
+			config->buckets = buckets;
+			config->nbBuckets = max;
+			config->nbChunks = 0;
+			for (list = HEAD(config->chunks); list; NEXT(list))
+			{
+				if (list == chunk) continue;
+				bucket = buckets + (configHashName(list->name) & (max - 1));
+				list->hashNext = *bucket;
+				*bucket = list;
+				config->nbChunks ++;
+			}
+		}
+		else if (config->nbBuckets == 0) return;
+	}
+	bucket = config->buckets + (configHashName(chunk->name) & (config->nbBuckets - 1));
+	chunk->hashNext = *bucket;
+	*bucket = chunk;
+	config->nbChunks ++;
+}
+
+static void configHashDel(ConfigChunk chunk)
+{
+	ConfigChunk * prev;
+	if (config->nbBuckets == 0) return;
+	for (prev = config->buckets + (configHashName(chunk->name) & (config->nbBuckets - 1)); *prev; prev = &(*prev)->hashNext)
+	{
+		if (*prev == chunk)
+		{
+			*prev = chunk->hashNext;
+			config->nbChunks --;
+			break;
+		}
+	}
+}
+
+static ConfigChunk configFindChunk(STRPTR name)
+{
+	ConfigChunk chunk = NULL;
+
+	if (config->nbBuckets > 0)
+		for (chunk = config->buckets[configHashName(name) & (config->nbBuckets - 1)]; chunk; chunk = chunk->hashNext)
+			if (strcasecmp(chunk->name, name) == 0) break;
+
+	return chunk;
+}
+
+static void configLinkChunk(ConfigChunk chunk)
+{
+	ListAddTail(&config->chunks, &chunk->node);
+	configHashAdd(chunk);
+}
+
+static void configUnlinkChunk(ConfigChunk chunk)
+{
+	ListRemove(&config->chunks, &chunk->node);
+	configHashDel(chunk);
+}
+
+/* content from file: compressed chunks are only unpacked when they are needed */
+static void configSetContent(ConfigChunk chunk, DATA8 content, uint64_t size)
+{
+	if (size & CHUNK_PACKED)
+	{
+		int bytes = size & ~CHUNK_PACKED;
+		chunk->packed = content;
+		chunk->packedSize = bytes;
+		chunk->content = NULL;
+		size = bytes < 4 ? 0 : ((uint32_t) content[0] << 24) | (content[1] << 16) | (content[2] << 8) | content[3];
+		if (size > 0x7fffffff) size = 0;
+	}
+	else chunk->content = content, chunk->packed = NULL;
+	chunk->size = chunk->oldSize = size;
+}
+
+static void configAddChunkFrom(DATA8 name, int max, DATA8 content, uint64_t size)
+{
+	ConfigChunk chunk = calloc(sizeof *chunk, 1);
+
+	CopyString(chunk->name, name, MIN(max + 1, sizeof chunk->name));
+	configSetContent(chunk, content, size);
+	configLinkChunk(chunk);
+}
+
+/* get chunks from index at end of base file: no need to scan the whole file */
+/* offset of chunk index written at the end of <content> by configCompact(), 0 if there is none */
+static uint64_t configIndexOffset(DATA8 content, int total)
+{
+	uint64_t offset, size;
+	DATA8    index;
+
+	if (total < 16 + CHUNK_HDR + 8) return 0;
+	offset = configGetU64(content + total - 8);
+	if (offset < 16 || offset > total - CHUNK_HDR - 8) return 0;
 
-		fread(config->content, 1, size, in);
-		fclose(in);
+	index = content + offset;
+	size  = configGetU64(index);
+	if (strcmp(index + 8, CHUNK_INDEX) || size > total - 8 - CHUNK_HDR - offset || (size % INDEX_ENTRY) > 0 ||
+	    configGetU64(index + CHUNK_HDR + size) != offset)
+		return 0;
+
+	return offset;
+}
+
+static int configReadIndex(int total)
+{
+	uint64_t offset, size, i;
+	DATA8    index;
+
+	offset = configIndexOffset(config->content, total);
+	if (offset == 0) return 0;
+
+	index = config->content + offset;
+	size  = configGetU64(index);
+
+	/* chunks are all located before the index */
+	for (index += CHUNK_HDR, i = 0; i < size; i += INDEX_ENTRY)
+	{
+		uint64_t start = configGetU64(index + i);
+		uint64_t bytes = configGetU64(index + i + 8) & ~CHUNK_PACKED;
+		if (start < 16 + CHUNK_HDR || start > offset || bytes > offset - start)
+			return 0;
+	}
+	for (i = 0; i < size; i += INDEX_ENTRY)
+	{
+		DATA8 entry = index + i;
+		configAddChunkFrom(entry + 16, 15, config->content + configGetU64(entry), configGetU64(entry + 8));
+	}
+	return offset;
+}
+
+/* index missing or damaged: get list of chunks from headers */
+static int configScanChunks(int total)
+{
+	DATA8 cfg, eof;
+	for (cfg = config->content + 16, eof = config->content + total; eof - cfg >= CHUNK_HDR; )
+	{
+		uint64_t size = configGetU64(cfg);
+		uint64_t bytes = size & ~CHUNK_PACKED;
+		if (bytes > (uint64_t) (eof - cfg) - CHUNK_HDR) break;
+		if (strcmp(cfg + 8, CHUNK_INDEX) == 0)
+			return cfg - config->content;
+		configAddChunkFrom(cfg + 8, 15, cfg + CHUNK_HDR, size);
+		cfg += CHUNK_HDR + bytes;
+	}
+	return 0;
+}
+
+/* replay records appended after the base file, return where they end */
+static int configReadJournal(int index, int total)
+{
+	DATA8 cfg = config->content + index;
+	DATA8 eof = config->content + total;
+
+	/* skip index */
+	cfg += CHUNK_HDR + configGetU64(cfg) + 8;
+
+	while (eof - cfg >= CHUNK_HDR + 8)
+	{
+		uint64_t    size = configGetU64(cfg);
+		ConfigChunk chunk;
+		TEXT        name[16];
+
+		if (size == CHUNK_DELETED) size = 0;
+		else size &= ~CHUNK_PACKED;
+		if (size > (uint64_t) (eof - cfg) - CHUNK_HDR - 8 || configGetU64(cfg + CHUNK_HDR + size) != index)
+			break;
+
+		CopyString(name, cfg + 8, sizeof name);
+		chunk = configFindChunk(name);
+		if (configGetU64(cfg) == CHUNK_DELETED)
+		{
+			if (chunk) configUnlinkChunk(chunk), free(chunk);
+		}
+		else if (chunk)
+		{
+			configSetContent(chunk, cfg + CHUNK_HDR, configGetU64(cfg));
+		}
+		else configAddChunkFrom(name, 15, cfg + CHUNK_HDR, configGetU64(cfg));
+
+		cfg += CHUNK_HDR + size + 8;
+	}
+	return cfg - config->content;
+}
+
+/* replace <path> with <temp> in one step: there is no point where <path> does not exist */
+static Bool configReplace(STRPTR temp, STRPTR path)
+{
+	#ifdef WIN32
+	return MoveFileEx(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	#else
+	return rename(temp, path) == 0;
+	#endif
+}
+
+/* <path> is missing: use the file written by configCompact() if it was complete */
+static DATA8 configRecover(STRPTR path, int * size)
+{
+	TEXT temp[256];
+	Bool complete;
+
+	snprintf(temp, sizeof temp, "%s.new", path);
+	config->content = configMap(temp, size);
+	if (config->content == NULL)
+		return NULL;
+	config->size = *size;
+	complete = *size >= 16 && strncmp(configHeader, config->content, 16) == 0 &&
+		configIndexOffset(config->content, *size) > 0;
+	configUnmap();
+
+	return complete && configReplace(temp, path) ? configMap(path, size) : NULL;
+}
+
+void configRead(STRPTR path)
+{
+	int size = 0;
+
+	config = calloc(sizeof *config + strlen(path), 1);
+	config->content = configMap(path, &size);
+	if (config->content == NULL)
+		config->content = configRecover(path, &size);
+	config->version = 2;
+	strcpy(config->path, path);
+
+	if (config->content)
+	{
+		config->size = size;
 
 		/* 16 bytes header */
-		if (strncmp(configHeader, config->content, 16) == 0)
+		if (size >= 16 && strncmp(configHeader, config->content, 16) == 0)
+		{
+			int index = configReadIndex(size);
+
+			if (index == 0)
+				index = configScanChunks(size);
+
+			if (index > 0)
+			{
+				config->base = index;
+				config->eof = configReadJournal(index, size);
+				/* crashed while appending: remove partial record */
+				if (config->eof < size)
+					TruncateFile(path, config->eof);
+			}
+			/* no index at all: rewrite everything */
+			else config->changed = 1;
+		}
+		else if (size >= 16 && strncmp("CONFIG v1.0____\n", config->content, 16) == 0)
 		{
 			DATA8 cfg, eof;
 
-			/* get list of chunks in this config */
-			for (cfg = config->content + 16, eof = cfg + size - 16; cfg < eof; cfg += size + 16)
+			/* will be written back in new format */
+			config->version = 1;
+			config->changed = 1;
+			for (cfg = config->content + 16, eof = cfg + size - 16; eof - cfg >= 16; cfg += size + 16)
 			{
 				/* chunk hdr: 2bytes size (BE) + 14 bytes name */
 				size = (cfg[0] << 8) | cfg[1];
-				if (cfg + size > eof) return;
-
-				ConfigChunk chunk = calloc(sizeof *chunk, 1);
-
-				memcpy(chunk->name, cfg + 2, 14);
-				chunk->name[15] = 0;
-				chunk->size = chunk->oldSize = size;
-				chunk->content = cfg + 16;
-
-				ListAddTail(&config->chunks, &chunk->node);
+				if (cfg + size > eof) break;
+				configAddChunkFrom(cfg + 2, 14, cfg + 16, size);
 			}
 		}
 	}
-	else /* create a default config */
-	{
-		config = calloc(sizeof *config + length, 1);
+	/* file does not exist or can't be used: write everything */
+	if (config->base == 0)
 		config->changed = 1;
-		strcpy(config->path, path);
-	}
 
 	/* already read config chunk */
 	DATA8 mem = configGetChunk("_CONFIG", NULL);
@@ -82,15 +413,16 @@ void configRead(STRPTR path)
 		appcfg.use64b = mem[6];
 		appcfg.lightMode = mem[7];
 		appcfg.defProg   = mem[8];
+		appcfg.maxCallDepth = (mem[9] << 8) | mem[10];
 		memcpy(appcfg.defUnitNames, mem + 16, sizeof appcfg.defUnitNames);
 	}
 	else /* set default values */
 	{
 		ConfigChunk chunk = calloc(sizeof *chunk, 1);
 		strcpy(chunk->name, "_CONFIG");
-		chunk->content = mem = calloc(SZ_CHUNK, 1);
+		chunk->content = calloc(SZ_CHUNK, 1);
 		chunk->size = SZ_CHUNK;
-		ListAddTail(&config->chunks, &chunk->node);
+		configLinkChunk(chunk);
 
 		appcfg.width  = 640;
 		appcfg.height = 480;
@@ -98,143 +430,465 @@ void configRead(STRPTR path)
 		appcfg.lightMode = 1;
 		strcpy(appcfg.defUnitNames, "M/degC/G");
 	}
-	memcpy(config->oldConfig, mem, sizeof config->oldConfig);
 }
 
-/* will overwrite file read in configRead() */
-void configSave(void)
+/* store appcfg back into chunk mem */
+static void configStoreApp(void)
+{
+	uint8_t mem[64];
+	DATA8   content;
+	int     size;
+
+	content = configGetChunk("_CONFIG", &size);
+	if (content == NULL || size < sizeof mem) return;
+	memcpy(mem, content, sizeof mem);
+	mem[0] = appcfg.width >> 8;
+	mem[1] = appcfg.width & 0xff;
+	mem[2] = appcfg.height >> 8;
+	mem[3] = appcfg.height & 0xff;
+	mem[4] = appcfg.format;
+	mem[5] = appcfg.mode;
+	mem[6] = appcfg.use64b;
+	mem[7] = appcfg.lightMode;
+	mem[8] = appcfg.defProg;
+	mem[9] = appcfg.maxCallDepth >> 8;
+	mem[10] = appcfg.maxCallDepth & 0xff;
+	memcpy(mem + 16, appcfg.defUnitNames, sizeof appcfg.defUnitNames);
+
+	/* content might still be in the file mapping */
+	if (memcmp(mem, content, sizeof mem) && (content = configAddChunk("_CONFIG", size)))
+		memcpy(content, mem, sizeof mem);
+}
+
+static Bool configSync(FILE * out)
+{
+	if (fflush(out)) return False;
+	#ifdef WIN32
+	return _commit(fileno(out)) == 0;
+	#else
+	return fsync(fileno(out)) == 0;
+	#endif
+}
+
+/* chunks containing mostly text: programs and expression history */
+static Bool configIsPackable(STRPTR name)
+{
+	return name[0] == '$' || strcasecmp(name, "_EXPR") == 0;
+}
+
+/* compressed content is kept until chunk is modified: only done once per change */
+static void configPack(ConfigChunk chunk)
+{
+	DATA8 mem, shrink;
+	int   max, size;
+
+	if (chunk->packed || chunk->size < PACK_MIN || ! configIsPackable(chunk->name))
+		return;
+
+	/* has to save at least 1/8 of the size, otherwise keep it as is */
+	max = chunk->size - chunk->size / 8;
+	mem = malloc(max + 4);
+	if (mem == NULL) return;
+	size = lzCompress(chunk->content, chunk->size, mem + 4, max);
+	if (size == 0)
+	{
+		free(mem);
+		return;
+	}
+	mem[0] = chunk->size >> 24;
+	mem[1] = chunk->size >> 16;
+	mem[2] = chunk->size >> 8;
+	mem[3] = chunk->size;
+	shrink = realloc(mem, size + 4);
+	chunk->packed = shrink ? shrink : mem;
+	chunk->packedSize = size + 4;
+}
+
+/* content has been modified: compressed version is not valid anymore */
+static void configDropPacked(ConfigChunk chunk)
+{
+	if (! configIsMapped(chunk->packed))
+		free(chunk->packed);
+	chunk->packed = NULL;
+}
+
+/* set header of chunk record, return content as it will be stored in file */
+static DATA8 configFileContent(ConfigChunk chunk, DATA8 header, int * size)
+{
+	configPack(chunk);
+	strncpy(header + 8, chunk->name, 16);
+	if (chunk->packed)
+	{
+		configSetU64(header, chunk->packedSize | CHUNK_PACKED);
+		*size = chunk->packedSize;
+		return chunk->packed;
+	}
+	configSetU64(header, chunk->size);
+	*size = chunk->size;
+	return chunk->content;
+}
+
+/* copy memory out of file mapping */
+static Bool configDetach(DATA8 * mem, int size)
+{
+	DATA8 copy;
+	if (! configIsMapped(*mem)) return True;
+	copy = malloc(size);
+	if (copy == NULL) return False;
+	memcpy(copy, *mem, size);
+	*mem = copy;
+	return True;
+}
+
+/* write all chunks in a new file that will replace the old one, journal is discarded */
+static void configCompact(void)
 {
 	ConfigChunk chunk;
 	FILE *      out;
-	Bool        modif = config->changed;
-	/* note: this is done at program exit */
-	out = fopen(config->path, modif ? "wb" : "rb+");
-	if (! out) return;
+	DATA8       index, entry, data;
+	uint64_t    offset;
+	uint8_t     header[CHUNK_HDR];
+	TEXT        temp[256];
+	int         count = config->nbChunks, size, bytes;
 
-	if (modif)
-		fwrite(configHeader, 1, 16, out);
-	else
-		fseek(out, 16, SEEK_SET);
+	index = calloc(count, INDEX_ENTRY);
+	if (index == NULL) return;
 
-	/* don't care if it is modified or not */
-	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+	snprintf(temp, sizeof temp, "%s.new", config->path);
+	out = fopen(temp, "wb");
+	if (! out) { free(index); return; }
+
+	fwrite(configHeader, 1, 16, out);
+	for (chunk = HEAD(config->chunks), offset = 16, entry = index; chunk; NEXT(chunk), entry += INDEX_ENTRY)
 	{
-		uint8_t header[16];
-		header[0] = chunk->size >> 8;
-		header[1] = chunk->size & 0xff;
-		memcpy(header + 2, chunk->name, 14);
+		data = configFileContent(chunk, header, &bytes);
+		configSetU64(entry, offset + CHUNK_HDR);
+		memcpy(entry + 8, header, 8);
+		strncpy(entry + 16, chunk->name, 16);
+		offset += CHUNK_HDR + bytes;
 
-		if (strcasecmp(chunk->name, "_CONFIG") == 0)
+		fwrite(header, 1, sizeof header, out);
+		fwrite(data, 1, bytes, out);
+	}
+
+	memset(header, 0, sizeof header);
+	configSetU64(header, count * INDEX_ENTRY);
+	strcpy(header + 8, CHUNK_INDEX);
+	fwrite(header, 1, sizeof header, out);
+	fwrite(index, INDEX_ENTRY, count, out);
+	configSetU64(header, offset);
+	fwrite(header, 1, 8, out);
+	free(index);
+
+	/* old file is still intact if anything goes wrong before rename() */
+	if (! configSync(out) || ferror(out))
+	{
+		fclose(out);
+		remove(temp);
+		return;
+	}
+	fclose(out);
+
+	/* file mapping has to be released before the file can be replaced (win32) */
+	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+	{
+		if (! configDetach(&chunk->content, chunk->size) || ! configDetach(&chunk->packed, chunk->packedSize))
 		{
-			/* store appcfg back into chunk mem */
-			DATA8 mem = chunk->content;
-			mem[0] = appcfg.width >> 8;
-			mem[1] = appcfg.width & 0xff;
-			mem[2] = appcfg.height >> 8;
-			mem[3] = appcfg.height & 0xff;
-			mem[4] = appcfg.format;
-			mem[5] = appcfg.mode;
-			mem[6] = appcfg.use64b;
-			mem[7] = appcfg.lightMode;
-			mem[8] = appcfg.defProg;
-			memcpy(mem + 16, appcfg.defUnitNames, sizeof appcfg.defUnitNames);
-			if (memcmp(mem, config->oldConfig, sizeof config->oldConfig))
-				chunk->changed = 1;
+			remove(temp);
+			return;
 		}
+	}
+	configUnmap();
+
+	if (! configReplace(temp, config->path))
+	{
+		/* everything is on the heap: try again on next flush */
+		config->base = 0;
+		return;
+	}
 
-		/* do not overwrite stuff that hasn't changed */
-		if (! modif && ! chunk->changed && chunk->oldSize == chunk->size)
+	/* and map new file: content is at the same place in the new file */
+	config->content = configMap(config->path, &size);
+	if (config->content)
+		config->size = size;
+
+	for (chunk = HEAD(config->chunks), offset = 16; chunk; NEXT(chunk))
+	{
+		bytes = chunk->packed ? chunk->packedSize : chunk->size;
+		offset += CHUNK_HDR;
+		if (config->content && offset + bytes <= size)
 		{
-			//fprintf(stderr, "skipping %s\n", chunk->name);
-			fseek(out, chunk->size + 16, SEEK_CUR);
-			continue;
+			/* unpacked content stays on the heap */
+			if (chunk->packed)
+				free(chunk->packed), chunk->packed = config->content + offset;
+			else
+				free(chunk->content), chunk->content = config->content + offset;
 		}
-		if (chunk->oldSize != chunk->size)
-			/* overwrite remaining */
-			modif = True;
-
-		//fprintf(stderr, "writing %s\n", chunk->name);
-		fwrite(header, 1, sizeof header, out);
-		fwrite(chunk->content, 1, chunk->size, out);
+		offset += bytes;
+		chunk->changed = 0;
 		chunk->oldSize = chunk->size;
 	}
-	fclose(out);
+
+	config->base = offset;
+	config->eof  = offset + CHUNK_HDR + count * INDEX_ENTRY + 8;
+	config->nbDeleted = 0;
+	config->changed = 0;
 }
 
-DATA8 configGetChunk(STRPTR name, int * size)
+/* append chunks modified since last call to end of file: cost is proportional to what has changed */
+void configFlush(void)
 {
 	ConfigChunk chunk;
+	FILE *      out;
+	uint8_t     record[CHUNK_HDR];
+	uint8_t     trailer[8];
+	int         i, eof;
+
+	configStoreApp();
+	/* journal has grown too much compared to what is really used */
+	if (config->eof - config->base > MAX(config->base, JOURNAL_MIN))
+		config->changed = 1;
+
+	if (config->changed || config->base == 0)
+	{
+		configCompact();
+		return;
+	}
+
+	for (chunk = HEAD(config->chunks); chunk && ! chunk->changed; NEXT(chunk));
+	if (chunk == NULL && config->nbDeleted == 0)
+		return;
+
+	out = fopen(config->path, "rb+");
+	if (! out) return;
+	fseek(out, config->eof, SEEK_SET);
+
+	/* records are only valid if followed by this */
+	configSetU64(trailer, config->base);
+	configSetU64(record, CHUNK_DELETED);
+	for (i = 0, eof = config->eof; i < config->nbDeleted; i ++)
+	{
+		strncpy(record + 8, config->deleted[i], 16);
+		fwrite(record, 1, CHUNK_HDR, out);
+		fwrite(trailer, 1, 8, out);
+		eof += CHUNK_HDR + 8;
+	}
 
 	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
 	{
-		if (strcasecmp(chunk->name, name) == 0)
-		{
-			if (size) *size = chunk->size;
-			return chunk->content;
-		}
+		DATA8 data;
+		int   size;
+		if (! chunk->changed) continue;
+		data = configFileContent(chunk, record, &size);
+		fwrite(record, 1, CHUNK_HDR, out);
+		fwrite(data, 1, size, out);
+		fwrite(trailer, 1, 8, out);
+		eof += CHUNK_HDR + size + 8;
+	}
+
+	/* one sync for all the records */
+	if (configSync(out) && ! ferror(out))
+	{
+		for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+			chunk->changed = 0, chunk->oldSize = chunk->size;
+		config->eof = eof;
+		config->nbDeleted = 0;
 	}
-	if (size) *size = 0;
-	return NULL;
+	fclose(out);
+}
+
+/* done at program exit */
+void configSave(void)
+{
+	configFlush();
+}
+
+/* compressed chunks are unpacked on first access */
+DATA8 configChunkContent(ConfigChunk chunk)
+{
+	if (chunk->content == NULL && chunk->packed)
+	{
+		DATA8 mem = malloc(chunk->size);
+		if (mem == NULL) return NULL;
+		/* corrupted stream: better get an empty chunk than garbage */
+		if (lzDecompress(chunk->packed + 4, chunk->packedSize - 4, mem, chunk->size) != chunk->size)
+			memset(mem, 0, chunk->size);
+		chunk->content = mem;
+	}
+	return chunk->content;
+}
+
+DATA8 configGetChunk(STRPTR name, int * size)
+{
+	ConfigChunk chunk = configFindChunk(name);
+
+	if (size) *size = chunk ? chunk->size : 0;
+	return chunk ? configChunkContent(chunk) : NULL;
 }
 
 DATA8 configAddChunk(STRPTR name, int size)
 {
-	ConfigChunk chunk;
-	/* round up to next chunk multiple */
-	int padSize = (size + SZ_CHUNK - 1) & ~(SZ_CHUNK-1);
-	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+	ConfigChunk chunk = configFindChunk(name);
+	DATA8       mem;
+
+	if (chunk)
 	{
-		if (strcasecmp(chunk->name, name) == 0)
+		/* round up to next chunk multiple, but never grow when shrinking */
+		int padSize = (size + SZ_CHUNK - 1) & ~(SZ_CHUNK-1);
+		int keep    = MIN(size, chunk->size);
+		if (size == chunk->size || (size < chunk->size && padSize > chunk->size))
+			padSize = chunk->size;
+
+		mem = configChunkContent(chunk);
+		if (mem == NULL && chunk->size > 0) return NULL;
+		if (configIsMapped(mem))
 		{
-			DATA8 mem = chunk->content;
-			if (size > chunk->size)
-			{
-				/* initial read will alloc the chunk content at once */
-				if (config->content <= mem && mem < config->content + config->size)
-					mem = NULL;
-
-				chunk->content = mem = realloc(mem, padSize);
-				/* might contain some sensitive information */
-				memset(mem + chunk->size, 0, padSize - chunk->size);
-				chunk->size = padSize;
-			}
-			else if (size < chunk->size)
-			{
-				/* prevent old data from leaking */
-				chunk->size = padSize;
-				memset(chunk->content + size, 0, chunk->size - size);
-			}
-			chunk->changed = 1;
-			return mem;
+			/* content from file is read-only: copy it on first modification */
+			mem = malloc(padSize);
+			if (mem) memcpy(mem, chunk->content, keep);
+		}
+		else if (padSize > chunk->size)
+		{
+			mem = realloc(mem, padSize);
 		}
+		if (mem == NULL) return NULL;
+
+		/* might contain some sensitive information or old data */
+		memset(mem + keep, 0, padSize - keep);
+		configDropPacked(chunk);
+		chunk->content = mem;
+		chunk->size = padSize;
+		chunk->changed = 1;
+		return mem;
 	}
 
 	/* chunk not in list yet, add it now */
 	chunk = calloc(sizeof *chunk, 1);
-	CopyString(chunk->name, name, 15);
-	ListAddTail(&config->chunks, &chunk->node);
-
+	mem = calloc(size, 1);
+	if (chunk == NULL || mem == NULL)
+	{
+		free(chunk);
+		free(mem);
+		return NULL;
+	}
+	CopyString(chunk->name, name, sizeof chunk->name);
 	chunk->size = size;
 	chunk->changed = 1;
-	chunk->content = calloc(size, 1);
-	return chunk->content;
+	chunk->content = mem;
+	configLinkChunk(chunk);
+	return mem;
+}
+
+/* chunk will have to be removed from journal by configFlush() */
+static void configRecordDelete(STRPTR name)
+{
+	if (config->nbDeleted == config->maxDeleted)
+	{
+		int  max = config->maxDeleted + 8;
+		TEXT (*buf)[16] = realloc(config->deleted, max * sizeof *config->deleted);
+		/* rewrite everything then */
+		if (buf == NULL) { config->changed = 1; return; }
+		config->deleted = buf;
+		config->maxDeleted = max;
+	}
+	CopyString(config->deleted[config->nbDeleted ++], name, 16);
 }
 
 void configDelChunk(STRPTR name)
 {
-	ConfigChunk chunk;
-	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+	ConfigChunk chunk = configFindChunk(name);
+	if (chunk)
 	{
-		if (strcasecmp(chunk->name, name) == 0)
+		configRecordDelete(chunk->name);
+		configUnlinkChunk(chunk);
+		if (! configIsMapped(chunk->content))
+			free(chunk->content);
+		configDropPacked(chunk);
+		free(chunk);
+	}
+}
+
+void configRenameChunk(ConfigChunk chunk, STRPTR name)
+{
+	configRecordDelete(chunk->name);
+	configHashDel(chunk);
+	CopyString(chunk->name, name, sizeof chunk->name);
+	configHashAdd(chunk);
+	chunk->changed = 1;
+}
+
+/*
+ * chunk writer: content is accumulated in a heap buffer that grows as needed, and that will directly
+ * become the content of the chunk if it differs from what is already there.
+ */
+void configStartChunk(ConfigWriter writer, STRPTR name)
+{
+	memset(writer, 0, sizeof *writer);
+	CopyString(writer->name, name, sizeof writer->name);
+}
+
+/* <data> can be NULL: space is reserved and has to be filled through the returned pointer */
+DATA8 configWrite(ConfigWriter writer, APTR data, int size)
+{
+	DATA8 mem;
+	if (writer->size < 0) return NULL;
+	if (writer->size + size > writer->max)
+	{
+		int max = writer->max;
+		while (max < writer->size + size)
+			max = max < 1024 ? 1024 : max * 2;
+		mem = realloc(writer->buffer, max);
+		if (mem == NULL)
 		{
-			DATA8 mem = config->content;
-			ListRemove(&config->chunks, &chunk->node);
-			if (! (config->content <= mem && mem < config->content + config->size))
-				free(mem);
-			free(chunk);
-			/* rewrite everything */
-			config->changed = 1;
-			break;
+			/* will keep the old content */
+			free(writer->buffer);
+			writer->buffer = NULL;
+			writer->size = -1;
+			return NULL;
 		}
+		writer->buffer = mem;
+		writer->max = max;
 	}
+	mem = writer->buffer + writer->size;
+	if (data) memcpy(mem, data, size);
+	writer->size += size;
+	return mem;
+}
+
+/* commit content: chunk is removed if nothing was written */
+void configEndChunk(ConfigWriter writer)
+{
+	ConfigChunk chunk;
+	DATA8       mem;
+
+	if (writer->size == 0)
+	{
+		configDelChunk(writer->name);
+		free(writer->buffer);
+	}
+	if (writer->size <= 0) return;
+
+	chunk = configFindChunk(writer->name);
+	if (chunk == NULL)
+	{
+		chunk = calloc(sizeof *chunk, 1);
+		if (chunk == NULL) { free(writer->buffer); return; }
+		CopyString(chunk->name, writer->name, sizeof chunk->name);
+		configLinkChunk(chunk);
+	}
+	else if (chunk->size == writer->size && (mem = configChunkContent(chunk)) && memcmp(mem, writer->buffer, writer->size) == 0)
+	{
+		/* do not overwrite stuff, if we don't have to */
+		free(writer->buffer);
+		return;
+	}
+	else if (! configIsMapped(chunk->content))
+	{
+		free(chunk->content);
+	}
+
+	configDropPacked(chunk);
+	chunk->content = writer->buffer;
+	chunk->size = writer->size;
+	chunk->changed = 1;
 }
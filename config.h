@@ -7,25 +7,37 @@
 #ifndef KALC_CONFIG_H
 #define KALC_CONFIG_H
 
+typedef struct ConfigChunk_t *       ConfigChunk;
+typedef struct ConfigApp_t *         ConfigApp;
+typedef struct ConfigWriter_t *      ConfigWriter;
+
 void  configRead(STRPTR path);
 void  configSave(void);
+void  configFlush(void);
 DATA8 configGetChunk(STRPTR name, int * size);
+DATA8 configChunkContent(ConfigChunk);
 DATA8 configAddChunk(STRPTR name, int size);
 void  configDelChunk(STRPTR name);
+void  configRenameChunk(ConfigChunk, STRPTR name);
+void  configStartChunk(ConfigWriter, STRPTR name);
+DATA8 configWrite(ConfigWriter, APTR data, int size);
+void  configEndChunk(ConfigWriter);
 
 extern struct ConfigApp_t appcfg;
 extern struct Config_t *  config;
 
-typedef struct ConfigChunk_t *       ConfigChunk;
-typedef struct ConfigApp_t *         ConfigApp;
-
 
 struct Config_t
 {
 	ListHead chunks;
-	DATA8    content;
+	DATA8    content;            /* config file, mapped read-only */
 	int      size, changed;
-	uint8_t  oldConfig[64];
+	int      version;            /* of file read: 1 = 16bit chunk size, 2 = 64bit + index */
+	int      base, eof;          /* offset of index in file (journal starts after it), end of journal */
+	TEXT     (*deleted)[16];     /* chunks deleted since last configFlush() */
+	int      nbDeleted, maxDeleted;
+	ConfigChunk * buckets;       /* hash table of chunk names */
+	int      nbBuckets, nbChunks;
 	TEXT     path[1];
 };
 
@@ -33,9 +45,19 @@ struct ConfigChunk_t
 {
 	ListNode node;
 	TEXT     name[16];
-	DATA8    content;
-	uint16_t size, oldSize;
-	uint16_t changed;
+	DATA8    content;            /* in file mapping until modified, NULL if not unpacked yet */
+	DATA8    packed;             /* compressed content (file mapping or heap), NULL if stored as is */
+	ConfigChunk hashNext;
+	int      size, oldSize;
+	int      packedSize;
+	int      changed;
+};
+
+struct ConfigWriter_t
+{
+	DATA8    buffer;
+	int      size, max;          /* size < 0: out of memory */
+	TEXT     name[16];
 };
 
 struct ConfigApp_t
@@ -44,10 +66,13 @@ struct ConfigApp_t
 	int      format, use64b;
 	int      mode, lightMode;
 	int      defProg;
+	int      maxCallDepth;
 	uint8_t  defUnitNames[32];
 	int      defUnits[4];
 };
 
 #define SZ_CHUNK         128
+#define JOURNAL_MIN      65536  /* compact file if journal gets bigger than that and the chunks themselves */
+#define PACK_MIN         256    /* do not bother compressing chunks smaller than that */
 
 #endif
@@ -0,0 +1,134 @@
+/*
+ * lz.c: small LZ77 codec, similar to LZ4 block format: fast enough to be used each time a chunk of the
+ *       config file is written or read, with no external dependency. Stream is a list of sequences:
+ *       - token: 4 bits literal length, 4 bits match length - 4 (value 15: more length bytes follow),
+ *       - literal length continuation (bytes added until one is != 255), then the literals,
+ *       - 2 bytes match offset (LE), match length continuation.
+ *       Last sequence only contains literals.
+ */
+
+#include <string.h>
+#include "UtilityLibLite.h"
+#include "lz.h"
+
+#define LZ_HASH_BITS     12
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_OFFSET    65535
+
+static DATA8 lzPutLength(DATA8 out, int len)
+{
+	for (; len >= 255; len -= 255)
+		*out++ = 255;
+	*out++ = len;
+	return out;
+}
+
+/* return size of compressed data, 0 if it does not fit in <max> bytes */
+int lzCompress(DATA8 src, int size, DATA8 dst, int max)
+{
+	int   table[1 << LZ_HASH_BITS];
+	DATA8 in, end, anchor, out, eod;
+	int   lit;
+
+	memset(table, 0xff, sizeof table);
+	for (in = anchor = src, end = src + size, out = dst, eod = dst + max; end - in >= LZ_MIN_MATCH; )
+	{
+		uint32_t seq;
+		DATA8    match;
+		int      ref, hash, len, offset;
+
+		memcpy(&seq, in, 4);
+		hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref  = table[hash];
+		table[hash] = in - src;
+		if (ref < 0 || (in - src) - ref > LZ_MAX_OFFSET || memcmp(src + ref, in, LZ_MIN_MATCH))
+		{
+			in ++;
+			continue;
+		}
+
+		for (match = src + ref, len = LZ_MIN_MATCH; in + len < end && match[len] == in[len]; len ++);
+		offset = in - match;
+		lit = in - anchor;
+
+		/* worst case for that sequence */
+		if (eod - out < lit + lit / 255 + len / 255 + 5)
+			return 0;
+
+		*out = (MIN(lit, 15) << 4) | MIN(len - LZ_MIN_MATCH, 15);
+		out = lit >= 15 ? lzPutLength(out + 1, lit - 15) : out + 1;
+		memcpy(out, anchor, lit);
+		out += lit;
+		out[0] = offset & 0xff;
+		out[1] = offset >> 8;
+		out += 2;
+		if (len - LZ_MIN_MATCH >= 15)
+			out = lzPutLength(out, len - LZ_MIN_MATCH - 15);
+
+		/* positions inside the match are not hashed: faster, and good enough for what we compress */
+		in += len;
+		anchor = in;
+	}
+
+	/* last literals */
+	lit = end - anchor;
+	if (eod - out < lit + lit / 255 + 2)
+		return 0;
+	*out = MIN(lit, 15) << 4;
+	out = lit >= 15 ? lzPutLength(out + 1, lit - 15) : out + 1;
+	memcpy(out, anchor, lit);
+
+	return out + lit - dst;
+}
+
+static DATA8 lzGetLength(DATA8 in, DATA8 end, int * len, int max)
+{
+	int c;
+	do {
+		if (in >= end) return NULL;
+		c = *in++;
+		*len += c;
+		if (*len > max) return NULL;
+	} while (c == 255);
+	return in;
+}
+
+/* return size of uncompressed data, -1 if stream is corrupted or does not fit in <max> bytes */
+int lzDecompress(DATA8 src, int size, DATA8 dst, int max)
+{
+	DATA8 in, end, out, eod, match;
+	int   token, len, offset;
+
+	for (in = src, end = src + size, out = dst, eod = dst + max; ; )
+	{
+		/* last sequence only contains literals: anything else is a truncated stream */
+		if (in >= end) return -1;
+		token = *in++;
+		len = token >> 4;
+		if (len == 15 && (in = lzGetLength(in, end, &len, max)) == NULL)
+			return -1;
+		if (len > end - in || len > eod - out)
+			return -1;
+		memcpy(out, in, len);
+		in  += len;
+		out += len;
+		if (in == end) break;
+
+		if (end - in < 2) return -1;
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		if (offset == 0 || offset > out - dst)
+			return -1;
+		len = token & 15;
+		if (len == 15 && (in = lzGetLength(in, end, &len, max)) == NULL)
+			return -1;
+		len += LZ_MIN_MATCH;
+		if (len > eod - out)
+			return -1;
+
+		/* match can overlap with what is being written */
+		for (match = out - offset; len > 0; len --)
+			*out++ = *match++;
+	}
+	return out - dst;
+}
@@ -0,0 +1,11 @@
+/*
+ * lz.h: public functions of the LZ77 codec used to compress config chunks.
+ */
+
+#ifndef KALC_LZ_H
+#define KALC_LZ_H
+
+int lzCompress(DATA8 src, int size, DATA8 dst, int max);
+int lzDecompress(DATA8 src, int size, DATA8 dst, int max);
+
+#endif
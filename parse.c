@@ -14,6 +14,7 @@
 #include "UtilityLibLite.h"
 #include "config.h"
 #include "parse.h"
+#include "vector.h"
 
 #define RIGHT               1
 #define LEFT                2
@@ -63,6 +64,7 @@ static struct Operator_t OperatorList[] =
 static struct Operator_t functionCall = { "(",   0, LEFT,  17 };
 
 /* special operators */
+#define binaryPlus      (OperatorList+8)
 #define binaryMinus     (OperatorList+9)
 #define commaSeparator  (OperatorList+36)
 #define logicalAnd      (OperatorList+21)
@@ -71,6 +73,8 @@ static struct Operator_t functionCall = { "(",   0, LEFT,  17 };
 #define ternaryRight    (OperatorList+24)
 #define arrayStart      (OperatorList+37)
 #define arrayEnd        (OperatorList+38)
+#define assign          (OperatorList+25)
+#define assignAdd       (OperatorList+29)
 
 struct Unit_t units[] =
 {
@@ -171,8 +175,7 @@ static void * MyCalloc(DATA8 buffer, int length)
 static void MyFree(DATA8 buffer, Stack stack)
 {
 	DATA8 mem = (DATA8) stack;
-	if (VAR_TOFREE(&stack->value))
-		free(stack->value.string);
+	VarRelease(&stack->value);
 	if (buffer <= mem && mem < buffer + SZ_POOL)
 	{
 		DATA8 ptr  = mem - 4;
@@ -226,28 +229,152 @@ static Stack NewOperator(DATA8 buffer, Operator ope)
 	return oper;
 }
 
+/*
+ * identifiers are interned: each distinct name is stored once, at an address that will never change, and
+ * has an index that the byte code can reference. Names are case-sensitive here, unlike variables.
+ */
+#define ATOM_CHUNK   4096
+#define ATOM_PAGE    1024             /* index => name table is never relocated: AtomName() does not lock */
+#define ATOM_MAX     (ATOM_PAGE * ATOM_PAGE)
+
+typedef struct AtomChunk_t *    AtomChunk;
+
+struct AtomChunk_t
+{
+	AtomChunk next;
+	int       used, size;
+	TEXT      chars[4];
+};
+
+static struct
+{
+	STRPTR *  names[ATOM_PAGE];  /* atom index => name, by page of ATOM_PAGE */
+	int *     slots;             /* hash table of atom index + 1, 0 = empty */
+	int       count, capa;
+	AtomChunk chunks;            /* names storage */
+	Mutex     lock;              /* created by ParseInit() */
+}	atoms;
+
+static uint32_t AtomHash(DATA8 name, int len)
+{
+	uint32_t hash;
+	for (hash = 2166136261u; len > 0; hash = (hash ^ *name ++) * 16777619, len --);
+	return hash;
+}
+
+static Bool AtomGrow(void)
+{
+	int   capa = atoms.capa ? atoms.capa * 2 : 256;
+	int * slots = calloc(capa, sizeof *slots);
+	int   i, j;
+
+	if (slots == NULL) return False;
+	for (i = 0; i < atoms.count; i ++)
+	{
+		STRPTR name = AtomName(i);
+		for (j = AtomHash(name, strlen(name)) & (capa - 1); slots[j]; j = (j + 1) & (capa - 1));
+		slots[j] = i + 1;
+	}
+	free(atoms.slots);
+	atoms.slots = slots;
+	atoms.capa  = capa;
+	return True;
+}
+
+static int AtomAdd(DATA8 name, int len)
+{
+	AtomChunk chunk;
+	STRPTR    atom;
+	int       i, id;
+
+	if ((atoms.count + 1) * 4 > atoms.capa * 3 && ! AtomGrow())
+		return -1;
+
+	for (i = AtomHash(name, len) & (atoms.capa - 1); (id = atoms.slots[i]) > 0; i = (i + 1) & (atoms.capa - 1))
+	{
+		atom = AtomName(id - 1);
+		if (strncmp(atom, name, len) == 0 && atom[len] == 0)
+			return id - 1;
+	}
+
+	if (atoms.count % ATOM_PAGE == 0)
+	{
+		STRPTR * names = atoms.count < ATOM_MAX ? malloc(ATOM_PAGE * sizeof *names) : NULL;
+		if (names == NULL) return -1;
+		atoms.names[atoms.count / ATOM_PAGE] = names;
+	}
+	chunk = atoms.chunks;
+	if (chunk == NULL || chunk->used + len >= chunk->size)
+	{
+		int size = MAX(ATOM_CHUNK, len + 1);
+		chunk = malloc(sizeof *chunk + size);
+		if (chunk == NULL) return -1;
+		chunk->next = atoms.chunks;
+		chunk->used = 0;
+		chunk->size = size;
+		atoms.chunks = chunk;
+	}
+	atom = chunk->chars + chunk->used;
+	memcpy(atom, name, len);
+	atom[len] = 0;
+	chunk->used += len + 1;
+
+	atoms.slots[i] = atoms.count + 1;
+	atoms.names[atoms.count / ATOM_PAGE][atoms.count % ATOM_PAGE] = atom;
+	return atoms.count ++;
+}
+
+/* return index of atom <name> (which is <len> bytes long, not necessarily nul-terminated), -1 if out of memory */
+int AtomIntern(DATA8 name, int len)
+{
+	int atom;
+	/* no lock until expressions are evaluated by several threads */
+	if (atoms.lock) MutexEnter(atoms.lock);
+	atom = AtomAdd(name, len);
+	if (atoms.lock) MutexLeave(atoms.lock);
+	return atom;
+}
+
+STRPTR AtomName(int atom)
+{
+	return atoms.names[atom / ATOM_PAGE][atom % ATOM_PAGE];
+}
+
+/* escape sequences are processed in one pass, rewriting <src> in place: return its new length */
 static int UnescapeAntiSlash(DATA8 src)
 {
-	DATA8 token;
+	DATA8 token, dst;
 
-	for (token = src; *token; token ++)
+	for (token = dst = src; *token; token ++, dst ++)
 	{
-		if (*token != '\\') continue;
-		DATA8 overwrite = token + 2;
-		switch (token[1]) {
-		case 'a':  *token = '\a'; break;
-		case 'b':  *token = '\b'; break;
-		case 't':  *token = '\t'; break;
-		case 'n':  *token = '\n'; break;
-		case 'v':  *token = '\v'; break;
-		case 'f':  *token = '\f'; break;
-		case 'r':  *token = '\r'; break;
-		case 'x':  token += CP2UTF8(token, strtoul(token + 2, (char **) &overwrite, 16)) - 1; break;
-		default:   *token = token[1];
+		if (*token != '\\')
+		{
+			*dst = *token;
+			continue;
+		}
+		/* unterminated string ending with a backslash */
+		if (token[1] == 0) break;
+		switch (* ++ token) {
+		case 'a':  *dst = '\a'; break;
+		case 'b':  *dst = '\b'; break;
+		case 't':  *dst = '\t'; break;
+		case 'n':  *dst = '\n'; break;
+		case 'v':  *dst = '\v'; break;
+		case 'f':  *dst = '\f'; break;
+		case 'r':  *dst = '\r'; break;
+		case 'x':
+			{
+				/* UTF-8 encoding is never longer than the escape sequence */
+				int cp = strtoul(token + 1, (char **) &token, 16);
+				dst += CP2UTF8(dst, cp) - 1;
+				token --;
+			}
+			break;
+		default:   *dst = *token;
 		}
-		strcpy(token + 1, overwrite);
 	}
-	return token - src;
+	*dst = 0;
+	return dst - src;
 }
 
 static Stack NewNumber(DATA8 buffer, int type, ...)
@@ -278,7 +405,7 @@ static Stack NewNumber(DATA8 buffer, int type, ...)
 	case TYPE_STR:
 	case TYPE_IDF:
 		CopyString(num->value.string = (DATA8) (num + 1), str, len);
-		num->value.eval = type == TYPE_STR ? UnescapeAntiSlash(num->value.string) : len - 1;
+		num->value.eval = len - 1;
 	}
 	va_end(args);
 	return num;
@@ -422,38 +549,53 @@ static int GetNumber32(DATA8 buffer, Stack * object, DATA8 * exp, Bool neg)
 	return 1;
 }
 
-/* will point to GetNumber64 or GetNumber32 depending on <use64b> */
-static int (*GetNumber)(DATA8 buffer, Stack * object, DATA8 * exp, Bool neg);
+/* GetNumber64 or GetNumber32 depending on <use64b> */
+static int GetNumber(DATA8 buffer, Stack * object, DATA8 * exp, Bool neg)
+{
+	return appcfg.use64b ? GetNumber64(buffer, object, exp, neg) : GetNumber32(buffer, object, exp, neg);
+}
+
+static uint8_t chrClass[128];
+
+static void InitCharClass(void)
+{
+	int i;
+	for (i = 0; i < DIM(OperatorList); i ++)
+		chrClass[OperatorList[i].token[0]] = TOKEN_OPERATOR;
+
+	memset(chrClass + 'a', TOKEN_IDENT, 'z' - 'a' + 1);
+	memset(chrClass + 'A', TOKEN_IDENT, 'Z' - 'A' + 1);
+	memset(chrClass + '0', TOKEN_SCALAR, '9' - '0' + 1);
+	chrClass['_']  = TOKEN_IDENT;
+	chrClass['$']  = TOKEN_IDENT;
+	chrClass['(']  = TOKEN_INCPRI;
+	chrClass[')']  = TOKEN_DECPRI;
+	chrClass['[']  = TOKEN_ARRAYSTART;
+	chrClass[']']  = TOKEN_ARRAYEND;
+	chrClass['-']  = TOKEN_SCALAR;
+	chrClass['\''] = TOKEN_STRING;
+	chrClass['\"'] = TOKEN_STRING;
+	chrClass[0]    = TOKEN_END;
+}
+
+/* tables built on first use: must be called before ParseExpression() is used by several threads */
+void ParseInit(void)
+{
+	if (chrClass[0] == 0)
+		InitCharClass();
+	if (atoms.lock == NULL)
+		atoms.lock = MutexCreate();
+}
 
 /* our main lexical analyser, this should've been the lex part, if we ever used it */
 static int GetToken(DATA8 buffer, Stack * object, DATA8 * exp)
 {
-	static uint8_t chrClass[128];
-
 	DATA8 str;
 	int   type;
 
 	if (chrClass[0] == 0)
-	{
 		/* init on the fly */
-		int i;
-		for (i = 0; i < DIM(OperatorList); i ++)
-			chrClass[OperatorList[i].token[0]] = TOKEN_OPERATOR;
-
-		memset(chrClass + 'a', TOKEN_IDENT, 'z' - 'a' + 1);
-		memset(chrClass + 'A', TOKEN_IDENT, 'Z' - 'A' + 1);
-		memset(chrClass + '0', TOKEN_SCALAR, '9' - '0' + 1);
-		chrClass['_']  = TOKEN_IDENT;
-		chrClass['$']  = TOKEN_IDENT;
-		chrClass['(']  = TOKEN_INCPRI;
-		chrClass[')']  = TOKEN_DECPRI;
-		chrClass['[']  = TOKEN_ARRAYSTART;
-		chrClass[']']  = TOKEN_ARRAYEND;
-		chrClass['-']  = TOKEN_SCALAR;
-		chrClass['\''] = TOKEN_STRING;
-		chrClass['\"'] = TOKEN_STRING;
-		chrClass[0]    = TOKEN_END;
-	}
+		InitCharClass();
 
 	/* skip starting space */
 	for (str = *exp; isspace(*str); str ++);
@@ -465,12 +607,19 @@ static int GetToken(DATA8 buffer, Stack * object, DATA8 * exp)
 	case TOKEN_STRING:
 		{
 			uint8_t start = *str;
+			Bool    escape = False;
 
 			for (*exp = ++ str; *str && *str != start; str ++)
-				if (*str == '\\' && str[1]) str ++;
+				if (*str == '\\')
+				{
+					escape = True;
+					if (str[1]) str ++;
+				}
 
 			*object = NewNumber(buffer, TYPE_STR, *exp, (int) (str - *exp));
 			type    = TOKEN_SCALAR;
+			if (escape)
+				(*object)->value.eval = UnescapeAntiSlash((*object)->value.string);
 
 			if (*str) str ++;
 		}
@@ -478,8 +627,17 @@ static int GetToken(DATA8 buffer, Stack * object, DATA8 * exp)
 	case TOKEN_IDENT:
 		for (*exp = str ++; *str == '_' || isalnum(*str); str ++);
 
-		*object = NewNumber(buffer, TYPE_IDF, *exp, (int) (str - *exp));
-		type    = TOKEN_SCALAR;
+		/* name will not be copied in the pool */
+		type = AtomIntern(*exp, str - *exp);
+		if (type >= 0)
+		{
+			*object = MyCalloc(buffer, sizeof **object);
+			(*object)->value.type = TYPE_IDF;
+			(*object)->value.string = AtomName(type);
+			(*object)->value.eval = str - *exp;
+		}
+		else *object = NewNumber(buffer, TYPE_IDF, *exp, (int) (str - *exp));
+		type = TOKEN_SCALAR;
 		break;
 	case TOKEN_SCALAR:
 		if (GetNumber(buffer, object, &str, False))
@@ -550,26 +708,27 @@ Bool IsNull(Variant arg)
 	case TYPE_DBL:   return arg->real64 == 0;
 	case TYPE_FLOAT: return arg->real32 == 0.0f;
 	case TYPE_STR:   return arg->string[0] == 0;
-	case TYPE_ARRAY: return VAR_LENGTH(arg) == 0;
+	case TYPE_ARRAY:
+	case TYPE_VECTOR: return VAR_LENGTH(arg) == 0;
 	default:         return False;
 	}
 }
 
 /* make the type of arg1 and arg2 the same, based on "widest" type */
+static uint8_t typeWidth[] = {8, 4, 9, 5, 0, 0, 0, 0};
+
 static void Promote(Stack arg1, Stack arg2)
 {
-	static uint8_t sizes[] = {8, 4, 9, 5, 0, 0, 0, 0};
-
 	if (arg1->value.type >= TYPE_IDF || arg2->value.type >= TYPE_IDF)
 		/* only works with numbers */
 		return;
 
-	if (sizes[arg1->value.type] > sizes[arg2->value.type])
+	if (typeWidth[arg1->value.type] > typeWidth[arg2->value.type])
 	{
 		/* convert arg2 number to arg1 type */
 		;
 	}
-	else if (sizes[arg2->value.type] > sizes[arg1->value.type])
+	else if (typeWidth[arg2->value.type] > typeWidth[arg1->value.type])
 	{
 		/* convert arg1 number to arg2 type */
 		Stack tmp;
@@ -588,7 +747,8 @@ static void Promote(Stack arg1, Stack arg2)
 		}
 		break;
 	case TYPE_FLOAT:
-		/* can only be int32 at this point */
+		/* can only be int32 at this point, if it is a number */
+		if (arg2->value.type != TYPE_INT32) return;
 		arg2->value.real32 = arg2->value.int32;
 		break;
 	case TYPE_DBL:
@@ -619,6 +779,8 @@ int CompareString(Stack arg1, Stack arg2)
 {
 	TEXT number[32];
 	Bool invert = False;
+	if (arg1->value.type == TYPE_STR && arg2->value.type == TYPE_STR)
+		return strcmp(arg1->value.string, arg2->value.string);
 	if (arg2->value.type != TYPE_STR)
 	{
 		Stack arg3 = arg1; arg1 = arg2; arg2 = arg3;
@@ -639,18 +801,18 @@ static int MakeCall(DATA8 buffer, Stack * values, ParseExpCb cb, APTR data, Bool
 
 	if (val)
 	{
-		Variant list = alloca(MAX(nb, 1) * sizeof *val);
-		if (nb == 0)
-		{
-			/* no arg provided for this function, but alloc one slot for result */
-			memset(list, 0, sizeof *list);
-		}
-		/* convert all arguments to scalars */
+		/* extra slot after arguments: call site (and result slot if there are no args) */
+		Variant list = alloca((nb + 1) * sizeof *list);
+		memset(list + nb, 0, sizeof *list);
+		list[nb].type = TYPE_FUN;
+		if (val->value.eval > 0)
+			/* resolved program will be cached in the bytecode, right after the function name */
+			list[nb].ope = val->value.string + val->value.eval;
+		/* convert all arguments to scalars: stack keeps ownership, callee only borrows them */
 		for (val = *values, i = nb-1; val && val->value.type != TYPE_FUN; val = val->next, i --)
 		{
+			AffectArg(val, cb, data);
 			list[i] = val->value;
-			if (val->value.type == TYPE_IDF)
-				cb(val->value.string, list + i, 0, data);
 		}
 		if (eval)
 		{
@@ -685,10 +847,158 @@ static Bool IsConstant(Variant v)
 	return False;
 }
 
+/* widest of two number types: same rule as Promote() */
+int WidestType(int type1, int type2)
+{
+	return typeWidth[type2] > typeWidth[type1] ? type2 : type1;
+}
+
+/* widest number type of <v> or its items, -1 if not a number */
+int NumberType(Variant v)
+{
+	int i, type;
+
+	switch (v->type) {
+	case TYPE_VECTOR:
+		if (VAR_ITEMTYPE(v) != TYPE_BOXED)
+			return VAR_ITEMTYPE(v);
+		return vecBoxedType(v->vector, VAR_LENGTH(v));
+	case TYPE_ARRAY:
+		for (i = VAR_LENGTH(v) - 1, type = TYPE_INT32; i >= 0; i --)
+		{
+			if (v->array[i].type > TYPE_FLOAT) return -1;
+			type = WidestType(type, v->array[i].type);
+		}
+		return type;
+	default:
+		return v->type <= TYPE_FLOAT ? v->type : -1;
+	}
+}
+
+/* change <v> into a vector of <type> items, that will be owned by <v> */
+Bool VectorConvert(Variant v, int type)
+{
+	VariantBuf conv;
+	int        i, count = VAR_LENGTH(v);
+
+	if (v->type == TYPE_VECTOR && VAR_ITEMTYPE(v) == type)
+		return True;
+	if (! VectorAlloc(&conv, type, count))
+		return False;
+	if (v->type == TYPE_VECTOR)
+		vecConvert(conv.vector, type, v->vector, VAR_ITEMTYPE(v), count);
+	else for (i = 0; i < count; i ++)
+		VectorSet(&conv, i, v->array + i);
+	VarRelease(v);
+	*v = conv;
+	return True;
+}
+
+/* element-wise * / + - on arrays: a scalar operand is applied to all items, result is stored in <arg1> */
+static int MakeOpVector(int nb, Variant arg1, Variant arg2)
+{
+	static uint8_t ops[] = {VEC_MUL, VEC_DIV, 0, VEC_ADD, VEC_SUB};
+	union {
+		int64_t int64;
+		double  real64;
+	}          num1, num2;
+	VariantBuf res;
+	APTR       src1, src2;
+	int        type1, type2, count, scalar;
+
+	type1 = NumberType(arg1);
+	type2 = NumberType(arg2);
+	if (type1 < 0 || type2 < 0)
+		return PERR_InvalidOperation;
+	type1 = WidestType(type1, type2);
+
+	/* scalar is converted into a one item vector */
+	res.type = TYPE_VECTOR;
+	res.lengthFree = 1 | VAR_SETITEM(type1);
+	if (arg1->type <= TYPE_FLOAT)
+	{
+		res.vector = src1 = &num1;
+		VectorSet(&res, 0, arg1);
+		scalar = VEC_SCALAR1;
+	}
+	else if (! VectorConvert(arg1, type1)) return PERR_NoMem;
+	else src1 = arg1->vector;
+
+	if (arg2->type <= TYPE_FLOAT)
+	{
+		res.vector = src2 = &num2;
+		VectorSet(&res, 0, arg2);
+		scalar = VEC_SCALAR2;
+	}
+	else if (! VectorConvert(arg2, type1)) return PERR_NoMem;
+	else src2 = arg2->vector;
+
+	if (src1 != &num1 && src2 != &num2)
+	{
+		if (VAR_LENGTH(arg1) != VAR_LENGTH(arg2))
+			return PERR_InvalidOperation;
+		scalar = VEC_BOTH;
+	}
+	count = VAR_LENGTH(scalar == VEC_SCALAR1 ? arg2 : arg1);
+
+	if (nb == 6 && vecHasZero(src2, type1, scalar == VEC_SCALAR2 ? 1 : count))
+		return PERR_DivisionByZero;
+
+	/* reuse memory of temporary arrays: not if it is shared with a variable (copy on write) */
+	if (scalar != VEC_SCALAR1 && VarUnique(arg1))
+	{
+		res = *arg1;
+	}
+	else if (scalar != VEC_SCALAR2 && VarUnique(arg2))
+	{
+		res = *arg2;
+		VAR_BORROW(arg2);
+	}
+	else if (! VectorAlloc(&res, type1, count))
+	{
+		return PERR_NoMem;
+	}
+	vecOp(ops[nb - 5], type1, res.vector, src1, src2, count, scalar);
+
+	if (scalar != VEC_SCALAR1 && arg1->vector != res.vector)
+		VarRelease(arg1);
+	*arg1 = res;
+	return 0;
+}
+
 /*
  * This is the function that takes operand and perform operation according to top most operator
  * This is the syntax analyser, usually produced by tools like yacc
  */
+/* result of string operators: short strings are allocated in the pool, longer ones are refcounted */
+static Stack NewString(DATA8 buffer, int length)
+{
+	Stack str;
+	if (length > VAR_MAXLENGTH)
+		return NULL;
+	if (length < SZ_SHORTSTR)
+	{
+		str = MyCalloc(buffer, sizeof *str + length + 1);
+		if (str == NULL) return NULL;
+		str->value.string = (STRPTR) (str + 1);
+	}
+	else
+	{
+		str = MyCalloc(buffer, sizeof *str);
+		if (str == NULL) return NULL;
+		str->value.string = RefAlloc(length + 1);
+		if (str->value.string == NULL)
+		{
+			MyFree(buffer, str);
+			return NULL;
+		}
+		VAR_SETREF(&str->value);
+	}
+	str->value.type = TYPE_STR;
+	str->value.lengthFree |= length;
+	return str;
+}
+
 static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APTR data)
 {
 	Stack    arg1, arg2, arg3;
@@ -731,8 +1041,10 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 			if (arg2) argv[2] = arg2->value;
 			if (arg3) argv[3] = arg3->value;
 			cb(NULL, argv, ope->arity, data);
-			/* dummy value to stop folding inner expression */
-			arg1->value.type = TYPE_OPE;
+			/* folded operand has been copied in the byte code */
+			VarRelease(&arg1->value);
+			/* dummy value to stop folding inner expression (and where its byte code starts) */
+			arg1->value = argv[0];
 			PushStack(values, arg1);
 			arg1 = NULL;
 			THROW(0);
@@ -773,6 +1085,16 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 		Promote(arg1, arg2);
 	}
 
+	if (5 <= nb && nb <= 9 && nb != 7 && (arg1->value.type == TYPE_ARRAY || arg1->value.type == TYPE_VECTOR ||
+	                                      arg2->value.type == TYPE_ARRAY || arg2->value.type == TYPE_VECTOR))
+	{
+		error = MakeOpVector(nb, &arg1->value, &arg2->value);
+		if (error) THROW(error);
+		MyFree(buffer, arg2);
+		PushStack(values, arg1);
+		return 0;
+	}
+
 	switch (nb) {
 	case 0: /* unary - */
 		AffectArg(arg1, cb, data);
@@ -847,12 +1169,11 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 				THROW(PERR_InvalidOperation);
 
 			len = strlen(arg2->value.string);
-			arg3 = MyCalloc(buffer, sizeof *arg3 + len * mult + 1);
+			arg3 = NewString(buffer, len * mult);
 			if (arg3 == NULL) THROW(PERR_NoMem);
 
-			arg3->value.type = TYPE_STR;
-			for (arg3->value.string = mem = (DATA8) (arg3 + 1); mult > 0; mult --, mem += len)
-				strcpy(mem, arg2->value.string);
+			for (mem = arg3->value.string; mult > 0; mult --, mem += len)
+				memcpy(mem, arg2->value.string, len);
 			MyFree(buffer, arg1);
 			MyFree(buffer, arg2);
 			PushStack(values, arg3);
@@ -886,20 +1207,21 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 		if (arg1->value.type == TYPE_STR || arg2->value.type == TYPE_STR)
 		{
 			/* string concatenation instead */
-			TEXT number[32];
-			Bool invert = False;
-
-			if (arg2->value.type != TYPE_STR)
-				arg3 = arg1, arg1 = arg2, arg2 = arg3, invert = True;
-			if (arg1->value.type != TYPE_STR)
-				ToString(&arg1->value, number, sizeof number), arg1->value.string = number;
-
-			arg3 = MyCalloc(buffer, sizeof *arg3 + strlen(arg1->value.string) + strlen(arg2->value.string) + 1);
+			TEXT   number[32];
+			STRPTR str1, str2;
+			int    len1, len2;
+
+			str1 = arg1->value.string;
+			str2 = arg2->value.string;
+			if (arg1->value.type != TYPE_STR) ToString(&arg1->value, str1 = number, sizeof number);
+			if (arg2->value.type != TYPE_STR) ToString(&arg2->value, str2 = number, sizeof number);
+			len1 = strlen(str1);
+			len2 = strlen(str2);
+
+			arg3 = NewString(buffer, len1 + len2);
 			if (arg3 == NULL) THROW(PERR_NoMem);
-			arg3->value.type = TYPE_STR;
-			arg3->value.string = (DATA8) (arg3 + 1);
-			if (invert) sprintf(arg3->value.string, "%s%s", arg2->value.string, arg1->value.string);
-			else        sprintf(arg3->value.string, "%s%s", arg1->value.string, arg2->value.string);
+			memcpy(arg3->value.string, str1, len1);
+			memcpy(arg3->value.string + len1, str2, len2);
 			MyFree(buffer, arg1);
 			MyFree(buffer, arg2);
 			PushStack(values, arg3);
@@ -1043,7 +1365,7 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 		PushStack(values, arg3);
 		PushStack(values, arg2);
 		/* first push is assignment, second push is operator */
-		PushStack(oper, NewOperator(buffer, OperatorList + 25));
+		PushStack(oper, NewOperator(buffer, assign));
 		PushStack(oper, NewOperator(buffer, OperatorList + nb - (nb < 24 ? -5 : nb < 31 ? 21 : 15)));
 		MakeOp(buffer, values, oper, cb, data);
 		error = MakeOp(buffer, values, oper, cb, data);
@@ -1057,41 +1379,360 @@ static int MakeOp(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb, APT
 	return error;
 }
 
-static Variant MakeArray(Stack * values, int count, STRPTR buffer, ParseExpCb cb, APTR data)
+/*
+ * strings, arrays and vectors that outlive an expression are stored in blocks prefixed by a reference
+ * count: assigning or passing them around only increments the count. A Variant with VAR_HASREF set owns
+ * one reference; a block shared by several owners must be copied before being modified.
+ */
+typedef struct RefBlock_t *      RefBlock;
+
+struct RefBlock_t
 {
-	Stack value;
-	int   i, extra;
-	for (i = count - 1, extra = 0, value = *values; value && i >= 0; value = value->next, i --)
+	int refs;                    /* changed atomically: blocks can be shared by several threads */
+	int size;                    /* bytes available for content: strings can be appended in place */
+	union {
+		int *   index;           /* strings: built on first s[i], see StrOffset() */
+		int64_t align;           /* keep content 8 bytes aligned */
+	};
+};
+
+#define REFBLOCK(mem)            ((RefBlock) (mem) - 1)
+
+APTR RefAlloc(int size)
+{
+	RefBlock block = calloc(sizeof *block + size, 1);
+	if (block == NULL)
+		return NULL;
+	block->refs = 1;
+	block->size = size;
+	return block + 1;
+}
+
+static Bool VarIsRef(Variant v)
+{
+	return (v->type == TYPE_STR || v->type == TYPE_ARRAY || v->type == TYPE_VECTOR) && VAR_HASREF(v);
+}
+
+void VarRetain(Variant v)
+{
+	if (VarIsRef(v))
+		__sync_fetch_and_add(&REFBLOCK(v->string)->refs, 1);
+}
+
+void VarRelease(Variant v)
+{
+	if (VarIsRef(v))
+	{
+		RefBlock block = REFBLOCK(v->string);
+		if (__sync_sub_and_fetch(&block->refs, 1) == 0)
+		{
+			if (v->type == TYPE_ARRAY)
+			{
+				Variant item;
+				int     i;
+				for (i = VAR_LENGTH(v), item = v->array; i > 0; VarRelease(item), i --, item ++);
+			}
+			free(block->index);
+			free(block);
+		}
+		VAR_BORROW(v);
+	}
+}
+
+/* can content be modified in place */
+Bool VarUnique(Variant v)
+{
+	return VarIsRef(v) && REFBLOCK(v->string)->refs == 1;
+}
+
+/*
+ * append <len> bytes of <str> to string <v> (that must be refcounted or borrowed, with a valid length): in
+ * place if not shared and there is enough room, otherwise content is moved in a block twice as big.
+ */
+Bool VarAppend(Variant v, STRPTR str, int len)
+{
+	int length = VAR_LENGTH(v), need = length + len + 1;
+
+	if (need > VAR_MAXLENGTH)
+		return False;
+
+	if (! VarUnique(v) || REFBLOCK(v->string)->size < need)
+	{
+		STRPTR mem = RefAlloc(need * 2);
+		if (mem == NULL) return False;
+		memcpy(mem, v->string, length);
+		memcpy(mem + length, str, len);
+		/* <str> can be part of <v> */
+		VarRelease(v);
+		v->string = mem;
+	}
+	else
+	{
+		/* character index is not valid anymore */
+		RefBlock block = REFBLOCK(v->string);
+		free(block->index);
+		block->index = NULL;
+		memcpy(v->string + length, str, len);
+	}
+	v->string[length + len] = 0;
+	v->lengthFree = length + len;
+	VAR_SETREF(v);
+	return True;
+}
+
+/* <dst> will own a reference to the content of <src>: shared if refcounted, duplicated otherwise */
+Bool VarCopy(Variant dst, Variant src)
+{
+	Variant item;
+	DATA8   mem;
+	int     i, size;
+
+	*dst = *src;
+	switch (src->type) {
+	case TYPE_STR:    size = strlen(src->string) + 1; break;
+	case TYPE_VECTOR: size = VAR_LENGTH(src) * VAR_ITEMSIZE(src); break;
+	case TYPE_ARRAY:
+		/* strings are stored after the items */
+		for (i = VAR_LENGTH(src), size = i * sizeof *item, item = src->array; i > 0; i --, item ++)
+			if (item->type == TYPE_STR && ! VAR_HASREF(item)) size += strlen(item->string) + 1;
+		break;
+	default: return True;
+	}
+	if (VAR_HASREF(src))
+	{
+		__sync_fetch_and_add(&REFBLOCK(src->string)->refs, 1);
+		return True;
+	}
+	mem = RefAlloc(size);
+	if (mem == NULL)
+	{
+		dst->type = TYPE_ERR;
+		dst->int32 = PERR_NoMem;
+		return False;
+	}
+	VAR_BORROW(dst);
+	VAR_SETREF(dst);
+	dst->string = (STRPTR) mem;
+	if (src->type == TYPE_STR)
+	{
+		dst->lengthFree = (size - 1) | VAR_HASREF(dst);
+		memcpy(mem, src->string, size);
+	}
+	else if (src->type == TYPE_VECTOR)
+	{
+		memcpy(mem, src->vector, size);
+	}
+	else for (i = VAR_LENGTH(src), mem += i * sizeof *item, item = dst->array, src = src->array; i > 0; i --, item ++, src ++)
+	{
+		*item = *src;
+		if (src->type == TYPE_STR && ! VAR_HASREF(src))
+		{
+			size = strlen(src->string) + 1;
+			item->string = memcpy(mem, src->string, size);
+			mem += size;
+		}
+		else VarCopy(item, src);
+	}
+	return True;
+}
+
+/*
+ * typed arrays: numbers are stored unboxed, type of items is in the top bits of lengthFree. Like Variant
+ * arrays, memory is refcounted (see RefAlloc).
+ */
+Bool VectorAlloc(Variant v, int type, int count)
+{
+	v->type = TYPE_VECTOR;
+	v->lengthFree = count | VAR_SETITEM(type);
+	v->vector = RefAlloc(count * (type & 1 ? 4 : 8));
+	if (v->vector == NULL)
+		return False;
+	VAR_SETREF(v);
+	return True;
+}
+
+void VectorGet(Variant v, int index, Variant item)
+{
+	memset(item, 0, sizeof *item);
+	item->type = VAR_ITEMTYPE(v);
+	switch (item->type) {
+	case TYPE_INT:   item->int64  = ((int64_t *) v->vector)[index]; break;
+	case TYPE_INT32: item->int32  = ((int *)     v->vector)[index]; break;
+	case TYPE_DBL:   item->real64 = ((double *)  v->vector)[index]; break;
+	case TYPE_FLOAT: item->real32 = ((float *)   v->vector)[index]; break;
+	case TYPE_BOXED: vecUnbox(((uint64_t *) v->vector)[index], item); break;
+	default:         break;
+	}
+}
+
+/* <item> is converted to the type of the vector */
+void VectorSet(Variant v, int index, Variant item)
+{
+	int64_t num;
+	double  real;
+
+	if (VAR_ITEMTYPE(v) == TYPE_BOXED && vecBox(item, (uint64_t *) v->vector + index))
+		return;
+
+	switch (item->type) {
+	case TYPE_INT:   real = num = item->int64; break;
+	case TYPE_INT32: real = num = item->int32; break;
+	case TYPE_DBL:   num = real = item->real64; break;
+	case TYPE_FLOAT: num = real = item->real32; break;
+	case TYPE_STR:   num = strtoll(item->string, NULL, 10); real = strtod(item->string, NULL); break;
+	default:         num = real = 0;
+	}
+	switch (VAR_ITEMTYPE(v)) {
+	case TYPE_INT:   ((int64_t *) v->vector)[index] = num; break;
+	case TYPE_INT32: ((int *)     v->vector)[index] = num; break;
+	case TYPE_DBL:   ((double *)  v->vector)[index] = real; break;
+	case TYPE_FLOAT: ((float *)   v->vector)[index] = real; break;
+	case TYPE_BOXED:
+		/* item could not be boxed with its type (caller should have checked): store it as a double */
+		{
+			VariantBuf dbl = {.type = TYPE_DBL, .real64 = real};
+			vecBox(&dbl, (uint64_t *) v->vector + index);
+		}
+	}
+}
+
+/*
+ * s[i] on UTF-8 strings: long strings are refcounted (see SZ_SHORTSTR) and have an index built on first
+ * access, that stores the number of characters, if the string is pure ASCII and otherwise, the byte offset
+ * of every STR_STEP characters. Short strings are simply scanned.
+ */
+#define STR_STEP                 64
+#define NEXTCHAR(str)            (str + utf8Next[*(str) >> 4])
+static uint8_t utf8Next[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
+
+static int * StrMakeIndex(DATA8 str)
+{
+	DATA8 p, eof;
+	int * index;
+	int   count, ascii;
+
+	for (p = str, ascii = 1; *p; p ++)
+		if (*p >= 0x80) ascii = 0;
+	eof = p;
+	if (ascii)
+		count = eof - str;
+	else
+		for (p = str, count = 0; p < eof; p = NEXTCHAR(p), count ++);
+
+	index = malloc((ascii ? 2 : 2 + (count + STR_STEP - 1) / STR_STEP) * sizeof *index);
+	if (index == NULL) return NULL;
+	index[0] = count;
+	index[1] = ascii;
+	if (! ascii)
+	{
+		int * offset;
+		for (p = str, count = 0, offset = index + 2; p < eof; p = NEXTCHAR(p), count ++)
+			if (count % STR_STEP == 0) *offset ++ = p - str;
+	}
+	return index;
+}
+
+/* byte offset of character <index> in string <v>, -1 if out of range */
+static int StrOffset(Variant v, int index)
+{
+	DATA8 p, str = v->string;
+
+	if (VAR_HASREF(v))
+	{
+		RefBlock block = REFBLOCK(str);
+		int *    chars = block->index;
+		if (chars == NULL && (chars = StrMakeIndex(str)) && ! __sync_bool_compare_and_swap(&block->index, NULL, chars))
+		{
+			/* string shared with another thread that has built it first */
+			free(chars);
+			chars = block->index;
+		}
+		if (chars)
+		{
+			if (index >= chars[0]) return -1;
+			if (chars[1]) return index;
+			p = str + chars[2 + index / STR_STEP];
+			for (index %= STR_STEP; index > 0; p = NEXTCHAR(p), index --);
+			return p - str;
+		}
+	}
+	for (p = str; *p && index > 0; p = NEXTCHAR(p), index --);
+	return *p ? p - str : -1;
+}
+
+/*
+ * array literal: items that are all numbers (and without unit) will be stored in a vector, NaN-boxed if they
+ * are not all of the same type.
+ */
+static Bool MakeArray(Stack * values, int count, Variant array, DATA8 buffer, ParseExpCb cb, APTR data)
+{
+	Stack    value;
+	uint64_t box;
+	int      i, extra, type, boxed;
+	for (i = count - 1, extra = 0, type = -1, boxed = 1, value = *values; value && i >= 0; value = value->next, i --)
 	{
 		if (value->value.type == TYPE_IDF)
 			AffectArg(value, cb, data);
 		if (value->value.type == TYPE_STR)
 			/* string content will be duplicated along the array */
-			extra += VAR_LENGTH(&value->value) + 1;
+			extra += strlen(value->value.string) + 1;
+		if (value->value.type > TYPE_FLOAT || value->value.unit)
+			type = TYPE_ARRAY;
+		else if (type < 0)
+			type = value->value.type;
+		else if (type != value->value.type && type != TYPE_ARRAY)
+			type = TYPE_BOXED;
+		if (value->value.type <= TYPE_FLOAT && ! vecBox(&value->value, &box))
+			boxed = 0;
 	}
-	if (i < 0)
-	{
-		Variant array = malloc(sizeof *array * count + extra);
-		DATA8   strbuf = (DATA8) (array + count);
+	/* not good: not enough values */
+	if (i >= 0) return False;
+	/* integers too wide for a box: keep their exact value in a Variant */
+	if (type == TYPE_BOXED && ! boxed)
+		type = TYPE_ARRAY;
 
+	if (type != TYPE_ARRAY)
+	{
+		if (! VectorAlloc(array, type, count))
+			return False;
 		for (count --; count >= 0; count --)
 		{
 			value = PopStack(values);
-			array[count] = value->value;
-			if (value->value.type == TYPE_STR)
+			VectorSet(array, count, &value->value);
+			MyFree(buffer, value);
+		}
+	}
+	else
+	{
+		DATA8 strbuf;
+		array->array = RefAlloc(sizeof *array * count + extra);
+		if (array->array == NULL)
+			return False;
+		array->type = TYPE_ARRAY;
+		array->lengthFree = count;
+		VAR_SETREF(array);
+
+		for (strbuf = (DATA8) (array->array + count), count --; count >= 0; count --)
+		{
+			Variant item = array->array + count;
+			value = PopStack(values);
+			*item = value->value;
+			if (item->type == TYPE_STR)
 			{
-				i = VAR_LENGTH(&value->value) + 1;
-				memcpy(strbuf, value->value.string, i);
+				i = strlen(item->string) + 1;
+				item->string = memcpy(strbuf, item->string, i);
+				item->lengthFree = i - 1;
 				strbuf += i;
 			}
-			if (value->value.type == TYPE_ARRAY)
-				/* take ownership of the array content */
-				value->value.lengthFree &= 0x0fffffff;
+			else if (item->type == TYPE_ARRAY || item->type == TYPE_VECTOR)
+			{
+				/* nested arrays are shared */
+				VarCopy(item, &value->value);
+			}
 			MyFree(buffer, value);
 		}
-		return array;
 	}
-	else return NULL; /* not good: not enough values */
+	return True;
 }
 
 /* arrays behave differently from scalar */
@@ -1107,13 +1748,35 @@ static int MakeOpArray(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb
 		int   count = VAR_LENGTH(&ope->value);
 		Stack array = MyCalloc(buffer, sizeof *array);
 
-		/* memory for array must be malloced: it can be resized */
-		array->value.array = MakeArray(values, count, buffer, cb, data);
-		array->value.type = TYPE_ARRAY;
-		array->value.lengthFree = ope->value.lengthFree; /* item count actually */
-		VAR_SETFREE(&array->value);
+		/* nested arrays: next ']' is for the enclosing operator */
+		*oper = ope->next;
+		MyFree(buffer, ope);
 
-		if (array->value.array)
+		if (cb == ByteCodeGenExpr)
+		{
+			/* array will be built at run time: items are added to the byte code before the constructor */
+			Variant argv = alloca((count + 1) * sizeof *argv);
+			Stack   list, value;
+			int     i;
+			for (i = count, list = NULL; i > 0 && (value = PopStack(values)); i --)
+				argv[i] = value->value, PushStack(&list, value);
+			if (i == 0 && count < 65536)
+			{
+				argv[0].type = TYPE_OPE;
+				argv[0].ope  = arrayStart;
+				ByteCodeGenExpr(NULL, argv, count, data);
+				array->value = argv[0];
+				PushStack(values, array);
+				array = NULL;
+			}
+			while (list) MyFree(buffer, PopStack(&list));
+			if (array == NULL) return 0;
+			MyFree(buffer, array);
+			return PERR_MissingOperand;
+		}
+
+		/* memory for array must be malloced: it can be resized */
+		if (MakeArray(values, count, &array->value, buffer, cb, data))
 		{
 			PushStack(values, array);
 			return 0;
@@ -1135,39 +1798,53 @@ static int MakeOpArray(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb
 		/* convert index to integer */
 		int index;
 
-		if (value->value.type == TYPE_IDF)
+		if (cb != ByteCodeGenExpr)
 			AffectArg(value, cb, data);
-
-		switch (value->value.type) {
-		case TYPE_INT:   index = value->value.int64; break;
-		case TYPE_INT32: index = value->value.int32; break;
-		case TYPE_DBL:   index = value->value.real64; break;
-		case TYPE_FLOAT: index = value->value.real32; break;
-		default:         index = -1; /* number and nothing else */
+		/* byte code: index will be evaluated at run time if it is not constant */
+		if (cb != ByteCodeGenExpr || IsConstant(&value->value))
+		{
+			switch (value->value.type) {
+			case TYPE_INT:   index = value->value.int64; break;
+			case TYPE_INT32: index = value->value.int32; break;
+			case TYPE_DBL:   index = value->value.real64; break;
+			case TYPE_FLOAT: index = value->value.real32; break;
+			default:         index = -1; /* number and nothing else */
+			}
+			VarRelease(&value->value);
+			value->value.type  = TYPE_INT32;
+			value->value.int32 = index;
 		}
-		MyFree(buffer, value);
-		value = PopStack(values);
-		if (cb == ByteCodeGenExpr && value->value.type == TYPE_IDF)
+		Stack array = PopStack(values);
+		if (array == NULL)
+		{
+			MyFree(buffer, value);
+			return PERR_MissingOperand;
+		}
+		if (cb == ByteCodeGenExpr && (array->value.type == TYPE_IDF || array->value.type == TYPE_OPE || value->value.type != TYPE_INT32))
 		{
 			/* need to generate byte code for this, not do the dereference operation (unless the expression is constant) */
 			VariantBuf argv[3];
 			argv[0].type = TYPE_OPE;
 			argv[0].ope  = arrayEnd;
-			argv[1] = value->value;
-			argv[2].type = TYPE_INT32;
-			argv[2].int32 = index;
+			argv[1] = array->value;
+			argv[2] = value->value;
 			ByteCodeGenExpr(NULL, argv, 2, data);
+			MyFree(buffer, value);
 
 			/* push a dummy value */
-			MyFree(buffer, value);
-			value = NewNumber(buffer, TYPE_INT32, 0);
-			value->value.type = TYPE_OPE;
-			PushStack(values, value);
+			VarRelease(&array->value);
+			array->value = argv[0];
+			PushStack(values, array);
 			return 0;
 		}
+		index = value->value.int32;
+		MyFree(buffer, value);
+		value = array;
 		if (value->value.type == TYPE_IDF)
 			AffectArg(value, cb, data);
 
+		/* <value> is released whatever happens: item is copied out first */
+		int error = PERR_IndexOutOfRange;
 		if (value->value.type == TYPE_ARRAY)
 		{
 			int count = VAR_LENGTH(&value->value);
@@ -1176,35 +1853,42 @@ static int MakeOpArray(DATA8 buffer, Stack * values, Stack * oper, ParseExpCb cb
 			{
 				Variant item = value->value.array + index;
 				Stack arrayItem = MyCalloc(buffer, sizeof *value);
-				arrayItem->value = *item;
+				/* array can be freed before the item */
+				if (VarCopy(&arrayItem->value, item))
+					PushStack(values, arrayItem), error = 0;
+				else
+					MyFree(buffer, arrayItem), error = PERR_NoMem;
+			}
+		}
+		else if (value->value.type == TYPE_VECTOR)
+		{
+			if (0 <= index && index < VAR_LENGTH(&value->value))
+			{
+				Stack arrayItem = MyCalloc(buffer, sizeof *value);
+				VectorGet(&value->value, index, &arrayItem->value);
 				PushStack(values, arrayItem);
-				MyFree(buffer, value);
-				return 0;
+				error = 0;
 			}
-			else return PERR_IndexOutOfRange;
 		}
 		else if (value->value.type == TYPE_STR)
 		{
 			/* allow indexing individual characters */
-			if (index >= 0)
+			if (index >= 0 && (index = StrOffset(&value->value, index)) >= 0)
 			{
-				#define NEXTCHAR(str)    (str + utf8Next[*(str) >> 4])
-				static uint8_t utf8Next[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
-				DATA8 p;
-				for (p = value->value.string; *p && index > 0; p = NEXTCHAR(p), index --);
-				if (*p == 0) return PERR_IndexOutOfRange;
-				Stack chr = MyCalloc(buffer, sizeof *chr + utf8Next[*p >> 4] + 1);
+				DATA8 p = value->value.string + index;
+				int   len = utf8Next[*p >> 4];
+				Stack chr = MyCalloc(buffer, sizeof *chr + len + 1);
 				chr->value.type = TYPE_STR;
-				chr->value.lengthFree = 1;
+				chr->value.lengthFree = len;
 				chr->value.string = (STRPTR) (chr + 1);
-				CopyString(chr->value.string, p, utf8Next[*p >> 4] + 1);
-				MyFree(buffer, value);
+				CopyString(chr->value.string, p, len + 1);
 				PushStack(values, chr);
-				#undef NEXTCHAR
-				return 0;
+				error = 0;
 			}
-			else return PERR_IndexOutOfRange;
 		}
+		else error = PERR_InvalidOperation;
+		MyFree(buffer, value);
+		return error;
 	}
 	return PERR_InvalidOperation;
 }
@@ -1225,8 +1909,6 @@ int ParseExpression(DATA8 exp, ParseExpCb cb, APTR data)
 	buffer[2] = 0;
 	buffer[3] = 0;
 
-	GetNumber = appcfg.use64b ? GetNumber64 : GetNumber32;
-
 	for (curpri = error = tok = 0, values = oper = NULL, next = exp; error == 0 && *exp && *exp != ';'; exp = next)
 	{
 		switch (GetToken(buffer, &object, &next)) {
@@ -1250,7 +1932,9 @@ int ParseExpression(DATA8 exp, ParseExpCb cb, APTR data)
 			if (curpri < 0) THROW(PERR_TooManyClosingParens);
 			break;
 		case TOKEN_ARRAYSTART:
-			if (values && (values->value.type == TYPE_IDF || values->value.type == TYPE_ARRAY || values->value.type == TYPE_STR))
+			/* after an operator, it can only be an array constructor (TYPE_OPE: result of byte code, like a[i] or f(x)) */
+			if (tok == TOKEN_SCALAR && values && (values->value.type == TYPE_IDF || values->value.type == TYPE_ARRAY || values->value.type == TYPE_VECTOR ||
+			    values->value.type == TYPE_STR || values->value.type == TYPE_OPE))
 				/* dereference */
 				ope = arrayEnd;
 			else
@@ -1275,6 +1959,7 @@ int ParseExpression(DATA8 exp, ParseExpCb cb, APTR data)
 				{
 					object = NewOperator(buffer, &functionCall);
 					values->value.type = TYPE_FUN; /* function instead */
+					values->value.eval = 0; /* no call site cache */
 					// no break
 				}
 				else THROW(PERR_SyntaxError);
@@ -1374,6 +2059,7 @@ int ParseExpression(DATA8 exp, ParseExpCb cb, APTR data)
 		cb(NULL, &v, 0, data);
 		if (*exp == ';')
 		{
+			while (values) MyFree(buffer, PopStack(&values));
 			exp ++;
 			goto restart;
 		}
@@ -1405,13 +2091,27 @@ void ByteCodeAddVariant(ByteCode bc, Variant v)
 {
 	APTR arg;
 	int  size;
+	/* only the value of numbers is kept */
+	if (v->type <= TYPE_FLOAT && v->unit) bc->units ++;
 	switch (v->type) {
 	case TYPE_INT:    arg = &v->int64;  size = 8; break;
 	case TYPE_INT32:  arg = &v->int32;  size = 4; break;
 	case TYPE_DBL:    arg = &v->real64; size = 8; break;
 	case TYPE_FLOAT:  arg = &v->real32; size = 4; break;
-	case TYPE_STR:
-	case TYPE_IDF:    arg = v->string;  size = strlen(v->string)+1; break;
+	case TYPE_STR:    arg = v->string;  size = strlen(v->string)+1; break;
+	case TYPE_IDF:
+		size = strlen(v->string);
+		int atom = AtomIntern(v->string, size);
+		if (0 <= atom && atom < 65536)
+		{
+			DATA8 mem = ByteCodeAdd(bc, 3);
+			mem[0] = BC_ATOM;
+			mem[1] = atom >> 8;
+			mem[2] = atom & 0xff;
+			return;
+		}
+		arg = v->string; size ++;
+		break;
 	default: return;
 	}
 	size += 3;
@@ -1422,6 +2122,46 @@ void ByteCodeAddVariant(ByteCode bc, Variant v)
 	memcpy(mem+3, arg, size-3);
 }
 
+/* insert variant <v> at offset <pos>, return number of bytes added */
+static int ByteCodeInsertVariant(ByteCode bc, int pos, Variant v)
+{
+	int old = bc->size, len;
+	ByteCodeAddVariant(bc, v);
+	len = bc->size - old;
+	if (len > 0 && pos < old)
+	{
+		DATA8 tmp = alloca(len);
+		memcpy(tmp, bc->code + old, len);
+		memmove(bc->code + pos + len, bc->code + pos, old - pos);
+		memcpy(bc->code + pos, tmp, len);
+	}
+	return len;
+}
+
+/*
+ * sub-expressions (TYPE_OPE) are already in the byte code, .int32 being their start offset: scalars and
+ * identifiers must be inserted before the sub-expressions that follow them. Return start of first operand.
+ */
+static int ByteCodeAddOperands(ByteCode bc, Variant argv, int count)
+{
+	int i, j, pos, len, start = -1;
+	for (i = 0; i < count; i ++)
+	{
+		if (argv[i].type == TYPE_OPE)
+		{
+			if (start < 0) start = argv[i].int32;
+			continue;
+		}
+		for (j = i + 1; j < count && argv[j].type != TYPE_OPE; j ++);
+		pos = j < count ? argv[j].int32 : bc->size;
+		len = ByteCodeInsertVariant(bc, pos, argv + i);
+		if (start < 0) start = pos;
+		for (; j < count; j ++)
+			if (argv[j].type == TYPE_OPE) argv[j].int32 += len;
+	}
+	return start < 0 ? bc->size : start;
+}
+
 /* generate byte code from expression */
 void ByteCodeGenExpr(STRPTR name, Variant argv, int arity, APTR data)
 {
@@ -1438,28 +2178,46 @@ void ByteCodeGenExpr(STRPTR name, Variant argv, int arity, APTR data)
 			/* scalar types: try to evaluate the function */
 			VariantBuf first = *argv; /* result will be written here */
 			parseExpr(name, argv, arity, NULL);
-			if (argv->type != TYPE_ERR)
+			if (argv->type <= TYPE_SCALAR)
 			{
 				/* evaluation was ok */
 				return;
 			}
+			/* arrays cannot be stored in byte code */
+			VarRelease(argv);
 			*argv = first;
 		}
-		/* not constant: register a function call then */
+		/* builtin functions are resolved now (unless a program overrides it), user programs on first call */
+		int func = builtinResolve(name);
 		i = strlen(name) + 1;
-		if (i > 255) return;
+		/* name of programs is stored in one byte: check before emitting anything */
+		if (func < 0 && i > 255) return;
+
 		/* add variants right after */
-		for (arity = 0; arity < narg; arity ++)
-			ByteCodeAddVariant(data, argv + arity);
+		int start = ByteCodeAddOperands(data, argv, narg);
 
-		mem = ByteCodeAdd(data, 3 + i);
+		if (func >= 0)
+		{
+			mem = ByteCodeAdd(data, 3);
+			mem[0] = BC_BUILTIN;
+			mem[1] = narg;
+			mem[2] = func;
+			argv->type = TYPE_OPE;
+			argv->int32 = start;
+			return;
+		}
+		/* not constant: register a function call then */
+		mem = ByteCodeAdd(data, 3 + i + sizeof (APTR));
 		mem[0] = TYPE_FUN;
 		mem[1] = narg;
 		mem[2] = i;
 		strcpy(mem + 3, name);
+		/* call site cache: program will be resolved on first call */
+		memset(mem + 3 + i, 0, sizeof (APTR));
 
 		/* will stop constant folding */
 		argv->type = TYPE_OPE;
+		argv->int32 = start;
 	}
 	else if (name)
 	{
@@ -1470,22 +2228,99 @@ void ByteCodeGenExpr(STRPTR name, Variant argv, int arity, APTR data)
 	}
 	else
 	{
-		for (i = 1; i <= arity; i ++)
-			ByteCodeAddVariant(data, argv + i);
+		int start = ByteCodeAddOperands(data, argv + 1, arity);
 
-		i = (Operator) argv->ope - OperatorList;
-		/* first: add operator */
-		mem = ByteCodeAdd(data, 2);
-		mem[0] = TYPE_OPE;
-		mem[1] = i;
+		if (argv->ope == arrayStart)
+		{
+			/* operands are the items of the array */
+			mem = ByteCodeAdd(data, 3);
+			mem[0] = BC_ARRAY;
+			mem[1] = arity >> 8;
+			mem[2] = arity & 0xff;
+		}
+		else
+		{
+			i = (Operator) argv->ope - OperatorList;
+			/* operator goes after its operands */
+			mem = ByteCodeAdd(data, 2);
+			mem[0] = TYPE_OPE;
+			mem[1] = i;
+		}
+		argv->int32 = start;
+	}
+}
+
+/* next record of an expression generated by ByteCodeGenExpr(): expression ends with byte 255 */
+DATA8 ByteCodeNext(DATA8 start)
+{
+	switch (start[0]) {
+	case TYPE_OPE:   return start + 2;
+	case TYPE_FUN:   return start + 3 + start[2] + sizeof (APTR);
+	case BC_BUILTIN:
+	case BC_ATOM:
+	case BC_ARRAY:   return start + 3;
+	default:         return start + ((start[1] << 8) | start[2]);
+	}
+}
+
+/* ?:, && and || evaluate all their operands in byte code: False if expression at <start> uses one of them */
+Bool ByteCodeIsEager(DATA8 start)
+{
+	for (; start[0] < 255; start = ByteCodeNext(start))
+		if (start[0] == TYPE_OPE && OperatorList + start[1] >= logicalAnd && OperatorList + start[1] <= ternaryLeft)
+			return False;
+	return True;
+}
+
+/* name of the variable read by byte code record <start>, NULL if it is not a variable */
+STRPTR ByteCodeName(DATA8 start)
+{
+	switch (start[0]) {
+	case BC_ATOM:  return AtomName((start[1] << 8) | start[2]);
+	case TYPE_IDF: return start + 3;
+	default:       return NULL;
 	}
 }
 
 /* execute the code generated by ByteCodeGenExpr() */
+/*
+ * s += str or s = s + str: string is appended to the variable storage, instead of being copied in a temporary
+ * and then copied back in the variable. Amortized O(1) for string built in a loop. <count> is the number of
+ * values to pop: the string and the variable names above the one that will be the result.
+ */
+static Bool ByteCodeAppend(DATA8 buffer, Stack * values, int count, ParseExpCb cb, APTR data)
+{
+	Stack      arg2 = *values, arg1, target;
+	VariantBuf str;
+
+	if (arg2 == NULL || (arg1 = arg2->next) == NULL || arg1->value.type != TYPE_IDF)
+		return False;
+	/* identifiers from the byte code are interned: same name => same pointer, in the common case */
+	if (count == 2 && ((target = arg1->next) == NULL || target->value.type != TYPE_IDF ||
+	    (arg1->value.string != target->value.string && strcasecmp(arg1->value.string, target->value.string))))
+		return False;
+
+	/* numbers follow the rules of operator + (string can be converted to number) */
+	AffectArg(arg2, cb, data);
+	if (arg2->value.type != TYPE_STR)
+		return False;
+
+	str = arg2->value;
+	cb(arg1->value.string, &str, 2, data);
+	if (str.type != TYPE_VOID)
+		/* variable is not a string */
+		return False;
+
+	/* result of the assignment is the variable */
+	for (; count > 0; MyFree(buffer, PopStack(values)), count --);
+	return True;
+}
+
 Bool ByteCodeExe(DATA8 start, DATA8 * end, Bool isTrue, ParseExpCb cb, APTR data)
 {
 	uint8_t buffer[SZ_POOL];
 	Stack   values, val;
+	int     error;
 
 	buffer[0] = (SZ_POOL-4) >> 8;
 	buffer[1] = (SZ_POOL-4) & 0xff;
@@ -1495,14 +2330,38 @@ Bool ByteCodeExe(DATA8 start, DATA8 * end, Bool isTrue, ParseExpCb cb, APTR data
 
 	while (start[0] < 255)
 	{
-		VariantBuf num;
+		if (values && values->value.type == TYPE_ERR)
+		{
+			/* stop at first error, like ParseExpression() */
+			while (start[0] < 255) start = ByteCodeNext(start);
+			break;
+		}
 		switch (start[0]) {
 		case TYPE_OPE:
+			/* s += str, or s = s + str: operator + is immediately followed by assignment */
+			if (OperatorList + start[1] == assignAdd && ByteCodeAppend(buffer, &values, 1, cb, data))
+			{
+				start += 2;
+				continue;
+			}
+			if (OperatorList + start[1] == binaryPlus && start[2] == TYPE_OPE && OperatorList + start[3] == assign &&
+			    ByteCodeAppend(buffer, &values, 2, cb, data))
+			{
+				start += 4;
+				continue;
+			}
 			val = NewOperator(buffer, OperatorList + start[1]);
 			if (val->value.ope == arrayEnd || val->value.ope == arrayStart)
-				MakeOpArray(buffer, &values, &val, cb, data);
+				error = MakeOpArray(buffer, &values, &val, cb, data);
 			else
-				MakeOp(buffer, &values, &val, cb, data);
+				error = MakeOp(buffer, &values, &val, cb, data);
+			if (error)
+			{
+				val = MyCalloc(buffer, sizeof *val);
+				val->value.type  = TYPE_ERR;
+				val->value.int32 = error;
+				PushStack(&values, val);
+			}
 			start += 2;
 			continue;
 		case TYPE_FUN:
@@ -1514,20 +2373,55 @@ Bool ByteCodeExe(DATA8 start, DATA8 * end, Bool isTrue, ParseExpCb cb, APTR data
 				else ret->next = values, values = ret;
 				ret->value.type = TYPE_FUN;
 				ret->value.string = start + 3;
+				ret->value.eval = start[2];
 				val = NewOperator(buffer, &functionCall);
 				MakeOp(buffer, &values, &val, cb, data);
-				start += 3 + start[2];
+				start += 3 + start[2] + sizeof (APTR);
 			}
 			continue;
+		case BC_BUILTIN:
+			/* arguments are right on top of value stack */
+			{
+				Variant list = alloca((start[1] + 1) * sizeof *list);
+				int     i;
+				memset(list, 0, sizeof *list);
+				for (i = start[1] - 1, val = values; i >= 0 && val; i --, val = val->next)
+				{
+					AffectArg(val, cb, data);
+					list[i] = val->value;
+				}
+				builtinCall(start[2], list, start[1]);
+				for (i = start[1]; i > 0; i --)
+					MyFree(buffer, PopStack(&values));
+				val = MyCalloc(buffer, sizeof *val);
+				val->value = list[0];
+				PushStack(&values, val);
+				start += 3;
+			}
+			continue;
+		case BC_ARRAY:
+			val = MyCalloc(buffer, sizeof *val);
+			if (! MakeArray(&values, (start[1] << 8) | start[2], &val->value, buffer, cb, data))
+				val->value.type = TYPE_ERR, val->value.int32 = PERR_NoMem;
+			PushStack(&values, val);
+			start += 3;
+			continue;
+		case BC_ATOM:
+			val = MyCalloc(buffer, sizeof *val);
+			val->value.type = TYPE_IDF;
+			val->value.string = AtomName((start[1] << 8) | start[2]);
+			PushStack(&values, val);
+			start += 3;
+			continue;
 		case TYPE_INT:
 		case TYPE_DBL:
-			memcpy(&num.int64, start + 3, 8);
-			PushStack(&values, NewNumber(buffer, start[0], num.int64));
-			break;
 		case TYPE_FLOAT:
 		case TYPE_INT32:
-			memcpy(&num.int64, start + 3, 8);
-			PushStack(&values, NewNumber(buffer, start[0], num.int64));
+			/* raw copy: NewNumber() needs the exact C type in its vararg */
+			val = MyCalloc(buffer, sizeof *val);
+			val->value.type = start[0];
+			memcpy(&val->value.int64, start + 3, ((start[1] << 8) | start[2]) - 3);
+			PushStack(&values, val);
 			break;
 		case TYPE_STR:
 		case TYPE_IDF:
@@ -1536,13 +2430,15 @@ Bool ByteCodeExe(DATA8 start, DATA8 * end, Bool isTrue, ParseExpCb cb, APTR data
 			val->value.string = start + 3;
 			PushStack(&values, val);
 		}
-		if (values && values->value.type == TYPE_ERR)
-			break;
 		start += (start[1] << 8) | start[2];
 	}
+	if (values)
+		/* result can be a lone variable name */
+		AffectArg(values, cb, data);
+
 	if (isTrue)
 		/* only check if the result is "True" */
-		isTrue = ! IsNull(&values->value);
+		isTrue = values && ! IsNull(&values->value);
 
 	/* notify final results */
 	if (values)
@@ -1575,7 +2471,19 @@ DATA8 ByteCodeDebug(DATA8 start, DATA8 end)
 			continue;
 		case TYPE_FUN:
 			fprintf(stderr, "%s(%d) ", start + 3, start[1]);
-			start += 3 + start[2];
+			start += 3 + start[2] + sizeof (APTR);
+			continue;
+		case BC_BUILTIN:
+			fprintf(stderr, "builtin#%d(%d) ", start[2], start[1]);
+			start += 3;
+			continue;
+		case BC_ARRAY:
+			fprintf(stderr, "array(%d) ", (start[1] << 8) | start[2]);
+			start += 3;
+			continue;
+		case BC_ATOM:
+			fprintf(stderr, "%s ", AtomName((start[1] << 8) | start[2]));
+			start += 3;
 			continue;
 		case TYPE_INT:
 			memcpy(&buf.int64, start + 3, 8);
@@ -34,6 +34,7 @@ typedef enum /* possible values for 'Variant_t.type' field */
 	TYPE_FLOAT,
 	TYPE_STR,
 	TYPE_ARRAY,
+	TYPE_VECTOR,                 /* array of unboxed numbers of the same type */
 	TYPE_IDF,
 	TYPE_OPE,
 	TYPE_FUN,
@@ -42,6 +43,7 @@ typedef enum /* possible values for 'Variant_t.type' field */
 }	TYPE;
 
 #define TYPE_SCALAR              TYPE_STR
+#define TYPE_BOXED               TYPE_STR     /* only as TYPE_VECTOR item type: NaN-boxed numbers of any type */
 
 struct Variant_t
 {
@@ -49,7 +51,7 @@ struct Variant_t
 	union {
 		int eval;                /* TYPE_OPE */
 		int unit;                /* TYPE_INT - TYPE_FLOAT */
-		int lengthFree;          /* TYPE_STRING, TYPE_ARRAY */
+		int lengthFree;          /* TYPE_STRING, TYPE_ARRAY, TYPE_VECTOR */
 	};
 	union {
 		int64_t int64;
@@ -58,21 +60,31 @@ struct Variant_t
 		float   real32;
 		STRPTR  string;
 		Variant array;
+		APTR    vector;
 		APTR    ope;
 	};
 };
 
 #define MAX_VAR_NAME             32
-#define VAR_LENGTH(variant)      ((variant)->lengthFree & 0x0fffffff)
-#define VAR_TOFREE(variant)      ((variant)->lengthFree & 0x10000000)
-#define VAR_SETFREE(variant)     ((variant)->lengthFree |= 0x10000000)
+#define VAR_LENGTH(variant)      ((variant)->lengthFree & VAR_MAXLENGTH)
+#define VAR_MAXLENGTH            0x07ffffff
+#define VAR_BOXED                0x08000000    /* TYPE_VECTOR: items are TYPE_BOXED */
+#define VAR_HASREF(variant)      ((variant)->lengthFree & 0x10000000)    /* owns one reference of a RefAlloc() block */
+#define VAR_SETREF(variant)      ((variant)->lengthFree |= 0x10000000)
+#define VAR_BORROW(variant)      ((variant)->lengthFree &= 0xcfffffff)   /* copy does not own memory */
+#define VAR_ITEMTYPE(variant)    ((variant)->lengthFree & VAR_BOXED ? TYPE_BOXED : ((variant)->lengthFree >> 30) & 3) /* TYPE_VECTOR: TYPE_INT - TYPE_BOXED */
+#define VAR_ITEMSIZE(variant)    (VAR_ITEMTYPE(variant) & 1 ? 4 : 8)
+#define VAR_SETITEM(type)        ((type) == TYPE_BOXED ? VAR_BOXED : (unsigned) (type) << 30)
+#define SZ_SHORTSTR              256     /* longer strings are always refcounted */
 
 
 struct Result_t
 {
 	VariantBuf bin;              /* out */
 	int frame;                   /* prevent var from being displayed twice */
-	TEXT name[MAX_VAR_NAME];     /* as stored in symbol table */
+	uint32_t valueKey;           /* symtable.c: index by value */
+	STRPTR   name;               /* as stored in symbol table: interned, see AtomIntern() */
+	Result   valueNext;
 };
 
 struct Unit_t
@@ -91,8 +103,14 @@ struct ByteCode_t
 {
 	DATA8   code, exp;
 	int     max, size;
+	int     units;               /* numbers that had an unit: only their value is kept */
 };
 
+/* byte code records that are not a Variant type */
+#define BC_BUILTIN (TYPE_VOID+1)   /* [BC_BUILTIN][argc][builtin id] */
+#define BC_ARRAY   (TYPE_VOID+2)   /* [BC_ARRAY][count (2 bytes)]: build array from <count> values on stack */
+#define BC_ATOM    (TYPE_VOID+3)   /* [BC_ATOM][atom (2 bytes)]: identifier, see AtomIntern() */
+
 enum /* possible values for Unit_t.cat */
 {
 	UNIT_DIST,
@@ -118,8 +136,19 @@ enum
 };
 
 
+enum /* possible values for <access> parameter of TrackVar */
+{
+	TRACK_READ,
+	TRACK_WRITE,
+	TRACK_CALL,                  /* user program called */
+	TRACK_VOLATILE               /* clock used: result will change on its own */
+};
+
+/* function call: store == -argc-1, v[argc] is TYPE_FUN with .ope pointing to a call site cache or NULL */
+/* store == 2: append string <v> to variable, optional: set v->type to TYPE_VOID if done */
 typedef void (*ParseExpCb)(STRPTR, Variant, int store, APTR data);
 typedef void (*FormatResult)(Variant, STRPTR varName);
+typedef void (*TrackVar)(APTR ud, STRPTR name, Variant written, int access);
 
 typedef struct ParseExprData_t *       ParseExprData;
 struct ParseExprData_t
@@ -127,10 +156,54 @@ struct ParseExprData_t
 	FormatResult cb;
 	VariantBuf   res;
 	STRPTR       assignTo;
+	TrackVar     track;          /* optional: variables accessed by expression */
+	APTR         trackData;
+};
+
+typedef struct ExprCode_t *            ExprCode;
+typedef struct EvalJob_t *             EvalJob;
+typedef struct EvalEvent_t *           EvalEvent;
+
+struct ExprCode_t                    /* expression of a row compiled once, see evalExprCode() */
+{
+	struct ByteCode_t bc;            /* size == 0: has to be parsed each time */
+	uint32_t  key;                   /* crc of expression and settings it was compiled with */
+};
+
+struct EvalJob_t                     /* expression evaluated by a worker thread, see evalJobs() */
+{
+	STRPTR    expr;
+	ExprCode  code;                  /* compiled <expr> (can be NULL) */
+	EvalEvent events;                /* what parseExpr() would have done, applied by evalReplay() */
+	int       count, max;
+	int       error;                 /* ParseExpression() result, -1 if not evaluated */
+};
+
+struct EvalEvent_t
+{
+	int        type;                 /* EVAL_* */
+	int        access;               /* TRACK_* for EVAL_TRACK */
+	STRPTR     name;                 /* atom, or line of output (EVAL_OUTPUT) */
+	VariantBuf value;
+};
+
+enum /* possible values for EvalEvent_t.type */
+{
+	EVAL_TRACK,                      /* call ParseExprData_t.track */
+	EVAL_STORE,                      /* assign variable */
+	EVAL_PRINT,                      /* result of expression */
+	EVAL_OUTPUT                      /* line printed by a user program */
 };
 
 int   ParseExpression(DATA8 exp, ParseExpCb cb, APTR data);
+void  ParseInit(void);
 int   evalExpr(STRPTR expr, ParseExprData data);
+int   evalExprCode(STRPTR expr, ExprCode code, ParseExprData data);
+void  evalJobs(EvalJob jobs, int count, ULONG end);
+Bool  evalStale(EvalJob job);
+int   evalReplay(EvalJob job, ParseExprData data);
+void  evalFreeJob(EvalJob job);
+void  restoreResult(STRPTR varName, Variant v, ParseExprData data);
 void  formatResult(Variant v, STRPTR varName, STRPTR out, int max);
 void  freeAllVars(void);
 void  parseExpr(STRPTR name, Variant v, int store, APTR data);
@@ -138,6 +211,27 @@ void  ToString(Variant, DATA8 out, int max);
 void  ByteCodeGenExpr(STRPTR unused, Variant v, int arity, APTR data);
 DATA8 ByteCodeAdd(ByteCode bc, int size);
 Bool  ByteCodeExe(DATA8 start, DATA8 * end, Bool isTrue, ParseExpCb cb, APTR data);
+int   builtinFind(STRPTR name);
+int   builtinResolve(STRPTR name);
+void  builtinCall(int func, Variant v, int argc);
+Bool  constantGet(STRPTR name, Variant v);
+DATA8 ByteCodeNext(DATA8 start);
+Bool  ByteCodeIsEager(DATA8 start);
+STRPTR ByteCodeName(DATA8 start);
+int   AtomIntern(DATA8 name, int len);
+STRPTR AtomName(int atom);
+Bool  VectorAlloc(Variant, int type, int count);
+void  VectorGet(Variant, int index, Variant item);
+void  VectorSet(Variant, int index, Variant item);
+Bool  VectorConvert(Variant, int type);
+APTR  RefAlloc(int size);
+void  VarRetain(Variant);
+void  VarRelease(Variant);
+Bool  VarUnique(Variant);
+Bool  VarCopy(Variant dst, Variant src);
+Bool  VarAppend(Variant v, STRPTR str, int len);
+int   NumberType(Variant);
+int   WidestType(int type1, int type2);
 
 extern struct Unit_t units[];
 extern int firstUnits[];
@@ -22,13 +22,21 @@ struct
 	SIT_Action   checkOk, clearErr;
 	ConfigChunk  curEdit;
 	ListHead     programs;
-	ProgOutput_t output;
+	ProgByteCode progHash[PROG_HASH];
+	int          generation, indexGen;
+	uint32_t     shadowCrc;          /* names of programs that override a builtin function */
+	int          readyGen;           /* scriptPrecompile() done for this generation */
 	Bool         curProgChanged, showError;
 	int          cancelEdit, autoIndentPos;
-	int          callStack, stopNow;
+	struct ProgContext_t main;       /* programs called from main thread */
+	int          nbContext;
+	ProgMemo     memoHash[MEMO_HASH];
+	ListHead     memoLRU;
+	int          memoCount, memoGen, memoUse64b;
+	Mutex        memoLock;           /* created by scriptPrecompile() */
 	ProgEdit_t   oldStat;
 
-}	script;
+}	script = {.generation = 1, .nbContext = 1};
 
 STRPTR errorMessages[] = {
 	NULL, /* not an error */
@@ -77,6 +85,8 @@ static void scriptSaveChanges(ConfigChunk chunk)
 	SIT_GetValues(script.progEdit, SIT_Title, &text, NULL);
 	length = strlen(text) + 1;
 	memcpy(configAddChunk(chunk->name, length), text, length);
+	/* compiled programs will have to be checked again */
+	script.generation ++;
 }
 
 /* SITE_OnChange on list: show program content */
@@ -96,7 +106,7 @@ static int scriptSelectProgram(SIT_Widget w, APTR cd, APTR ud)
 		script.curEdit = chunk;
 		script.curProgChanged = 0;
 		appcfg.defProg = index < 0 ? 0 : index;
-		SIT_SetValues(script.progEdit, SIT_Title, chunk ? chunk->content : (DATA8) "", SIT_ReadOnly, cd == NULL, NULL);
+		SIT_SetValues(script.progEdit, SIT_Title, chunk ? configChunkContent(chunk) : (DATA8) "", SIT_ReadOnly, cd == NULL, NULL);
 	}
 
 	return 1;
@@ -224,13 +234,16 @@ static int scriptFinishEdit(SIT_Widget w, APTR cd, APTR ud)
 	{
 		ConfigChunk chunk;
 		STRPTR      name;
+		TEXT        chunkName[16];
 		int         index;
 		SIT_GetValues(w, SIT_Title, &name, NULL);
 		SIT_GetValues(script.progList, SIT_SelectedIndex, &index, NULL);
 		SIT_GetValues(script.progList, SIT_RowTag(index), &chunk, NULL);
 
-		CopyString(chunk->name + 1, name, sizeof chunk->name - 1);
-		chunk->changed = 1;
+		chunkName[0] = '$';
+		CopyString(chunkName + 1, name, sizeof chunkName - 1);
+		configRenameChunk(chunk, chunkName);
+		script.generation ++;
 		SIT_ListSetCell(script.progList, index, 0, DontChangePtr, DontChange, chunk->name+1);
 		script.cancelEdit = 1;
 	}
@@ -319,6 +332,7 @@ static int scriptConfirmDel(SIT_Widget w, APTR cd, APTR ud)
 	int row = (int) ud, count;
 	SIT_GetValues(script.progList, SIT_ItemCount, &count, SIT_RowTag(row), &chunk, NULL);
 	configDelChunk(chunk->name);
+	script.generation ++;
 	SIT_ListDeleteRow(script.progList, row);
 	if (row == count - 1) row --;
 	if (row >= 0) SIT_SetValues(script.progList, SIT_SelectedIndex, row, NULL);
@@ -335,7 +349,7 @@ static int scriptDel(SIT_Widget w, APTR cd, APTR ud)
 	{
 		ConfigChunk chunk;
 		SIT_GetValues(script.progList, SIT_RowTag(index), &chunk, NULL);
-		if (chunk->content[0] == 0)
+		if (configChunkContent(chunk)[0] == 0)
 		{
 			/* empty program, delete without asking */
 			scriptConfirmDel(NULL, NULL, (APTR) index);
@@ -386,6 +400,7 @@ static int scriptAdd(SIT_Widget w, APTR cd, APTR ud)
 
 	configAddChunk(name, 1);
 	ConfigChunk chunk = TAIL(config->chunks);
+	script.generation ++;
 
 	id = SIT_ListInsertItem(script.progList, -1, chunk, name + 1);
 	SIT_SetValues(script.progList, SIT_SelectedIndex, id, NULL);
@@ -604,6 +619,9 @@ static uint8_t tokenSize[] = {
 	[STOKEN_PUSH]   = 1, [STOKEN_ELSE]     = 3, [STOKEN_EXIT]  = 1
 };
 
+/* STOKEN_VAR: [STOKEN_VAR][size][name\0] (+ [name\0] for POP/SHIFT target) */
+#define INST_SIZE(inst)       ((inst)[0] == STOKEN_VAR ? (inst)[1] : tokenSize[(inst)[0]])
+
 enum /* grammar action */
 {
 	NOTHING = 0,
@@ -801,6 +819,39 @@ static int scriptFindToken(ProgByteCode prog, DATA8 * start, int lineEnd)
 	return -error;
 }
 
+/* operand of PUSH/POP/SHIFT/UNSHIFT/REDIM: name of an array variable, POP and SHIFT can store the item in a second one */
+static int scriptParseVar(ProgByteCode prog, DATA8 * start, Bool target)
+{
+	DATA8 mem, name, inst;
+	int   pc = prog->bc.size, count;
+
+	if (pc + 2 + 2 * MAX_VAR_NAME > MAX_SCRIPT_SIZE)
+		return -PERR_NoMem;
+
+	inst = ByteCodeAdd(&prog->bc, 2);
+	inst[0] = STOKEN_VAR;
+	for (mem = *start, count = 0; ; count ++)
+	{
+		while (*mem == ' ' || *mem == '\t') mem ++;
+		if (! isalpha(*mem) && *mem != '_')
+			return -PERR_SyntaxError;
+		for (name = mem ++; isalnum(*mem) || *mem == '_'; mem ++);
+		if (mem - name >= MAX_VAR_NAME)
+			return -PERR_SyntaxError;
+		inst = ByteCodeAdd(&prog->bc, mem - name + 1);
+		CopyString(inst, name, mem - name + 1);
+
+		/* PUSH a, 1 */
+		while (*mem == ' ' || *mem == '\t') mem ++;
+		if (*mem != ',' || count > 0) break;
+		mem ++;
+		if (! target) break;
+	}
+	prog->bc.code[pc + 1] = prog->bc.size - pc;
+	*start = mem;
+	return STOKEN_VAR;
+}
+
 /* main function to convert string into bytecode */
 void scriptToByteCode(ProgByteCode prog, DATA8 source)
 {
@@ -844,6 +895,9 @@ void scriptToByteCode(ProgByteCode prog, DATA8 source)
 
 		if (mem[0] == '#')
 		{
+			/* "#pure": results can be cached even if analysis says otherwise */
+			if (strncasecmp(mem + 1, "pure", 4) == 0 && ! isalnum(mem[5]))
+				prog->flags |= PROG_MEMOIZE;
 			/* comment: ignore up to end of line */
 			for (mem ++; *mem != '\n'; mem ++)
 				if (*mem == 0) return;
@@ -851,7 +905,10 @@ void scriptToByteCode(ProgByteCode prog, DATA8 source)
 			continue;
 		}
 
-		token = scriptFindToken(prog, &mem, state->pendingEnd ? state->line : 0);
+		if (scriptGrammar[state->grammar] == STOKEN_VAR)
+			token = scriptParseVar(prog, &mem, lastToken == STOKEN_POP || lastToken == STOKEN_SHIFT);
+		else
+			token = scriptFindToken(prog, &mem, state->pendingEnd ? state->line : 0);
 
 		if (token == STOKEN_SPACES)
 			continue;
@@ -1131,105 +1188,563 @@ void scriptToByteCode(ProgByteCode prog, DATA8 source)
 		prog->errCode = PERR_MissingEnd;
 }
 
-/* high-level function to transform program string into bytecode */
-ProgByteCode scriptGenByteCode(STRPTR prog, Variant errCode)
+/* case-insensitive hash of program name */
+static int scriptHashName(STRPTR name)
 {
-	ConfigChunk chunk;
-	ProgByteCode list;
-	uint32_t crc = 0;
-	int progId = 1;
+	uint32_t hash;
+	for (hash = 0; *name; name ++)
+		hash = hash * 31 + toupper(*name);
+	return hash % PROG_HASH;
+}
 
-	/* get program source */
-	for (chunk = HEAD(config->chunks); chunk; NEXT(chunk))
+static ProgByteCode scriptFindProgram(STRPTR name)
+{
+	ProgByteCode prog;
+	for (prog = script.progHash[scriptHashName(name)]; prog && strcasecmp(prog->name, name); prog = prog->hashNext);
+	return prog;
+}
+
+/* list of programs has changed: rebuild the name -> program index (done once per generation) */
+static void scriptIndexPrograms(void)
+{
+	ConfigChunk  chunk;
+	ProgByteCode prog;
+	int          progId;
+
+	for (prog = HEAD(script.programs); prog; NEXT(prog))
+		prog->chunk = NULL;
+	script.shadowCrc = 0;
+
+	for (chunk = HEAD(config->chunks), progId = 1; chunk; NEXT(chunk))
 	{
-		if (chunk->name[0] == '$')
+		if (chunk->name[0] != '$') continue;
+
+		prog = scriptFindProgram(chunk->name + 1);
+		if (prog == NULL)
 		{
-			if (strcasecmp(chunk->name + 1, prog) == 0)
-				break;
-			progId ++;
+			/* program objects are never freed: call sites can keep a pointer on them */
+			int hash = scriptHashName(chunk->name + 1);
+			prog = calloc(sizeof *prog, 1);
+			/* index will be rebuilt on next lookup */
+			if (prog == NULL) return;
+			CopyString(prog->name, chunk->name + 1, sizeof prog->name);
+			prog->hashNext = script.progHash[hash];
+			script.progHash[hash] = prog;
+			ListAddHead(&script.programs, &prog->node);
 		}
+		/* if there are duplicate names, first one wins */
+		if (prog->chunk == NULL)
+			prog->chunk = chunk;
+		prog->progId = progId ++;
+		if (builtinFind(prog->name) >= 0)
+			script.shadowCrc = crc32(script.shadowCrc, prog->name, 0);
 	}
+	script.indexGen = script.generation;
+}
 
-	if (chunk == NULL)
-		return NULL;
+/* user programs take precedence over builtin functions with the same name */
+Bool scriptIsProgram(STRPTR name)
+{
+	ProgByteCode prog;
+
+	if (script.indexGen != script.generation)
+		scriptIndexPrograms();
+
+	prog = scriptFindProgram(name);
+	return prog && prog->chunk;
+}
+
+/* crc of program names that override a builtin: BC_BUILTIN records depend on it */
+uint32_t scriptShadowCrc(void)
+{
+	if (script.indexGen != script.generation)
+		scriptIndexPrograms();
+
+	return script.shadowCrc;
+}
+
+/* check what the program depends on, to know if its results can be memoized */
+static void scriptAnalyze(ProgByteCode prog)
+{
+	DATA8 inst, eof, rec;
+
+	for (inst = prog->bc.code, eof = inst + prog->bc.size; inst < eof; )
+	{
+		switch (inst[0]) {
+		case STOKEN_PRINT:
+			prog->flags |= PROG_IMPURE;
+			break;
+		case STOKEN_EXPR:
+			for (rec = inst + 1; rec[0] != 255; rec = ByteCodeNext(rec))
+			{
+				/* EXPR variables are not visible from programs: only the clock can change the result */
+				STRPTR var = ByteCodeName(rec);
+				if (var && FindInList("time,now", var, 0) >= 0)
+					prog->flags |= PROG_IMPURE;
+				if (rec[0] == TYPE_FUN && strcasecmp(rec + 3, prog->name))
+					prog->flags |= PROG_CALLS;
+			}
+			inst = rec + 1;
+			continue;
+		}
+		inst += INST_SIZE(inst);
+	}
+}
+
+ProgByteCode scriptGenByteCode(STRPTR name, APTR callSite, Variant errCode);
+
+/* pure: no PRINT, no clock and only calls to pure programs (checked once per generation) */
+static Bool scriptIsPure(ProgByteCode prog)
+{
+	DATA8 inst, eof, rec;
+
+	if (prog->flags & PROG_MEMOIZE) return True;
+	if (prog->flags & PROG_IMPURE)  return False;
+	if ((prog->flags & PROG_CALLS) == 0) return True;
+	if (prog->pureGen == script.generation) return prog->pure;
 
-	if (script.curEdit == chunk && script.curProgChanged)
-		scriptSaveChanges(chunk);
+	/* assume it is while checking: mutually recursive programs are pure if nothing else is called */
+	prog->pureGen = script.generation;
+	prog->pure = True;
 
-	crc = crc32(0, chunk->content, -1);
-	/* check if it is already compiled and up to date */
-	for (list = HEAD(script.programs); list; NEXT(list))
+	for (inst = prog->bc.code, eof = inst + prog->bc.size; inst < eof; )
 	{
-		if (strcasecmp(list->name, prog) == 0)
+		if (inst[0] != STOKEN_EXPR)
 		{
-			if (list->crc32 == crc)
-				return list;
+			inst += INST_SIZE(inst);
+			continue;
+		}
+		for (rec = inst + 1; rec[0] != 255; rec = ByteCodeNext(rec))
+		{
+			if (rec[0] == TYPE_FUN && strcasecmp(rec + 3, prog->name))
+			{
+				VariantBuf   error;
+				ProgByteCode callee = scriptGenByteCode(rec + 3, NULL, &error);
+				if (callee == NULL || ! scriptIsPure(callee))
+				{
+					prog->pure = False;
+					return False;
+				}
+			}
+		}
+		inst = rec + 1;
+	}
+	return True;
+}
 
-			/* not up to date: regen script */
-			list->bc.size = 0;
-			break;
+/* CRC of source code of <prog> and everything it calls */
+static uint32_t scriptProgCRC(ProgByteCode prog)
+{
+	DATA8    inst, eof, rec;
+	uint32_t crc;
+
+	if (prog->fpGen == script.generation) return prog->fingerprint;
+
+	/* recursive calls will use the CRC of the source only */
+	prog->fpGen = script.generation;
+	prog->fingerprint = crc = prog->crc32;
+
+	for (inst = prog->bc.code, eof = inst + prog->bc.size; (prog->flags & PROG_CALLS) && inst < eof; )
+	{
+		if (inst[0] != STOKEN_EXPR)
+		{
+			inst += INST_SIZE(inst);
+			continue;
+		}
+		for (rec = inst + 1; rec[0] != 255; rec = ByteCodeNext(rec))
+		{
+			if (rec[0] == TYPE_FUN && strcasecmp(rec + 3, prog->name))
+			{
+				VariantBuf   error;
+				ProgByteCode callee = scriptGenByteCode(rec + 3, NULL, &error);
+				uint32_t     sub = callee ? scriptProgCRC(callee) : 0;
+				crc = crc32(crc, (DATA8) &sub, sizeof sub);
+			}
+		}
+		inst = rec + 1;
+	}
+	return prog->fingerprint = crc;
+}
+
+/* identify what a call to <name> will return: 0 if it can't be known in advance (impure or missing program) */
+uint32_t scriptFingerprint(STRPTR name)
+{
+	VariantBuf   error;
+	ProgByteCode prog = scriptGenByteCode(name, NULL, &error);
+
+	if (prog == NULL || ! scriptIsPure(prog))
+		return 0;
+
+	return scriptProgCRC(prog);
+}
+
+/* name of config chunk holding compiled code of <prog>: depends on everything that can change the byte code */
+static void scriptCacheName(ProgByteCode prog, uint32_t crc, STRPTR name)
+{
+	crc = crc32(crc, prog->name, 0);
+	/* calls to builtin functions are bound at compile time */
+	crc = crc32(crc, (DATA8) &script.shadowCrc, sizeof script.shadowCrc);
+	/* constant folding is done at compile time */
+	crc = crc32(crc, (DATA8) &appcfg.use64b, sizeof appcfg.use64b);
+	crc = crc32(crc, (DATA8) appcfg.defUnits, sizeof appcfg.defUnits);
+	sprintf(name, "%%%08x", crc);
+}
+
+/*
+ * atoms (see AtomIntern()) are only valid in this session: cached byte code refers to a list of names
+ * stored after the code instead. <save>: build that list in <map>, otherwise <map> gives the atom of
+ * each name. Call site caches (pointers) are cleared in the process.
+ */
+static Bool scriptMapAtoms(DATA8 inst, DATA8 eof, int * map, int * count, Bool save)
+{
+	DATA8 rec;
+	int   atom, i;
+
+	while (inst < eof)
+	{
+		if (inst[0] != STOKEN_EXPR)
+		{
+			if (INST_SIZE(inst) == 0) return False;
+			inst += INST_SIZE(inst);
+			continue;
+		}
+		for (rec = inst + 1; rec[0] != 255; rec = ByteCodeNext(rec))
+		{
+			if (rec[0] == TYPE_FUN)
+				memset(rec + 3 + rec[2], 0, sizeof (APTR));
+			if (rec[0] != BC_ATOM)
+				continue;
+			atom = (rec[1] << 8) | rec[2];
+			if (save)
+			{
+				for (i = 0; i < *count && map[i] != atom; i ++);
+				if (i == *count) map[(*count) ++] = atom;
+				atom = i;
+			}
+			else if (atom < *count)
+				atom = map[atom];
+			else
+				return False;
+			rec[1] = atom >> 8;
+			rec[2] = atom & 0xff;
 		}
+		inst = rec + 1;
 	}
+	return True;
+}
+
+/* byte code compiled during a previous session: avoid parsing source again */
+static Bool scriptLoadByteCode(ProgByteCode prog, uint32_t crc)
+{
+	TEXT  name[16];
+	DATA8 mem, eof, atom;
+	int * map;
+	int   size, count;
+	Bool  ok;
+
+	scriptCacheName(prog, crc, name);
+	mem = configGetChunk(name, &size);
+	if (mem == NULL || size < BC_HEADER || mem[4] != sizeof (APTR) ||
+	    ((mem[0] << 24) | (mem[1] << 16) | (mem[2] << 8) | mem[3]) != BYTECODE_VERSION)
+		return False;
+
+	/* code is followed by the names of atoms it uses */
+	eof = mem + size;
+	size = (mem[6] << 24) | (mem[7] << 16) | (mem[8] << 8) | mem[9];
+	if (size > eof - mem - BC_HEADER || (size < eof - mem - BC_HEADER && eof[-1] != 0))
+		return False;
+	for (atom = mem + BC_HEADER + size, count = 0; atom < eof; atom += strlen(atom) + 1, count ++);
+	map = alloca(count * sizeof *map);
+	for (atom = mem + BC_HEADER + size, count = 0; atom < eof; atom += strlen(atom) + 1, count ++)
+		if ((map[count] = AtomIntern(atom, strlen(atom))) < 0) return False;
+
+	/* call site caches will be written in there: can't be used from config directly */
+	prog->bc.size = 0;
+	if (ByteCodeAdd(&prog->bc, size) == NULL)
+		return False;
+	memcpy(prog->bc.code, mem + BC_HEADER, size);
+	ok = scriptMapAtoms(prog->bc.code, prog->bc.code + size, map, &count, False);
+	if (! ok)
+		prog->bc.size = 0;
+	prog->flags = mem[5];
+	return ok;
+}
+
+/* keep byte code of programs compiled during this session, discard the ones from programs that don't exist anymore */
+void scriptSaveByteCode(void)
+{
+	struct ConfigWriter_t writer;
+	ConfigChunk  chunk, next;
+	ProgByteCode prog;
+	DATA8        inst, rec;
+	TEXT         name[16];
+	uint32_t *   keep;
+	int *        atoms, * map;
+	int          count, atom, i;
+
+	if (script.indexGen != script.generation)
+		scriptIndexPrograms();
 
-	/* not yet compiled or not up to date: do it now */
-	if (list == NULL)
+	for (prog = HEAD(script.programs), count = 0; prog; NEXT(prog), count ++);
+	keep = calloc(count, sizeof *keep);
+	atoms = NULL;
+	if (keep == NULL) return;
+
+	for (prog = HEAD(script.programs), count = 0; prog; NEXT(prog))
 	{
-		list = calloc(sizeof *list, 1);
-		ListAddHead(&script.programs, &list->node);
-		CopyString(list->name, prog, sizeof list->name);
+		uint32_t crc;
+		if (prog->chunk == NULL) continue;
+		crc = prog->generation == script.generation ? prog->crc32 : crc32(0, configChunkContent(prog->chunk), -1);
+		scriptCacheName(prog, crc, name);
+		keep[count ++] = strtoul(name + 1, NULL, 16);
+
+		/* compilation errors are not kept: they are reported with a program id that is not stable */
+		if (prog->generation != script.generation || prog->compileErr || prog->bc.code == NULL || configGetChunk(name, NULL))
+			continue;
+
+		configStartChunk(&writer, name);
+		rec = configWrite(&writer, NULL, BC_HEADER);
+		if (rec)
+		{
+			rec[0] = BYTECODE_VERSION >> 24;
+			rec[1] = BYTECODE_VERSION >> 16;
+			rec[2] = BYTECODE_VERSION >> 8;
+			rec[3] = BYTECODE_VERSION;
+			rec[4] = sizeof (APTR);
+			rec[5] = prog->flags;
+			rec[6] = prog->bc.size >> 24;
+			rec[7] = prog->bc.size >> 16;
+			rec[8] = prog->bc.size >> 8;
+			rec[9] = prog->bc.size;
+		}
+		configWrite(&writer, prog->bc.code, prog->bc.size);
+		/* one atom per 3 bytes at most */
+		map = writer.size > 0 ? realloc(atoms, (prog->bc.size / 3 + 1) * sizeof *map) : NULL;
+		inst = writer.buffer + BC_HEADER;
+		atom = 0;
+		if (map) atoms = map;
+		if (map == NULL || ! scriptMapAtoms(inst, inst + prog->bc.size, atoms, &atom, True))
+		{
+			free(writer.buffer);
+			continue;
+		}
+		for (i = 0; i < atom; i ++)
+		{
+			STRPTR str = AtomName(atoms[i]);
+			configWrite(&writer, str, strlen(str) + 1);
+		}
+		configEndChunk(&writer);
 	}
-	list->crc32 = crc;
 
-	/* convert to bytecode */
-	fprintf(stderr, "regen byte code for prog %s\n", list->name);
-	scriptToByteCode(list, chunk->content);
-	if (list->errCode == 0)
-		return list;
+	for (chunk = HEAD(config->chunks); chunk; chunk = next)
+	{
+		uint32_t key;
+		next = (ConfigChunk) chunk->node.ln_Next;
+		if (chunk->name[0] != '%') continue;
+		key = strtoul(chunk->name + 1, NULL, 16);
+		for (i = 0; i < count && keep[i] != key; i ++);
+		if (i == count) configDelChunk(chunk->name);
+	}
+	free(atoms);
+	free(keep);
+}
 
-	errCode->type = TYPE_ERR;
-	errCode->int32 = list->errCode | (progId << 5) | (list->errLine << 13);
+/*
+ * high-level function to get bytecode of program <name>: <callSite> points to a cache in the caller's bytecode (can
+ * be NULL), source will only be checked again if something was modified in the editor since the last call.
+ */
+ProgByteCode scriptGenByteCode(STRPTR name, APTR callSite, Variant errCode)
+{
+	ProgByteCode prog = NULL;
+
+	if (script.curEdit && script.curProgChanged)
+	{
+		/* editor content not committed yet */
+		scriptSaveChanges(script.curEdit);
+		script.curProgChanged = 0;
+	}
+
+	if (callSite)
+		memcpy(&prog, callSite, sizeof prog);
+
+	if (prog == NULL || prog->generation != script.generation)
+	{
+		if (script.indexGen != script.generation)
+			scriptIndexPrograms();
+
+		prog = scriptFindProgram(name);
+		if (prog == NULL || prog->chunk == NULL)
+			return NULL;
+
+		if (prog->generation != script.generation)
+		{
+			uint32_t crc = crc32(0, configChunkContent(prog->chunk), -1);
+
+			prog->generation = script.generation;
+			/* check if it is already compiled and up to date */
+			if (prog->crc32 != crc || prog->bc.code == NULL || prog->shadowCrc != script.shadowCrc)
+			{
+				prog->crc32 = crc;
+				prog->shadowCrc = script.shadowCrc;
+				prog->errCode = prog->compileErr = 0;
+				if (! scriptLoadByteCode(prog, crc))
+				{
+					/* not yet compiled or not up to date: do it now */
+					prog->bc.size = 0;
+					prog->flags = 0;
+					scriptToByteCode(prog, configChunkContent(prog->chunk));
+					if (prog->errCode > 0)
+					{
+						prog->compileErr = prog->errCode | (prog->progId << 5) | (prog->errLine << 13);
+						prog->errCode = 0;
+					}
+					else scriptAnalyze(prog);
+				}
+			}
+		}
+		if (callSite)
+			memcpy(callSite, &prog, sizeof prog);
+	}
+
+	if (prog->compileErr == 0)
+		return prog;
 
-	free(list->bc.code);
-	memset(&list->bc, 0, sizeof list->bc);
+	errCode->type = TYPE_ERR;
+	errCode->int32 = prog->compileErr;
 	return NULL;
 }
 
+/* compile everything and fill call site caches: programs can then be run by several threads without writing to them */
+void scriptPrecompile(void)
+{
+	ProgByteCode prog;
+	VariantBuf   error;
+	DATA8        inst, eof, rec;
+
+	if (script.curEdit && script.curProgChanged)
+	{
+		scriptSaveChanges(script.curEdit);
+		script.curProgChanged = 0;
+	}
+	if (script.readyGen == script.generation && script.memoLock)
+		return;
+
+	if (script.indexGen != script.generation)
+		scriptIndexPrograms();
+
+	for (prog = HEAD(script.programs); prog; NEXT(prog))
+	{
+		if (prog->chunk == NULL || scriptGenByteCode(prog->name, NULL, &error) == NULL)
+			continue;
+		scriptIsPure(prog);
+		for (inst = prog->bc.code, eof = inst + prog->bc.size; inst < eof; )
+		{
+			if (inst[0] != STOKEN_EXPR)
+			{
+				inst += INST_SIZE(inst);
+				continue;
+			}
+			for (rec = inst + 1; rec[0] != 255; rec = ByteCodeNext(rec))
+			{
+				if (rec[0] == TYPE_FUN)
+					scriptGenByteCode(rec + 3, rec + 3 + rec[2], &error);
+			}
+			inst = rec + 1;
+		}
+	}
+	if (script.memoLock == NULL)
+		script.memoLock = MutexCreate();
+	script.readyGen = script.generation;
+}
+
 /* do not dump output of program directly into main interface: it needs to be sandboxed */
-static Bool scriptAddOutput(STRPTR output)
+static Bool scriptAddOutput(ProgContext ctx, STRPTR output)
 {
 	int length = strlen(output);
 
 	if (length == 0) return True;
-	if (length + script.output.usage + 1 > script.output.max)
+	if (length + ctx->output.usage + 1 > ctx->output.max)
 	{
-		int max = (length + script.output.usage + 512) & ~511;
+		int max = (length + ctx->output.usage + 512) & ~511;
 		if (max > MAX_OUTPUT_SIZE)
 			max = MAX_OUTPUT_SIZE;
-		if (max == script.output.max)
+		if (max == ctx->output.max)
 			return False;
-		script.output.buffer = realloc(script.output.buffer, max);
-		script.output.max = max;
+		ctx->output.buffer = realloc(ctx->output.buffer, max);
+		ctx->output.max = max;
 	}
 
-	strcpy(script.output.buffer + script.output.usage, output);
-	script.output.usage += length;
+	strcpy(ctx->output.buffer + ctx->output.usage, output);
+	ctx->output.usage += length;
 
 	return True;
 }
 
 
+static void scriptGetVar(STRPTR name, Variant v, int store, APTR data);
+
+/* PUSH/POP/SHIFT/UNSHIFT/REDIM on variable in frame->curVar, <v> is the value of the expression that follows */
+static void scriptArrayOp(ProgFrame frame, Variant v)
+{
+	VariantBuf item;
+	STRPTR     name  = frame->curVar + 2;
+	Result     array = symTableFindByName(&frame->symbols, name);
+	int64_t    length;
+	int        error;
+
+	if (array == NULL)
+	{
+		/* non-existant variable == empty array */
+		memset(&item, 0, sizeof item);
+		item.type = TYPE_ARRAY;
+		array = symTableAdd(&frame->symbols, name, &item);
+		if (array == NULL)
+		{
+			frame->prog->runErr[frame->ctx->id] = PERR_NoMem;
+			return;
+		}
+	}
+
+	switch (frame->curInst) {
+	case STOKEN_PUSH:
+	case STOKEN_UNSHIFT:
+		error = symArrayPush(&frame->symbols, array, v, frame->curInst == STOKEN_UNSHIFT);
+		break;
+	case STOKEN_REDIM:
+		switch (v->type) {
+		case TYPE_INT:   length = v->int64;  break;
+		case TYPE_INT32: length = v->int32;  break;
+		case TYPE_DBL:   length = v->real64; break;
+		case TYPE_FLOAT: length = v->real32; break;
+		default:         length = -1;
+		}
+		error = symArrayResize(&frame->symbols, array, length > VAR_MAXLENGTH ? -1 : length);
+		break;
+	default: /* POP or SHIFT */
+		error = symArrayPop(&frame->symbols, array, &item, frame->curInst == STOKEN_SHIFT);
+		name = strchr(name, 0) + 1;
+		if (error == 0 && name < (STRPTR) frame->curVar + frame->curVar[1])
+			scriptGetVar(name, &item, 1, frame);
+		if (error == 0)
+			VarRelease(&item);
+	}
+	if (error)
+		frame->prog->runErr[frame->ctx->id] = error;
+}
+
 static void scriptGetVar(STRPTR name, Variant v, int store, APTR data)
 {
-	ProgByteCode prog = data;
+	ProgFrame frame = data;
 
-	if (store < 0) /* function call */
+	if (store < 0) /* function call: builtins are resolved at compile time */
 	{
-		parseExpr(name, v, store, NULL);
+		if (! scriptExecute(name, -store-1, v, frame->ctx))
+			v->int32 = PERR_UnknownFunction, v->type = TYPE_ERR;
 	}
 	else if (name == NULL)
 	{
 		/* this is the result */
-		switch (prog->curInst) {
+		switch (frame->curInst) {
 		case STOKEN_PRINT:
 			switch (v->type) {
 			case TYPE_INT:
@@ -1239,13 +1754,13 @@ static void scriptGetVar(STRPTR name, Variant v, int store, APTR data)
 				{
 					TEXT buffer[64];
 					formatResult(v, NULL, buffer, sizeof buffer);
-					if (! scriptAddOutput(buffer))
-						prog->errCode = PERR_StdoutFull;
+					if (! scriptAddOutput(frame->ctx, buffer))
+						frame->prog->runErr[frame->ctx->id] = PERR_StdoutFull;
 				}
 				break;
 			case TYPE_STR:
-				if (! scriptAddOutput(v->string))
-					prog->errCode = PERR_StdoutFull;
+				if (! scriptAddOutput(frame->ctx, v->string))
+					frame->prog->runErr[frame->ctx->id] = PERR_StdoutFull;
 				break;
 			case TYPE_ARRAY:
 				// TODO
@@ -1254,161 +1769,532 @@ static void scriptGetVar(STRPTR name, Variant v, int store, APTR data)
 			}
 			break;
 		case STOKEN_RETURN:
-			memcpy(prog->returnVal, v, sizeof *v);
-			if (v->type == TYPE_STR)
-			{
-				VAR_SETFREE(v);
-				v->string = strdup(v->string);
-			}
-			// XXX need to duplicate array too
+			/* frame variables will be gone: caller will release this */
+			VarCopy(frame->returnVal, v);
+			break;
+		case STOKEN_PUSH:
+		case STOKEN_UNSHIFT:
+		case STOKEN_REDIM:
+			scriptArrayOp(frame, v);
 		}
 	}
 	else /* get variable value */
 	{
-		Result var = symTableFindByName(&prog->symbols, name);
+		Result var = symTableFindByName(&frame->symbols, name);
 
 		if (store == 0)
 		{
 			/* non-existant variable == integer 0 */
-			if (var) memcpy(v, &var->bin, sizeof *v);
-			else     memset(v, 0, sizeof *v);
+			if (var)
+			{
+				memcpy(v, &var->bin, sizeof *v);
+				if (v->type == TYPE_ARRAY || v->type == TYPE_VECTOR || v->type == TYPE_STR)
+				{
+					/* shared content: no copy; content in arena is borrowed */
+					if (VAR_HASREF(v)) VarRetain(v);
+					else VAR_BORROW(v);
+				}
+			}
+			else if (! constantGet(name, v))
+				memset(v, 0, sizeof *v);
+		}
+		else if (store == 2)
+		{
+			/* s = s + str */
+			if (var && symTableAppend(&frame->symbols, var, v) == 0)
+				v->type = TYPE_VOID;
 		}
 		else
 		{
 			if (var == NULL)
-				var = symTableAdd(&prog->symbols, name, v);
+				var = symTableAdd(&frame->symbols, name, v);
 			else
-				symTableAssign(var, v);
+				symTableAssign(&frame->symbols, var, v);
 		}
 	}
 }
 
-/* must be called before evalutating an expression using evalExpr() */
-void scriptReset(void)
+/* must be called before evalutating an expression using evalExpr() (NULL: main thread) */
+void scriptReset(ProgContext ctx)
 {
-	script.output.usage = 0;
-	script.callStack = 0;
-	script.stopNow = 0;
 	ProgByteCode prog;
+	if (ctx == NULL) ctx = &script.main;
+	ctx->output.usage = 0;
+	ctx->callStack = 0;
+	ctx->stopNow = 0;
+	ctx->frame = NULL;
 	for (prog = HEAD(script.programs); prog; NEXT(prog))
-		prog->errCode = prog->errLine = 0;
+		prog->runErr[ctx->id] = 0;
+}
+
+/* call stack for another thread, <print> will receive lines PRINTed by programs: contexts are never freed */
+ProgContext scriptNewContext(ProgOutputCb print, APTR ud)
+{
+	ProgContext ctx;
+	if (script.nbContext == MAX_CONTEXT || (ctx = calloc(sizeof *ctx, 1)) == NULL)
+		return NULL;
+	ctx->print = print;
+	ctx->printData = ud;
+	ctx->id = script.nbContext ++;
+	return ctx;
 }
 
 void addOutputToList(STRPTR line);
 
-/* function to execute bytecode /!\ multi-thread context do not use SIGTL API here */
-Bool scriptExecute(STRPTR progName, int argc, Variant argv)
+/* frames are allocated in batch and never released: recursion does not touch heap after warm up */
+static ProgFrame scriptPushFrame(ProgContext ctx)
 {
-	ProgByteCode prog = scriptGenByteCode(progName, argv);
+	ProgFrame frame = ctx->frame ? ctx->frame->callee : ctx->frames;
 
-	if (prog)
+	if (frame == NULL)
 	{
-		/* default variables */
-		VariantBuf args = {.type = TYPE_ARRAY, .lengthFree = argc, .array = alloca(sizeof *argv * argc)};
-		SymTable_t oldSymTable;
-		DATA8 inst, eof;
-		int i, retValSet;
+		int i;
+		frame = calloc(sizeof *frame, FRAME_BATCH);
+		if (frame == NULL) return NULL;
+		for (i = 0; i < FRAME_BATCH; i ++)
+		{
+			/* locals will be allocated from the frame arena */
+			frame[i].symbols.arena = &frame[i].arena;
+			frame[i].ctx = ctx;
+			if (i > 0) frame[i].caller = frame + i - 1, frame[i-1].callee = frame + i;
+		}
+		frame->caller = ctx->frame;
+		if (ctx->frame) ctx->frame->callee = frame;
+		else ctx->frames = frame;
+	}
+	ctx->frame = frame;
+	return frame;
+}
 
-		//scriptDebug(&prog->bc);
+/* size needed to deep copy argument list: refcounted values are shared instead */
+static int scriptArgSize(Variant v, int count)
+{
+	int size = count * sizeof *v;
+	for (; count > 0; count --, v ++)
+	{
+		if (v->type >= TYPE_STR && v->type <= TYPE_VECTOR && VAR_HASREF(v))
+			continue;
+		if (v->type == TYPE_STR)
+			size += (strlen(v->string) + 8) & ~7;
+		else if (v->type == TYPE_ARRAY)
+			size += scriptArgSize(v->array, VAR_LENGTH(v));
+		else if (v->type == TYPE_VECTOR)
+			size += (VAR_LENGTH(v) * VAR_ITEMSIZE(v) + 7) & ~7;
+	}
+	return size;
+}
 
-		/* prevent infinite recursion loop */
-		if (script.callStack > MAX_CALL_STACK)
+static DATA8 scriptArgCopy(Variant dest, Variant src, int count, DATA8 mem)
+{
+	memcpy(dest, src, count * sizeof *dest);
+	for (; count > 0; count --, dest ++)
+	{
+		Variant array;
+		int     len;
+		if (dest->type >= TYPE_STR && dest->type <= TYPE_VECTOR && VAR_HASREF(dest))
 		{
-			prog->errCode = PERR_StackOverflow;
-			script.stopNow = 1;
-			argv->type = TYPE_ERR;
-			argv->int32 = prog->errCode;
-			return True;
+			VarRetain(dest);
+			continue;
+		}
+		switch (dest->type) {
+		case TYPE_STR:
+			len = strlen(dest->string) + 1;
+			dest->string = memcpy(mem, dest->string, len);
+			dest->lengthFree = len - 1;
+			mem += (len + 7) & ~7;
+			break;
+		case TYPE_ARRAY:
+			array = (Variant) mem;
+			len = dest->lengthFree = VAR_LENGTH(dest);
+			mem = scriptArgCopy(array, dest->array, len, mem + len * sizeof *dest);
+			dest->array = array;
+			break;
+		case TYPE_VECTOR:
+			len = VAR_LENGTH(dest) * VAR_ITEMSIZE(dest);
+			dest->vector = memcpy(mem, dest->vector, len);
+			VAR_BORROW(dest);
+			mem += (len + 7) & ~7;
+			break;
+		default:
+			break;
 		}
-		script.callStack ++;
+	}
+	return mem;
+}
+
+/* release references held by an argument list packed by scriptPackArgs() */
+static void scriptArgFree(Variant v, int count)
+{
+	for (; count > 0; count --, v ++)
+	{
+		if (v->type == TYPE_ARRAY && ! VAR_HASREF(v))
+			scriptArgFree(v->array, VAR_LENGTH(v));
+		else
+			VarRelease(v);
+	}
+}
 
-		for (i = 0; i < argc; i ++)
-			args.array[i] = argv[i];
+/* ARGV of a frame must not depend on caller memory: a tail call will release it */
+static Bool scriptPackArgs(Variant * buffer, int * max, Variant argv, int argc)
+{
+	int size = scriptArgSize(argv, argc);
 
-		prog->returnVal = argv;
-		prog->errLine = 0;
-		/* each new script instance will have its own variable environment */
-		oldSymTable = prog->symbols;
-		memset(&prog->symbols, 0, sizeof prog->symbols);
-		symTableAdd(&prog->symbols, "ARGV", &args);
+	if (size > *max)
+	{
+		Variant mem = realloc(*buffer, size = (size + 255) & ~255);
+		if (mem == NULL) return False;
+		*buffer = mem;
+		*max = size;
+	}
+	if (argc > 0)
+		scriptArgCopy(*buffer, argv, argc, (DATA8) (*buffer + argc));
+	return True;
+}
 
-		for (inst = prog->bc.code, eof = inst + prog->bc.size, retValSet = 0; inst < eof && ! prog->errCode && ! script.stopNow; )
+static void scriptSetArgv(ProgFrame frame, int argc)
+{
+	VariantBuf args = {.type = TYPE_INT32};
+	/* don't use symTableAssign() for that: ARGV content is owned by frame */
+	Result var = symTableAdd(&frame->symbols, "ARGV", &args);
+	var->bin.type = TYPE_ARRAY;
+	var->bin.lengthFree = argc;
+	var->bin.array = frame->args;
+}
+
+/*
+ * hash of argument list, for memoization. Refcounted content is hashed by address: it can't be modified
+ * while shared and memo keeps a reference, the address won't be reused for something else.
+ */
+static uint32_t scriptHashArgs(uint32_t hash, Variant v, int count)
+{
+	for (; count > 0; count --, v ++)
+	{
+		hash = crc32(hash, (DATA8) &v->type, sizeof v->type);
+		if (v->type >= TYPE_STR && v->type <= TYPE_VECTOR && VAR_HASREF(v))
 		{
-			switch (inst[0]) {
-			case STOKEN_IF:
-				i = (inst[1] << 8) | inst[2];
-				prog->curInst = STOKEN_SPACES;
-				if (inst[3] != STOKEN_EXPR)
-				{
-					prog->errCode = PERR_InvalidOperation;
-					break;
-				}
-				if (! ByteCodeExe(inst + 4, &inst, True, scriptGetVar, prog))
-					/* skip if block */
-					inst = prog->bc.code + i;
-				continue;
-			case STOKEN_EXPR:
-				/* don't care about result, user has to assign this to a variable */
-				ByteCodeExe(inst + 1, &inst, False, scriptGetVar, prog);
-				if (prog->curInst == STOKEN_RETURN)
-				{
-					retValSet = 1;
-					goto break_all;
-				}
-				prog->curInst = STOKEN_SPACES;
-				continue;
-			case STOKEN_GOTO:
-				inst = prog->bc.code + ((inst[1] << 8) | inst[2]);
-				continue;
-			case STOKEN_EXIT:
-				goto break_all;
-				break;
-			case STOKEN_RETURN:
-				prog->curInst = STOKEN_RETURN;
-				break;
-			case STOKEN_PRINT:
-				prog->curInst = STOKEN_PRINT;
-				break;
-			default:
-				symTableFree(&prog->symbols);
-				return False;
-			}
-			inst += tokenSize[inst[0]];
+			hash = crc32(hash, (DATA8) &v->vector, sizeof v->vector);
+			continue;
+		}
+		switch (v->type) {
+		case TYPE_STR:   hash = crc32(hash, v->string, 0); break;
+		case TYPE_ARRAY: hash = scriptHashArgs(hash, v->array, VAR_LENGTH(v)); break;
+		case TYPE_VECTOR:
+			if (VAR_LENGTH(v) > 0) hash = crc32(hash, v->vector, VAR_LENGTH(v) * VAR_ITEMSIZE(v));
+			break;
+		case TYPE_INT:
+		case TYPE_DBL:   hash = crc32(hash, (DATA8) &v->int64, 8); break;
+		case TYPE_INT32:
+		case TYPE_FLOAT: hash = crc32(hash, (DATA8) &v->int32, 4); break;
+		default:         break;
+		}
+	}
+	return hash;
+}
+
+/* bitwise equality: 0.0 and -0.0 will be 2 different entries */
+static Bool scriptSameArgs(Variant a, Variant b, int count)
+{
+	for (; count > 0; count --, a ++, b ++)
+	{
+		if (a->type != b->type) return False;
+		if (a->type >= TYPE_STR && a->type <= TYPE_VECTOR && a->vector == b->vector && ((a->lengthFree ^ b->lengthFree) & 0xcfffffff) == 0)
+			continue;
+		switch (a->type) {
+		case TYPE_STR:
+			if (strcmp(a->string, b->string)) return False;
+			break;
+		case TYPE_ARRAY:
+			if (VAR_LENGTH(a) != VAR_LENGTH(b) || ! scriptSameArgs(a->array, b->array, VAR_LENGTH(a))) return False;
+			break;
+		case TYPE_VECTOR:
+			if (VAR_LENGTH(a) != VAR_LENGTH(b) || VAR_ITEMTYPE(a) != VAR_ITEMTYPE(b) ||
+			    memcmp(a->vector, b->vector, VAR_LENGTH(a) * VAR_ITEMSIZE(a))) return False;
+			break;
+		case TYPE_INT:
+		case TYPE_DBL:
+			if (a->int64 != b->int64 || a->unit != b->unit) return False;
+			break;
+		case TYPE_INT32:
+		case TYPE_FLOAT:
+			if (a->int32 != b->int32 || a->unit != b->unit) return False;
+		default:
+			break;
 		}
+	}
+	return True;
+}
+
+/* result of pure programs: cache is flushed if programs are modified or precision changes */
+static ProgMemo scriptMemoFind(ProgByteCode prog, uint32_t hash, Variant argv, int argc)
+{
+	ProgMemo memo;
 
-		break_all:
-		script.callStack --;
-		symTableFree(&prog->symbols);
-		prog->symbols = oldSymTable;
-		if (prog->errCode > 0)
+	if (script.memoGen != script.generation || script.memoUse64b != appcfg.use64b)
+	{
+		memset(script.memoHash, 0, sizeof script.memoHash);
+		for (memo = HEAD(script.memoLRU); memo; NEXT(memo))
+			memo->prog = NULL;
+		script.memoGen = script.generation;
+		script.memoUse64b = appcfg.use64b;
+		return NULL;
+	}
+
+	for (memo = script.memoHash[hash % MEMO_HASH]; memo; memo = memo->hashNext)
+	{
+		if (memo->prog == prog && memo->hash == hash && memo->argc == argc && scriptSameArgs(memo->args, argv, argc))
 		{
-			/* bubble the error back to the caller */
-			argv->type = TYPE_ERR;
-			argv->int32 = prog->errCode;
+			/* most recently used */
+			ListRemove(&script.memoLRU, &memo->node);
+			ListAddHead(&script.memoLRU, &memo->node);
+			return memo;
 		}
-		else if (script.callStack == 0)
+	}
+	return NULL;
+}
+
+static void scriptMemoStore(ProgFrame frame, Variant result)
+{
+	ProgMemo memo, * prev;
+
+	if (result->type == TYPE_ERR)
+		return;
+
+	if (script.memoCount < MEMO_SIZE)
+	{
+		memo = calloc(sizeof *memo, 1);
+		if (memo == NULL) return;
+		script.memoCount ++;
+	}
+	else
+	{
+		/* recycle least recently used */
+		memo = TAIL(script.memoLRU);
+		ListRemove(&script.memoLRU, &memo->node);
+		if (memo->prog)
+		{
+			for (prev = &script.memoHash[memo->hash % MEMO_HASH]; *prev != memo; prev = &(*prev)->hashNext);
+			*prev = memo->hashNext;
+		}
+		VarRelease(&memo->result);
+		scriptArgFree(memo->args, memo->argc);
+	}
+	ListAddHead(&script.memoLRU, &memo->node);
+
+	memo->prog = NULL;
+	memo->argc = 0;
+	if (! VarCopy(&memo->result, result))
+		return;
+	if (! scriptPackArgs(&memo->args, &memo->argMax, frame->args, frame->argc))
+	{
+		VarRelease(&memo->result);
+		memo->result.type = TYPE_VOID;
+		return;
+	}
+	memo->prog = frame->prog;
+	memo->hash = frame->memoHash;
+	memo->argc = frame->argc;
+	memo->hashNext = script.memoHash[memo->hash % MEMO_HASH];
+	script.memoHash[memo->hash % MEMO_HASH] = memo;
+}
+
+/* function to execute bytecode /!\ multi-thread context do not use SIGTL API here */
+Bool scriptExecute(STRPTR progName, int argc, Variant argv, ProgContext ctx)
+{
+	/* argv[argc] describes the call site (see MakeCall() in parse.c) */
+	DATA8 callSite = argv[argc].type == TYPE_FUN ? argv[argc].ope : NULL;
+	ProgByteCode prog = scriptGenByteCode(progName, callSite, argv);
+	ProgFrame frame;
+	DATA8 inst, eof;
+	int i, retValSet;
+
+	if (ctx == NULL) ctx = &script.main;
+	frame = ctx->frame;
+
+	if (prog == NULL)
+		/* TYPE_ERR means the script exists, but there was an error compiling it to bytecode */
+		return argv->type == TYPE_ERR;
+
+	Bool     memoize = scriptIsPure(prog);
+	uint32_t hash = 0;
+	if (memoize)
+	{
+		ProgMemo memo;
+		hash = scriptHashArgs(prog->progId, argv, argc);
+		if (script.memoLock) MutexEnter(script.memoLock);
+		memo = scriptMemoFind(prog, hash, argv, argc);
+		/* caller will release this */
+		if (memo) VarCopy(argv, &memo->result);
+		if (script.memoLock) MutexLeave(script.memoLock);
+		if (memo) return True;
+	}
+
+	/* RETURN prog(...): call is the last thing evaluated in the expression, caller frame can be reused */
+	if (frame && frame->curInst == STOKEN_RETURN && callSite && callSite[sizeof (APTR)] == 255 && frame->tailCall == NULL)
+	{
+		if (! scriptPackArgs(&ctx->tailArgs, &ctx->tailMax, argv, argc))
 		{
-			/* all is good so far, dump output to main interface */
-			DATA8 output, next;
-			for (output = script.output.buffer, eof = output + script.output.usage; output < eof; output = next)
+			argv->type = TYPE_ERR;
+			argv->int32 = PERR_NoMem;
+			return True;
+		}
+		ctx->tailArgc = argc;
+		frame->tailCall = prog;
+		memset(argv, 0, sizeof *argv);
+		argv->type = TYPE_VOID;
+		return True;
+	}
+
+	/* prevent infinite recursion loop: nested calls also recurse on the C stack (ByteCodeExe) */
+	int maxDepth = appcfg.maxCallDepth > 0 ? MIN(appcfg.maxCallDepth, MAX_CALL_LIMIT) : MAX_CALL_STACK;
+	if (ctx->callStack == 0)
+		ctx->stackBase = (DATA8) &maxDepth;
+	if (ctx->callStack >= maxDepth || ctx->stackBase - (DATA8) &maxDepth > MAX_C_STACK ||
+	    (frame = scriptPushFrame(ctx)) == NULL)
+	{
+		prog->runErr[ctx->id] = PERR_StackOverflow;
+		ctx->stopNow = 1;
+		argv->type = TYPE_ERR;
+		argv->int32 = PERR_StackOverflow;
+		return True;
+	}
+	ctx->callStack ++;
+
+	/* each new script instance will have its own variable environment */
+	if (! scriptPackArgs(&frame->args, &frame->argMax, argv, argc))
+		prog->runErr[ctx->id] = PERR_NoMem, argc = 0;
+	frame->prog = prog;
+	frame->argc = argc;
+	frame->memoize = memoize;
+	frame->memoHash = hash;
+	frame->returnVal = argv;
+	frame->curInst = STOKEN_SPACES;
+	scriptSetArgv(frame, argc);
+
+	for (inst = prog->bc.code, eof = inst + prog->bc.size, retValSet = 0; inst < eof && ! prog->runErr[ctx->id] && ! ctx->stopNow; )
+	{
+		switch (inst[0]) {
+		case STOKEN_IF:
+			i = (inst[1] << 8) | inst[2];
+			frame->curInst = STOKEN_SPACES;
+			if (inst[3] != STOKEN_EXPR)
 			{
-				for (next = output; next < eof && *next != '\n'; next ++);
-				if (*next) *next ++= 0;
-				if (*output) addOutputToList(output);
+				prog->runErr[ctx->id] = PERR_InvalidOperation;
+				break;
 			}
-			script.output.usage = 0;
-
-			if (! retValSet)
+			if (! ByteCodeExe(inst + 4, &inst, True, scriptGetVar, frame))
+				/* skip if block */
+				inst = prog->bc.code + i;
+			continue;
+		case STOKEN_EXPR:
+			/* don't care about result, user has to assign this to a variable */
+			ByteCodeExe(inst + 1, &inst, False, scriptGetVar, frame);
+			if (frame->curInst == STOKEN_RETURN)
 			{
-				/* force integer void value */
-				memset(argv, 0, sizeof *argv);
-				argv->type = TYPE_VOID;
+				if (frame->tailCall)
+				{
+					/* restart this frame with the program being called */
+					Variant args = frame->args;
+					i = frame->argMax;
+					prog = frame->prog = frame->tailCall;
+					frame->tailCall = NULL;
+					frame->curInst = STOKEN_SPACES;
+					/* original arguments are gone: only the callee can be memoized */
+					frame->memoize = False;
+					scriptArgFree(frame->args, frame->argc);
+					frame->argc = ctx->tailArgc;
+					frame->args = ctx->tailArgs;   ctx->tailArgs = args;
+					frame->argMax = ctx->tailMax;  ctx->tailMax = i;
+					symTableClear(&frame->symbols);
+					scriptSetArgv(frame, ctx->tailArgc);
+					inst = prog->bc.code;
+					eof = inst + prog->bc.size;
+					continue;
+				}
+				retValSet = 1;
+				goto break_all;
 			}
+			frame->curInst = STOKEN_SPACES;
+			continue;
+		case STOKEN_GOTO:
+			inst = prog->bc.code + ((inst[1] << 8) | inst[2]);
+			continue;
+		case STOKEN_EXIT:
+			goto break_all;
+			break;
+		case STOKEN_RETURN:
+			frame->curInst = STOKEN_RETURN;
+			break;
+		case STOKEN_PRINT:
+			frame->curInst = STOKEN_PRINT;
+			break;
+		case STOKEN_PUSH:
+		case STOKEN_POP:
+		case STOKEN_SHIFT:
+		case STOKEN_UNSHIFT:
+		case STOKEN_REDIM:
+			frame->curInst = inst[0];
+			break;
+		case STOKEN_VAR:
+			/* PUSH/UNSHIFT/REDIM: done when the expression that follows is evaluated */
+			frame->curVar = inst;
+			if (frame->curInst == STOKEN_POP || frame->curInst == STOKEN_SHIFT)
+			{
+				scriptArrayOp(frame, NULL);
+				frame->curInst = STOKEN_SPACES;
+			}
+			inst += inst[1];
+			continue;
+		default:
+			ctx->callStack --;
+			ctx->frame = frame->caller;
+			symTableClear(&frame->symbols);
+			scriptArgFree(frame->args, frame->argc);
+			return False;
 		}
+		inst += tokenSize[inst[0]];
+	}
+
+	break_all:
+	ctx->callStack --;
+	ctx->frame = frame->caller;
+	symTableClear(&frame->symbols);
+	if (prog->runErr[ctx->id] > 0)
+	{
+		/* bubble the error back to the caller */
+		if (retValSet) VarRelease(argv);
+		scriptArgFree(frame->args, frame->argc);
+		argv->type = TYPE_ERR;
+		argv->int32 = prog->runErr[ctx->id];
 		return True;
 	}
-	/* TYPE_ERR means the script exists, but there was an error compiling it to bytecode */
-	return argv->type == TYPE_ERR;
+	if (! retValSet)
+	{
+		/* force integer void value */
+		memset(argv, 0, sizeof *argv);
+		argv->type = TYPE_VOID;
+	}
+	if (frame->memoize && ! ctx->stopNow)
+	{
+		if (script.memoLock) MutexEnter(script.memoLock);
+		scriptMemoStore(frame, argv);
+		if (script.memoLock) MutexLeave(script.memoLock);
+	}
+	scriptArgFree(frame->args, frame->argc);
+	if (ctx->callStack == 0)
+	{
+		/* all is good so far, dump output to main interface (or to whoever evaluates the expression) */
+		DATA8 output, next;
+		for (output = ctx->output.buffer, eof = output + ctx->output.usage; output < eof; output = next)
+		{
+			for (next = output; next < eof && *next != '\n'; next ++);
+			if (*next) *next ++= 0;
+			if (*output == 0) continue;
+			if (ctx->print) ctx->print(ctx->printData, output);
+			else addOutputToList(output);
+		}
+		ctx->output.usage = 0;
+	}
+	return True;
 }
 
 /* no need to bloat this file */
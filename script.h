@@ -16,41 +16,130 @@ void scriptShow(SIT_Widget app);
 int  scriptCheck(SIT_Widget, APTR, APTR);
 void scriptShowProgram(SIT_Widget, int progId, int line);
 #endif
+
+typedef struct ProgContext_t *     ProgContext;
+typedef void (*ProgOutputCb)(APTR ud, STRPTR line);
+
 Bool scriptCancelRename(void);
 void scriptCommitChanges(void);
-Bool scriptExecute(STRPTR prog, int argc, Variant argv);
+Bool scriptExecute(STRPTR prog, int argc, Variant argv, ProgContext);
+Bool scriptIsProgram(STRPTR name);
+uint32_t scriptShadowCrc(void);
+uint32_t scriptFingerprint(STRPTR prog);
+void scriptSaveByteCode(void);
 void scriptTest(void);
-void scriptReset(void);
+void scriptReset(ProgContext);
+void scriptPrecompile(void);
+ProgContext scriptNewContext(ProgOutputCb print, APTR ud);
 
 
 /* per compiled program, use sub-functions if you reach this limit */
 #define MAX_SCRIPT_SIZE      65536
 #define MAX_OUTPUT_SIZE      2048
-#define MAX_CALL_STACK       5
+/*
+ * heap frames only hold locals: a nested (non-tail) call still recurses on the C stack through
+ * ByteCodeExe(), hence the limits below. Only "RETURN prog(...)" runs in constant C stack.
+ */
+#define MAX_CALL_STACK       1000    /* default for appcfg.maxCallDepth (DEPTH field in PROG tab) */
+#define MAX_CALL_LIMIT       5000    /* appcfg.maxCallDepth is clamped to this */
+#define MAX_C_STACK          (10<<20) /* C stack nested calls can use (16Mb reserved, see Calc2.cbp) */
+#define FRAME_BATCH          32
+#define MAX_CONTEXT          8       /* ProgContext that can be created, including the one of main thread */
+#define MEMO_SIZE            256     /* results of pure programs kept (LRU) */
+#define MEMO_HASH            128
+#define PROG_HASH            32
+#define BYTECODE_VERSION     4       /* of compiled programs kept in config: bump if byte code, operators or builtins change */
+#define BC_HEADER            10
 
 /*
  * private datatypes below that point
  */
 
 typedef struct ProgByteCode_t *    ProgByteCode;
+typedef struct ProgFrame_t *       ProgFrame;
+typedef struct ProgMemo_t *        ProgMemo;
 typedef struct ProgLabel_t *       ProgLabel;
 typedef struct ProgState_t *       ProgState;
 typedef struct ProgOutput_t        ProgOutput_t;
 typedef struct SIT_OnEditChange_t  ProgEdit_t;
 struct ProgByteCode_t
 {
-	struct ListNode_t  node;
-	struct ListHead_t  labels;
-	struct ByteCode_t  bc;
-	struct SymTable_t  symbols;
-	struct Variant_t * returnVal;
+	struct ListNode_t      node;
+	struct ListHead_t      labels;
+	struct ByteCode_t      bc;
+	struct ConfigChunk_t * chunk;      /* source code, only valid if generation is up to date */
+	ProgByteCode           hashNext;   /* programs with same name hash */
 
 	TEXT name[16];
 	int  crc32;
-	int  curInst; /* STOKEN_* */
-	int  errCode;
+	int  generation; /* bytecode is up to date if == script.generation */
+	int  compileErr; /* TYPE_ERR value to return if source could not be compiled */
+	int  progId;
+	int  flags;   /* PROG_* */
+	int  pureGen; /* <pure> is up to date if == script.generation */
+	int  pure;
+	int  fpGen;   /* <fingerprint> is up to date if == script.generation */
+	uint32_t fingerprint;
+	uint32_t shadowCrc; /* script.shadowCrc when compiled: BC_BUILTIN records depend on it */
+	int  errCode; /* compilation error */
 	int  errLine;
 	int  line;
+	int  runErr[MAX_CONTEXT]; /* run time error, per ProgContext, until scriptReset() */
+};
+
+struct ProgOutput_t
+{
+	DATA8 buffer;
+	int   usage, max;
+};
+
+struct ProgContext_t             /* programs being run by one thread */
+{
+	ProgFrame    frames, frame;  /* frame stack, current frame */
+	ProgOutput_t output;         /* PRINT, dumped once outermost call is done */
+	ProgOutputCb print;          /* where to dump it, NULL: main list */
+	APTR         printData;
+	DATA8        stackBase;      /* C stack at outermost call */
+	int          callStack, stopNow;
+	Variant      tailArgs;       /* ARGV of pending tail call */
+	int          tailMax, tailArgc;
+	int          id;             /* index in ProgByteCode_t.runErr */
+};
+
+struct ProgFrame_t
+{
+	ProgFrame    caller, callee; /* once allocated, frames are kept for the next calls */
+	ProgContext  ctx;
+	ProgByteCode prog;
+	ProgByteCode tailCall;       /* RETURN prog(...): restart this frame with prog */
+	SymTable_t   symbols;        /* local variables, including ARGV */
+	SymArena_t   arena;          /* storage for symbols, reset on return */
+	Variant      returnVal;
+	Variant      args;           /* ARGV content, strings and arrays included */
+	int          argMax;         /* bytes allocated in args */
+	int          argc;
+	int          curInst;        /* STOKEN_* */
+	DATA8        curVar;         /* STOKEN_VAR operand of PUSH/POP/SHIFT/UNSHIFT/REDIM */
+	int          memoize;        /* result can be memoized once done */
+	uint32_t     memoHash;
+};
+
+struct ProgMemo_t
+{
+	ListNode     node;           /* LRU order: most recent first */
+	ProgMemo     hashNext;
+	ProgByteCode prog;
+	uint32_t     hash;
+	int          argc, argMax;
+	Variant      args;           /* same layout than ProgFrame_t.args */
+	VariantBuf   result;
+};
+
+enum /* possible flags for ProgByteCode_t.flags */
+{
+	PROG_IMPURE  = 1,            /* PRINT or time/now used */
+	PROG_CALLS   = 2,            /* call other user programs */
+	PROG_MEMOIZE = 4             /* "#pure" comment: memoize no matter what */
 };
 
 struct ProgState_t
@@ -72,12 +161,6 @@ struct ProgLabel_t
 	TEXT     name[1];
 };
 
-struct ProgOutput_t
-{
-	DATA8 buffer;
-	int   usage, max;
-};
-
 enum /*  extra error codes from script */
 {
 	PERR_DuplicateLabel = PERR_LastError,
@@ -4,6 +4,8 @@
  * written by T.Pierron, june 2022
  */
 
+#include "lz.h"
+#include "vector.h"
 
 DATA8 ByteCodeDebug(DATA8 start, DATA8 end);
 
@@ -43,13 +45,29 @@ static void scriptDebug(ByteCode bc)
 		case STOKEN_PRINT:
 			fprintf(stderr, "print ");
 			arg = 1;
+			break;
+		case STOKEN_PUSH:
+		case STOKEN_POP:
+		case STOKEN_SHIFT:
+		case STOKEN_UNSHIFT:
+		case STOKEN_REDIM:
+			fprintf(stderr, "%s ", (STRPTR []) {"redim", "push", "pop", "shift", "unshift"}[inst[0] - STOKEN_REDIM]);
+			/* 2: no expression after variable */
+			arg = inst[0] == STOKEN_POP || inst[0] == STOKEN_SHIFT ? 2 : 1;
+			break;
+		case STOKEN_VAR:
+			fprintf(stderr, "%s", inst + 2);
+			if (inst + 3 + strlen(inst + 2) < inst + inst[1])
+				fprintf(stderr, ", %s", inst + 3 + strlen(inst + 2));
+			fputs(arg == 2 ? "\n" : ", ", stderr);
+			if (arg == 2) arg = 0;
 		}
-		if (tokenSize[inst[0]] == 0)
+		if (INST_SIZE(inst) == 0)
 		{
 			fprintf(stderr, "incorrect token %d: aborting\n", inst[0]);
 			break;
 		}
-		inst += tokenSize[inst[0]];
+		inst += INST_SIZE(inst);
 	}
 	fprintf(stderr, "%3d:\n", bc->size);
 }
@@ -103,59 +121,59 @@ void scriptTest(void)
 
 	/* sample programs converted to byte code (note: suppose little endian and use64b enabled) */
 	static uint8_t byteCode[] = {
-		111,
+		97,
 		/* PROG0 */
-		STOKEN_IF, 0, 69, STOKEN_EXPR, TYPE_OPE, 0x11, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
-		STOKEN_IF, 0, 66, STOKEN_EXPR, TYPE_OPE, 0x0d, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
-		STOKEN_PRINT, STOKEN_EXPR, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 0x04, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_GOTO, 0x00, 0x17,
-		STOKEN_GOTO, 0x00, 0x6f,
-		STOKEN_IF,   0x00, 0x67, STOKEN_EXPR, TYPE_OPE, 0x11, TYPE_IDF, 0, 5, 'B', 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
-		STOKEN_PRINT, STOKEN_EXPR, TYPE_IDF, 0, 5, 'B', 0, 0xff,
-		STOKEN_GOTO, 0x00, 0x6f,
-		STOKEN_PRINT, STOKEN_EXPR, TYPE_IDF, 0, 5, 'C', 0, 0xff,
-
-		64,
+		STOKEN_IF, 0, 61, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, TYPE_OPE, 17, 0xff,
+		STOKEN_IF, 0, 58, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, TYPE_OPE, 13, 0xff,
+		STOKEN_PRINT, STOKEN_EXPR, BC_ATOM, 0, 0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_OPE, 4, 0xff,
+		STOKEN_GOTO, 0, 21,
+		STOKEN_GOTO, 0, 97,
+		STOKEN_IF, 0, 91, STOKEN_EXPR, BC_ATOM, 0, 1, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, TYPE_OPE, 17, 0xff,
+		STOKEN_PRINT, STOKEN_EXPR, BC_ATOM, 0, 1, 0xff,
+		STOKEN_GOTO, 0, 97,
+		STOKEN_PRINT, STOKEN_EXPR, BC_ATOM, 0, 2, 0xff,
+
+		56,
 		/* PROG1 */
-		STOKEN_EXPR, TYPE_OPE, 0x19, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
-		STOKEN_PRINT, STOKEN_EXPR, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 0x03, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_IF, 0, 0x3d, STOKEN_EXPR, TYPE_OPE, 16, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 10,0,0,0,0,0,0,0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, TYPE_OPE, 25, 0xff,
+		STOKEN_PRINT, STOKEN_EXPR, BC_ATOM, 0, 0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_OPE, 3, 0xff,
+		STOKEN_IF, 0, 53, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 10,0,0,0,0,0,0,0, TYPE_OPE, 16, 0xff,
 		STOKEN_EXIT,
-		STOKEN_GOTO, 0, 0x14,
+		STOKEN_GOTO, 0, 18,
 
-		186,
+		172,
 		/* PROG2 */
-		STOKEN_EXPR, TYPE_OPE, 0x19, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, 0xff,
-		STOKEN_IF, 0, 186, STOKEN_EXPR, TYPE_OPE, 12, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 100,0,0,0,0,0,0,0, 0xff,
-		STOKEN_IF, 0, 80, STOKEN_EXPR, TYPE_OPE, 7, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 5,0,0,0,0,0,0,0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, TYPE_OPE, 25, 0xff,
+		STOKEN_IF, 0, 172, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 100,0,0,0,0,0,0,0, TYPE_OPE, 12, 0xff,
+		STOKEN_IF, 0, 74, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 5,0,0,0,0,0,0,0, TYPE_OPE, 7, 0xff,
 		STOKEN_PRINT, STOKEN_EXPR, TYPE_STR, 0, 8, 'B', 'U', 'Z', 'Z', 0, 0xff,
-		STOKEN_GOTO, 0, 174,
-		STOKEN_IF, 0, 117, STOKEN_EXPR, TYPE_OPE, 7, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 3,0,0,0,0,0,0,0, 0xff,
+		STOKEN_GOTO, 0, 162,
+		STOKEN_IF, 0, 109, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 3,0,0,0,0,0,0,0, TYPE_OPE, 7, 0xff,
 		STOKEN_PRINT, STOKEN_EXPR, TYPE_STR, 0, 8, 'F', 'I', 'Z', 'Z', 0, 0xff,
-		STOKEN_GOTO, 0, 174,
-		STOKEN_IF, 0, 166, STOKEN_EXPR, TYPE_OPE, 7, TYPE_IDF, 0, 5, 'A', 0, TYPE_INT, 0, 11, 15,0,0,0,0,0,0,0, 0xff,
+		STOKEN_GOTO, 0, 162,
+		STOKEN_IF, 0, 156, STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 15,0,0,0,0,0,0,0, TYPE_OPE, 7, 0xff,
 		STOKEN_PRINT, STOKEN_EXPR, TYPE_STR, 0, 9, 'F', 'I', 'Z', 'Z', ' ', 0, 0xff,
 		STOKEN_PRINT, STOKEN_EXPR, TYPE_STR, 0, 8, 'B', 'U', 'Z', 'Z', 0, 0xff,
-		STOKEN_GOTO, 0, 174,
-		STOKEN_PRINT, STOKEN_EXPR, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 3, TYPE_IDF, 0, 5, 'A', 0, 0xff,
-		STOKEN_GOTO, 0, 20,
+		STOKEN_GOTO, 0, 162,
+		STOKEN_PRINT, STOKEN_EXPR, BC_ATOM, 0, 0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_OPE, 3, 0xff,
+		STOKEN_GOTO, 0, 18,
 
-		163,
+		135,
 		/* PROG3 */
-		STOKEN_EXPR, TYPE_OPE, 0x19, TYPE_IDF, 0, 5, 'J', 0, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 0x19, TYPE_IDF, 0, 5, 'K', 0, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, 0xff,
-		STOKEN_IF, 0, 77, STOKEN_EXPR, TYPE_OPE, 16, TYPE_IDF, 0, 5, 'N', 0, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, TYPE_OPE, 25, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 1, TYPE_INT, 0, 11, 1,0,0,0,0,0,0,0, TYPE_OPE, 25, 0xff,
+		STOKEN_IF, 0, 71, STOKEN_EXPR, BC_ATOM, 0, 2, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, TYPE_OPE, 16, 0xff,
 		STOKEN_RETURN, STOKEN_EXPR, TYPE_INT, 0, 11, 0,0,0,0,0,0,0,0, 0xff,
-		STOKEN_IF, 0, 155, STOKEN_EXPR, TYPE_OPE, 12, TYPE_IDF, 0, 5, 'K', 0, TYPE_IDF, 0, 5, 'N', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 8, TYPE_IDF, 0, 5, 'I', 0, TYPE_IDF, 0, 5, 'J', 0, TYPE_OPE, 25, TYPE_IDF, 0, 5, 'T', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 25, TYPE_IDF, 0, 5, 'I', 0, TYPE_IDF, 0, 5, 'J', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 25, TYPE_IDF, 0, 5, 'J', 0, TYPE_IDF, 0, 5, 'T', 0, 0xff,
-		STOKEN_EXPR, TYPE_OPE, 3, TYPE_IDF, 0, 5, 'K', 0, 0xff,
-		STOKEN_GOTO, 0, 77,
-		STOKEN_RETURN, STOKEN_EXPR, TYPE_IDF, 0, 5, 'J', 0, 0xff,
+		STOKEN_IF, 0, 129, STOKEN_EXPR, BC_ATOM, 0, 1, BC_ATOM, 0, 2, TYPE_OPE, 12, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 3, BC_ATOM, 0, 4, BC_ATOM, 0, 0, TYPE_OPE, 8, TYPE_OPE, 25, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 4, BC_ATOM, 0, 0, TYPE_OPE, 25, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 0, BC_ATOM, 0, 3, TYPE_OPE, 25, 0xff,
+		STOKEN_EXPR, BC_ATOM, 0, 1, TYPE_OPE, 3, 0xff,
+		STOKEN_GOTO, 0, 71,
+		STOKEN_RETURN, STOKEN_EXPR, BC_ATOM, 0, 0, 0xff,
 	};
 
 	struct ProgByteCode_t program;
@@ -178,13 +196,17 @@ void scriptTest(void)
 		}
 		else
 		{
-			DATA8 s, d;
-			int   n;
-			for (s = code + 1, n = code[0], d = program.bc.code; n > 0 && *s == *d; d ++, s ++, n --);
+			/* compare with the form kept in config: atoms numbered in order of appearance */
+			DATA8 s, d, export = alloca(program.bc.size);
+			int * map = alloca((program.bc.size / 3 + 1) * sizeof *map);
+			int   n = 0;
+			memcpy(export, program.bc.code, program.bc.size);
+			scriptMapAtoms(export, export + program.bc.size, map, &n, True);
+			for (s = code + 1, n = code[0], d = export; n > 0 && *s == *d; d ++, s ++, n --);
 			if (n > 0)
 			{
 				scriptDebug(&program.bc);
-				fprintf(stderr, "PROG%d: byte code differs at offset %d: %02x != %02x\n", i, d - program.bc.code, *s, *d);
+				fprintf(stderr, "PROG%d: byte code differs at offset %d: %02x != %02x\n", i, d - export, *s, *d);
 				break;
 			}
 			else fprintf(stderr, "PROG%d test passed\n", i);
@@ -192,4 +214,278 @@ void scriptTest(void)
 
 		free(program.bc.code);
 	}
+
+	/* programs run through scriptExecute(): result is formatted and compared to the expected string */
+	static STRPTR run[] = {
+		/* RUN0 - characters of multibyte string, with an index computed at run time */
+		"S = \"a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z\"\n"
+		"R = \"\"\n"
+		"I = 4\n"
+		"WHILE I >= 0 DO\n"
+		"	R += S[I]\n"
+		"	I --\n"
+		"END\n"
+		"RETURN R",
+		"\"z\xf0\x9f\x98\x80\xe2\x82\xac\xc3\xa9" "a\"",
+
+		/* RUN1 - arrays indexed by expressions */
+		"V = [1, 2, 3]\n"
+		"T = [[\"a\", \"b\"], i32([5, 6, 7])]\n"
+		"S = 0; I = 0\n"
+		"WHILE I < 3 DO\n"
+		"	S = S + V[I] * 10 + T[1][I]\n"
+		"	I ++\n"
+		"END\n"
+		"RETURN [S, T[0][I - 2], [7, 8][V[0]]]",
+		"[78, \"b\", 8]",
+
+		/* RUN2 - integers in mixed vectors: boxed within +/-2^47, Variant array beyond */
+		"B = 1 << 47\n"
+		"V = [B - 1, -B, 0.5]\n"
+		"W = [B, 0.5]\n"
+		"Z = [-B - 1, 0.5]\n"
+		"X = [(1 << 50) + 3, 0.5]\n"
+		"RETURN [V[0] - B, V[1] + B, W[0] - B, Z[0] + B, X[0] - (1 << 50), V[0] + V[1]]",
+		"[-1, 0, 0, -1, 3, -1]",
+
+		/* RUN3 - doubles and floats in mixed vectors: NaN, -0.0, float payload */
+		"N = sqrt(-1)\n"
+		"F = f32([0.1, N])\n"
+		"V = [1, N, -N, 0.0 * -1, F[0], F[1]]\n"
+		"RETURN [V[1] != V[1], V[2] != V[2], 1 / V[3] < 0, V[4] == F[0], V[5] != V[5], V[0]]",
+		"[1, 1, 1, 1, 1, 1]",
+
+		/* RUN4 - PUSH converting typed vectors to boxed vectors, then to Variant arrays */
+		"V = i32([1, 2])\n"
+		"PUSH V 1 << 40\n"
+		"PUSH V 0.5\n"
+		"W = i64([1 << 50])\n"
+		"PUSH W 0.5\n"
+		"X = [1, 0.5]\n"
+		"PUSH X \"s\"\n"
+		"Y = i32([7])\n"
+		"PUSH Y -1 << 50\n"
+		"RETURN [V[2] - (1 << 40), V[3] * 4, W[0] - (1 << 50), W[1] * 4, X[2], Y[1] + (1 << 50), Y[0]]",
+		"[0, 2, 0, 2, \"s\", 0, 7]",
+
+		/* RUN5 - copy of an array in arena: strings are stored after the items, growing must not overwrite them */
+		"C = [\"abcdefghijklmnopqrstuvwxyz\", 1]\n"
+		"PUSH C \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"\n"
+		"A = C\n"
+		"REDIM A 1\n"
+		"PUSH A [2, 3, 4]\n"
+		"RETURN [A[0], A[3]]",
+		"[\"abcdefghijklmnopqrstuvwxyz\", 4]",
+
+		/* RUN6 - array ops on Variant arrays with strings */
+		"C = [\"ab\", 1]\n"
+		"PUSH C \"cd\"\n"
+		"B = C\n"
+		"UNSHIFT B \"z\"\n"
+		"PUSH B \"ef\"\n"
+		"POP B, P\n"
+		"SHIFT B, S\n"
+		"UNSHIFT B 7\n"
+		"REDIM B 5\n"
+		"RETURN [S, P, B[0], B[1], B[3], B[4] + 1, C[0]]",
+		"[\"z\", \"ef\", 7, \"ab\", \"cd\", 1, \"ab\"]",
+
+		/* RUN7 - array ops on typed vectors */
+		"V = i32([1, 2, 3])\n"
+		"UNSHIFT V 0\n"
+		"PUSH V i32([4, 5])\n"
+		"SHIFT V, F\n"
+		"POP V, L\n"
+		"REDIM V 6\n"
+		"W = f64([0.5])\n"
+		"UNSHIFT W 1.5\n"
+		"POP W\n"
+		"RETURN [F, L, V[0], V[3], V[5], W[0] * 2]",
+		"[0, 5, 1, 4, 0, 3]",
+
+		/* RUN8 - long running queues: free space must be moved back to the other side instead of growing */
+		"Q = [0, 1, 2]\n"
+		"R = [\"x\", 0]\n"
+		"I = 3; S = 0\n"
+		"WHILE I < 1000 DO\n"
+		"	PUSH Q I\n"
+		"	SHIFT Q, X\n"
+		"	S += X\n"
+		"	UNSHIFT R I\n"
+		"	POP R, Y\n"
+		"	I ++\n"
+		"END\n"
+		"RETURN [S, Q[0], Q[2], R[0], R[1], Y]",
+		"[496506, 997, 999, 999, 998, 997]",
+	};
+
+	for (i = 0; i < DIM(run); i += 2)
+	{
+		ProgByteCode prog;
+		VariantBuf   argv[2];
+		TEXT         result[64];
+		TEXT         cache[16];
+		int          length = strlen(run[i]) + 1;
+		int          pass;
+
+		memcpy(configAddChunk("$_TEST", length), run[i], length);
+		script.generation ++;
+		/* second pass: with byte code saved in config and loaded back, like in a new session */
+		for (pass = 0, result[0] = 0; pass < 2; pass ++)
+		{
+			memset(argv, 0, sizeof argv);
+			scriptExecute("_TEST", 0, argv, NULL);
+			formatResult(argv, NULL, result, sizeof result);
+			VarRelease(argv);
+			if (pass > 0 || strcmp(result, run[i+1])) break;
+
+			scriptSaveByteCode();
+			prog = scriptFindProgram("_TEST");
+			if (! scriptLoadByteCode(prog, prog->crc32))
+			{
+				strcpy(result, "<byte code not cached>");
+				break;
+			}
+		}
+		prog = scriptFindProgram("_TEST");
+		scriptCacheName(prog, prog->crc32, cache);
+		configDelChunk(cache);
+		configDelChunk("$_TEST");
+		script.generation ++;
+
+		if (strcmp(result, run[i+1]))
+			fprintf(stderr, "RUN%d (pass %d): expected %s, got %s\n", i >> 1, pass, run[i+1], result);
+		else
+			fprintf(stderr, "RUN%d test passed\n", i >> 1);
+	}
+
+	/* SHADOW - program with the name of a builtin overrides it, until it is deleted */
+	{
+		static STRPTR shadow[] = {"X = 2\nRETURN max(5, X) * 10 + sum([1, X])", "RETURN ARGV[0] - ARGV[1]"};
+		static int    expect[] = {33, 53};
+		VariantBuf    argv[2];
+
+		memcpy(configAddChunk("$_TEST", strlen(shadow[0]) + 1), shadow[0], strlen(shadow[0]) + 1);
+		memcpy(configAddChunk("$max", strlen(shadow[1]) + 1), shadow[1], strlen(shadow[1]) + 1);
+		for (i = 0; i < 2; i ++)
+		{
+			script.generation ++;
+			memset(argv, 0, sizeof argv);
+			scriptExecute("_TEST", 0, argv, NULL);
+			VarRelease(argv);
+			if (argv->type != TYPE_INT || argv->int64 != expect[i]) break;
+			configDelChunk("$max");
+		}
+		configDelChunk("$_TEST");
+		script.generation ++;
+
+		if (i < 2)
+			fprintf(stderr, "SHADOW (pass %d): expected %d, got %d\n", i, expect[i], (int) argv->int64);
+		else
+			fprintf(stderr, "SHADOW test passed\n");
+	}
+
+	/* LZ - codec of config chunks: round trip, then streams that must be rejected */
+	{
+		static uint8_t corrupt[][6] = {
+			/* size, stream */
+			{1, 0x10},                        /* missing literal */
+			{4, 0x00, 0x01, 0x00, 0x00},      /* offset before start of output */
+			{5, 0x10, 'a', 0x00, 0x00, 0x00}, /* offset 0 */
+			{3, 0x10, 'a', 0x01},             /* truncated offset */
+			{3, 0xf0, 255, 255},              /* truncated literal length */
+			{4, 0x1f, 'a', 0x01, 0x00},       /* truncated match length */
+		};
+		/* empty, literal runs of 15 and 270 bytes, overlapping matches, match 64Kb back, and just too far back */
+		static int sizes[] = {0, 15, 270, 1000, 999, 70000, 70000};
+		int    max = 70000 + 70000 / 255 + 16, packed[DIM(sizes)];
+		DATA8  src = malloc(max), dst = malloc(max), out = malloc(max);
+		STRPTR error = NULL;
+		int    size, j;
+
+		for (i = 0; i < DIM(sizes); i ++)
+		{
+			uint32_t seed = sizes[i];
+			for (j = 0, size = sizes[i]; j < size; j ++)
+				seed = seed * 1103515245 + 12345, src[j] = seed >> 16;
+			switch (i) {
+			case 3: memset(src, 'a', size); break;
+			case 4: for (j = 0; j < size; src[j] = "abc"[j % 3], j ++); break;
+			case 5:
+			case 6: /* filler is one long match: won't evict start of buffer from hash table */
+				memset(src + 64, 'x', 65535 - 64 + (i == 6));
+				memcpy(src + 65535 + (i == 6), src, 64);
+			}
+			packed[i] = lzCompress(src, size, dst, max);
+			if (packed[i] <= 0)
+				error = "not compressed";
+			else if (lzDecompress(dst, packed[i], out, size) != size || memcmp(src, out, size))
+				error = "round trip failed";
+			else if (size > 0 && (lzDecompress(dst, packed[i] - 1, out, size) >= 0 || lzDecompress(dst, packed[i], out, size - 1) >= 0))
+				error = "truncated stream or output accepted";
+			if (error) break;
+		}
+		if (error == NULL && packed[5] >= packed[6])
+			i = 5, error = "no match 64Kb back";
+
+		for (j = 0; j < DIM(corrupt) && ! error; j ++)
+			if (lzDecompress(corrupt[j] + 1, corrupt[j][0], out, max) >= 0)
+				i = DIM(sizes) + j, error = "corrupt stream accepted";
+
+		if (error)
+			fprintf(stderr, "LZ%d: %s\n", i, error);
+		else
+			fprintf(stderr, "LZ test passed\n");
+		free(src);
+		free(dst);
+		free(out);
+	}
+
+	/* BOX - NaN-boxed vector items: unboxed as they were, except NaN payloads that could be read as a tag */
+	{
+		static uint64_t nan[] = {0xfff9000000000005ULL, 0x7ff8000000000000ULL}; /* payload, canonical */
+		static uint32_t nan32 = 0x7fc00001;
+		VariantBuf items[6] = {
+			{.type = TYPE_INT32, .int32 = -1},
+			{.type = TYPE_FLOAT},
+			{.type = TYPE_INT, .int64 = (1LL << 47) - 1},
+			{.type = TYPE_INT, .int64 = -(1LL << 47)},
+			{.type = TYPE_DBL, .real64 = -0.0},
+			{.type = TYPE_DBL}
+		};
+		VariantBuf item, wide = {.type = TYPE_INT, .int64 = 1LL << 47};
+		uint64_t   boxes[DIM(items)];
+		STRPTR     error = NULL;
+
+		memcpy(&items[1].real32, &nan32, 4);
+		memcpy(&items[5].real64, nan, 8);
+		for (i = 0; i < DIM(items); i ++)
+		{
+			if (! vecBox(items + i, boxes + i))
+			{
+				error = "not boxed";
+				break;
+			}
+			vecUnbox(boxes[i], &item);
+			if (i == 5) memcpy(&items[i].real64, nan + 1, 8);
+			if (item.type != items[i].type || memcmp(&item.int64, &items[i].int64, item.type == TYPE_INT32 || item.type == TYPE_FLOAT ? 4 : 8))
+			{
+				error = "unboxed value differs";
+				break;
+			}
+		}
+		if (error == NULL)
+		{
+			i = DIM(items);
+			if (vecBox(&wide, boxes) || (wide.int64 = -(1LL << 47) - 1, vecBox(&wide, boxes)))
+				error = "int64 beyond 48 bits boxed";
+			else if (vecBoxedType(boxes, 2) != TYPE_FLOAT || vecBoxedType(boxes + 2, 2) != TYPE_INT || vecBoxedType(boxes, DIM(items)) != TYPE_DBL)
+				error = "wrong widest type";
+		}
+
+		if (error)
+			fprintf(stderr, "BOX%d: %s\n", i, error);
+		else
+			fprintf(stderr, "BOX test passed\n");
+	}
 }
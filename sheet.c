@@ -0,0 +1,556 @@
+/*
+ * sheet.c: dependency graph between rows of the expression list. Each row records which variables
+ *          it reads and writes while being evaluated, this is then used to find exactly which rows
+ *          need to be re-evaluated when one is modified: a poor man's spreadsheet engine.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "UtilityLibLite.h"
+#include "symtable.h"
+#include "script.h"
+#include "config.h"
+#include "sheet.h"
+
+static struct Sheet_t sheet;
+
+/* fingerprint of a value, to check if it has changed after an evaluation */
+static uint32_t sheetHashValue(uint32_t crc, Variant v)
+{
+	int i;
+	crc = crc32(crc, (DATA8) &v->type, sizeof v->type);
+	switch (v->type) {
+	case TYPE_INT:
+	case TYPE_DBL:   return crc32(crc, (DATA8) &v->int64, 8);
+	case TYPE_INT32:
+	case TYPE_FLOAT: return crc32(crc, (DATA8) &v->int32, 4);
+	case TYPE_STR:   return crc32(crc, v->string, strlen(v->string));
+	case TYPE_VECTOR:
+		i = VAR_ITEMTYPE(v);
+		crc = crc32(crc, (DATA8) &i, sizeof i);
+		i = VAR_LENGTH(v) * VAR_ITEMSIZE(v);
+		return i > 0 ? crc32(crc, v->vector, i) : crc;
+	case TYPE_ARRAY:
+		for (i = VAR_LENGTH(v) - 1; i >= 0; i --)
+			crc = sheetHashValue(crc, v->array + i);
+		// no break;
+	default:         return crc;
+	}
+}
+
+static SheetVar sheetGetVar(STRPTR name)
+{
+	uint32_t hash = symHashName(name);
+	SheetVar var;
+
+	if (sheet.capaVars > 0)
+	{
+		for (var = sheet.vars[hash & (sheet.capaVars - 1)]; var; var = var->next)
+			if (var->hash == hash && strcasecmp(var->name, name) == 0) return var;
+	}
+
+	if (sheet.nbVars >= sheet.capaVars)
+	{
+		int        capa = sheet.capaVars ? sheet.capaVars * 2 : 32;
+		SheetVar * vars = calloc(capa, sizeof *vars);
+		int        i;
+		if (vars == NULL) return NULL;
+		for (i = 0; i < sheet.capaVars; i ++)
+		{
+			SheetVar next;
+			for (var = sheet.vars[i]; var; var = next)
+			{
+				next = var->next;
+				var->next = vars[var->hash & (capa - 1)];
+				vars[var->hash & (capa - 1)] = var;
+			}
+		}
+		free(sheet.vars);
+		sheet.vars = vars;
+		sheet.capaVars = capa;
+	}
+
+	var = calloc(sizeof *var, 1);
+	if (var)
+	{
+		CopyString(var->name, name, sizeof var->name);
+		var->hash = hash;
+		var->next = sheet.vars[hash & (sheet.capaVars - 1)];
+		sheet.vars[hash & (sheet.capaVars - 1)] = var;
+		sheet.nbVars ++;
+	}
+	return var;
+}
+
+/* position of <row> in var->rows, or where it should be inserted */
+static int sheetVarPos(SheetVar var, SheetRow row)
+{
+	int min = 0, max = var->nbRows;
+	while (min < max)
+	{
+		int mid = (min + max) >> 1;
+		if (var->rows[mid]->seq < row->seq) min = mid + 1;
+		else max = mid;
+	}
+	return min;
+}
+
+static void sheetVarLink(SheetVar var, SheetRow row)
+{
+	if (var->nbRows == var->maxRows)
+	{
+		int max = var->maxRows ? var->maxRows * 2 : 8;
+		SheetRow * rows = realloc(var->rows, max * sizeof *rows);
+		if (rows == NULL) return;
+		var->rows = rows;
+		var->maxRows = max;
+	}
+	int pos = sheetVarPos(var, row);
+	memmove(var->rows + pos + 1, var->rows + pos, (var->nbRows - pos) * sizeof *var->rows);
+	var->rows[pos] = row;
+	var->nbRows ++;
+}
+
+static void sheetVarUnlink(SheetVar var, SheetRow row)
+{
+	int pos = sheetVarPos(var, row);
+	if (pos < var->nbRows && var->rows[pos] == row)
+	{
+		var->nbRows --;
+		memmove(var->rows + pos, var->rows + pos + 1, (var->nbRows - pos) * sizeof *var->rows);
+	}
+}
+
+static SheetRef sheetFindRef(SheetRef refs, int count, SheetVar var)
+{
+	for (; count > 0; count --, refs ++)
+		if (refs->var == var) return refs;
+	return NULL;
+}
+
+static SheetRef sheetAddRef(SheetRow row, SheetVar var)
+{
+	SheetRef ref;
+	if (row->nbRefs == row->maxRefs)
+	{
+		int max = row->maxRefs + 4;
+		ref = realloc(row->refs, max * sizeof *ref);
+		if (ref == NULL) return NULL;
+		row->refs = ref;
+		row->maxRefs = max;
+	}
+	ref = row->refs + row->nbRefs ++;
+	ref->var = var;
+	ref->flags = 0;
+	ref->hash = 0;
+	return ref;
+}
+
+void sheetMarkDirty(SheetRow row)
+{
+	if (row->dirty) return;
+	row->dirty = 1;
+	if (sheet.pending == 0 || sheet.firstDirty > row->seq)
+		sheet.firstDirty = row->seq;
+	sheet.pending ++;
+}
+
+/* <row> has modified <var>: mark rows that read it, up to the next one that writes it */
+static void sheetPropagate(SheetRow row, SheetVar var, Bool changed)
+{
+	int i;
+	for (i = sheetVarPos(var, row); i < var->nbRows; i ++)
+	{
+		SheetRow dep = var->rows[i];
+		SheetRef ref = sheetFindRef(dep->refs, dep->nbRefs, var);
+		if (dep == row || ref == NULL) continue;
+		if (changed && (ref->flags & REF_READ))
+			sheetMarkDirty(dep);
+		/* value in symbol table might not be the one from <dep> anymore: sheetNextEval() will handle that */
+		if (ref->flags & REF_WRITE)
+			break;
+	}
+}
+
+/* TrackVar callback, set by sheetTrack() */
+static void sheetTrackVar(APTR ud, STRPTR name, Variant written, int access)
+{
+	SheetRow row = ud;
+	SheetVar var;
+	SheetRef ref;
+
+	if (access == TRACK_VOLATILE)
+	{
+		row->flags |= ROW_VOLATILE;
+		return;
+	}
+	var = sheetGetVar(name);
+	if (var == NULL) return;
+	ref = sheetFindRef(row->refs, row->nbRefs, var);
+	if (ref == NULL && (ref = sheetAddRef(row, var)) == NULL)
+		return;
+	switch (access) {
+	case TRACK_WRITE:
+		ref->flags |= REF_WRITE;
+		ref->hash = sheetHashValue(0, written);
+		break;
+	case TRACK_READ:
+		/* read after write: value is coming from this row */
+		if ((ref->flags & REF_WRITE) == 0)
+			ref->flags |= REF_READ;
+		break;
+	case TRACK_CALL:
+		ref->flags |= REF_CALL;
+	}
+}
+
+/* start recording variables accessed by <row>: must be followed by sheetCommit() */
+void sheetTrack(SheetRow row, ParseExprData data)
+{
+	if (sheet.maxOld < row->nbRefs)
+	{
+		SheetRef old = realloc(sheet.old, row->nbRefs * sizeof *old);
+		if (old == NULL) return;
+		sheet.old = old;
+		sheet.maxOld = row->nbRefs;
+	}
+	memcpy(sheet.old, row->refs, row->nbRefs * sizeof *row->refs);
+	sheet.nbOld = row->nbRefs;
+	row->nbRefs = 0;
+	row->flags = 0;
+	data->track = sheetTrackVar;
+	data->trackData = row;
+}
+
+/* row has been evaluated: update dependency graph and mark rows affected by this one */
+void sheetCommit(SheetRow row, STRPTR expr)
+{
+	SheetRef ref, old;
+	int      i;
+
+	if (row->dirty)
+		row->dirty = 0, sheet.pending --;
+
+	for (i = 0, old = sheet.old; i < sheet.nbOld; i ++, old ++)
+	{
+		ref = sheetFindRef(row->refs, row->nbRefs, old->var);
+		if (ref == NULL)
+		{
+			/* does not reference this var anymore */
+			if (old->flags & REF_WRITE)
+				sheetPropagate(row, old->var, True);
+			sheetVarUnlink(old->var, row);
+		}
+		else if (old->flags & REF_WRITE)
+		{
+			sheetPropagate(row, old->var, (ref->flags & REF_WRITE) == 0 || ref->hash != old->hash);
+		}
+	}
+
+	for (i = 0, ref = row->refs; i < row->nbRefs; i ++, ref ++)
+	{
+		old = sheetFindRef(sheet.old, sheet.nbOld, ref->var);
+		if (old == NULL)
+			sheetVarLink(ref->var, row);
+		if ((ref->flags & REF_WRITE) && (old == NULL || (old->flags & REF_WRITE) == 0))
+			sheetPropagate(row, ref->var, True);
+	}
+	sheet.nbOld = 0;
+	row->fingerprint = sheetFingerprint(row, expr);
+	sheetRestored(row);
+}
+
+/* values written by <row> are now in the symbol table */
+void sheetRestored(SheetRow row)
+{
+	SheetRef ref;
+	int      i;
+	for (i = row->nbRefs, ref = row->refs; i > 0; i --, ref ++)
+		if (ref->flags & REF_WRITE) ref->var->current = row;
+}
+
+/*
+ * rows don't have to be evaluated in list order, as long as what they read is what the row before them
+ * has written: push on stack rows that have to be evaluated before <target> can be.
+ */
+static void sheetBlockers(SheetRow target)
+{
+	SheetRef ref;
+	int      i, j;
+
+	for (i = target->nbRefs, ref = target->refs; i > 0; i --, ref ++)
+	{
+		SheetVar var = ref->var;
+		if ((ref->flags & REF_READ) == 0) continue;
+
+		for (j = sheetVarPos(var, target) - 1; j >= 0; j --)
+		{
+			SheetRow prev = var->rows[j];
+			SheetRef dep  = sheetFindRef(prev->refs, prev->nbRefs, var);
+			if (dep == NULL || (dep->flags & REF_WRITE) == 0) continue;
+			/* value read by <target> is coming from this row: must be in symbol table */
+			if ((prev->dirty || var->current != prev) && prev->mark != sheet.mark)
+			{
+				if (sheet.nbStack == sheet.maxStack)
+				{
+					int        max   = sheet.maxStack + 64;
+					SheetRow * stack = realloc(sheet.stack, max * sizeof *stack);
+					if (stack == NULL) return;
+					sheet.stack = stack;
+					sheet.maxStack = max;
+				}
+				prev->mark = sheet.mark;
+				sheet.stack[sheet.nbStack ++] = prev;
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * which row to evaluate next to be able to evaluate <target>: earliest of all the rows it depends on,
+ * this way they will be evaluated in list order (two rows can need a different value of the same var).
+ */
+SheetRow sheetNextEval(SheetRow target)
+{
+	SheetRow first = target;
+
+	sheet.mark ++;
+	sheet.nbStack = 0;
+	target->mark = sheet.mark;
+	sheetBlockers(target);
+	while (sheet.nbStack > 0)
+	{
+		SheetRow row = sheet.stack[-- sheet.nbStack];
+		if (first->seq > row->seq)
+			first = row;
+		sheetBlockers(row);
+	}
+	return first;
+}
+
+/* first row marked as dirty in list order */
+SheetRow sheetFirstDirty(void)
+{
+	int i;
+	if (sheet.pending == 0) return NULL;
+	for (i = sheetOrdinal(&(struct SheetRow_t) {.seq = sheet.firstDirty}); i < sheet.nbRows; i ++)
+	{
+		SheetRow row = sheet.rows[i];
+		if (row->dirty)
+		{
+			sheet.firstDirty = row->seq;
+			return row;
+		}
+	}
+	return NULL;
+}
+
+/* among the first <max> dirty rows, the ones that can be evaluated now, in list order */
+int sheetReadyRows(SheetRow * rows, int max)
+{
+	SheetRow row = sheetFirstDirty();
+	int      i, nb, seen;
+
+	if (row == NULL) return 0;
+	for (i = sheetOrdinal(row), nb = seen = 0; i < sheet.nbRows && seen < max; i ++)
+	{
+		row = sheet.rows[i];
+		if (! row->dirty) continue;
+		seen ++;
+		/* all inputs up to date: does not depend on a row evaluated in the same batch */
+		if (sheetNextEval(row) == row)
+			rows[nb ++] = row;
+	}
+	return nb;
+}
+
+/* position of <row> in list of expressions (or where it would be) */
+int sheetOrdinal(SheetRow row)
+{
+	int min = 0, max = sheet.nbRows;
+	while (min < max)
+	{
+		int mid = (min + max) >> 1;
+		if (sheet.rows[mid]->seq < row->seq) min = mid + 1;
+		else max = mid;
+	}
+	return min;
+}
+
+/* expression text, programs called and settings that can change the result */
+uint32_t sheetFingerprint(SheetRow row, STRPTR expr)
+{
+	uint32_t crc, prog;
+	SheetRef ref;
+	int      i;
+
+	if (row->flags & ROW_VOLATILE)
+		return 0;
+
+	crc = crc32(0, expr, strlen(expr));
+	crc = crc32(crc, (DATA8) &appcfg.use64b, sizeof appcfg.use64b);
+	crc = crc32(crc, (DATA8) appcfg.defUnits, sizeof appcfg.defUnits);
+
+	for (i = row->nbRefs, ref = row->refs; i > 0; i --, ref ++)
+	{
+		if ((ref->flags & REF_CALL) == 0) continue;
+		prog = scriptFingerprint(ref->var->name);
+		/* impure or missing program */
+		if (prog == 0) return 0;
+		crc = crc32(crc, (DATA8) &prog, sizeof prog);
+	}
+	/* 0 is reserved for "can't be cached" */
+	return crc ? crc : 1;
+}
+
+/*
+ * serialize dependencies of <row>, to be able to rebuild the graph without evaluating anything:
+ * [flags][hash: 4 bytes BE][name][0], ..., [0]. If <out> is NULL, only return size needed.
+ */
+int sheetSaveRefs(SheetRow row, DATA8 out)
+{
+	SheetRef ref;
+	int      i, size, len;
+
+	if (row->nbRefs > 255)
+	{
+		/* way too many: row will be re-evaluated */
+		if (out) out[0] = 0;
+		return 1;
+	}
+	for (i = row->nbRefs, ref = row->refs, size = 1; i > 0; i --, ref ++)
+	{
+		len = strlen(ref->var->name) + 1;
+		if (out)
+		{
+			DATA8 p = out + size;
+			p[0] = ref->flags;
+			p[1] = ref->hash >> 24;
+			p[2] = ref->hash >> 16;
+			p[3] = ref->hash >> 8;
+			p[4] = ref->hash;
+			memcpy(p + 5, ref->var->name, len);
+		}
+		size += len + 5;
+	}
+	if (out) out[0] = row->nbRefs;
+	return size;
+}
+
+/* inverse of sheetSaveRefs(): return NULL if data is corrupt */
+DATA8 sheetRestoreRefs(SheetRow row, DATA8 in, DATA8 eof)
+{
+	int count;
+
+	if (in >= eof) return NULL;
+	for (count = *in ++; count > 0; count --)
+	{
+		DATA8    name, end;
+		SheetVar var;
+		SheetRef ref;
+
+		/* flags, hash and at least the terminator of name */
+		if (eof - in < 6)
+			return NULL;
+		name = in + 5;
+		end  = memchr(name, 0, eof - name);
+		if (end == NULL)
+			return NULL;
+
+		var = sheetGetVar(name);
+		if (var == NULL || (ref = sheetAddRef(row, var)) == NULL)
+			return NULL;
+
+		ref->flags = in[0];
+		ref->hash  = (in[1] << 24) | (in[2] << 16) | (in[3] << 8) | in[4];
+		sheetVarLink(var, row);
+		in = end + 1;
+	}
+	return in;
+}
+
+/* new expression at the end of list */
+SheetRow sheetAddRow(void)
+{
+	SheetRow row;
+	if (sheet.nbRows == sheet.maxRows)
+	{
+		int max = sheet.maxRows ? sheet.maxRows * 2 : 64;
+		SheetRow * rows = realloc(sheet.rows, max * sizeof *rows);
+		if (rows == NULL) return NULL;
+		sheet.rows = rows;
+		sheet.maxRows = max;
+	}
+	row = calloc(sizeof *row, 1);
+	if (row)
+	{
+		row->seq = sheet.seq ++;
+		sheet.rows[sheet.nbRows ++] = row;
+	}
+	return row;
+}
+
+SheetRow sheetGetRow(int ordinal)
+{
+	return 0 <= ordinal && ordinal < sheet.nbRows ? sheet.rows[ordinal] : NULL;
+}
+
+Bool sheetIsDirty(SheetRow row)
+{
+	return row->dirty;
+}
+
+int sheetPending(void)
+{
+	return sheet.pending;
+}
+
+void sheetDelRow(int ordinal)
+{
+	SheetRow row = sheetGetRow(ordinal);
+	SheetRef ref;
+	int      i;
+
+	if (row == NULL) return;
+	for (i = row->nbRefs, ref = row->refs; i > 0; i --, ref ++)
+	{
+		if (ref->var->current == row)
+			ref->var->current = NULL;
+		sheetVarUnlink(ref->var, row);
+	}
+	if (row->dirty)
+		sheet.pending --;
+	sheet.nbRows --;
+	memmove(sheet.rows + ordinal, sheet.rows + ordinal + 1, (sheet.nbRows - ordinal) * sizeof *sheet.rows);
+	free(row->code.bc.code);
+	free(row->refs);
+	free(row);
+}
+
+void sheetClear(void)
+{
+	int i;
+	for (i = 0; i < sheet.nbRows; i ++)
+	{
+		free(sheet.rows[i]->code.bc.code);
+		free(sheet.rows[i]->refs);
+		free(sheet.rows[i]);
+	}
+	for (i = 0; i < sheet.capaVars; i ++)
+	{
+		SheetVar var, next;
+		for (var = sheet.vars[i]; var; var = next)
+		{
+			next = var->next;
+			free(var->rows);
+			free(var);
+		}
+	}
+	free(sheet.rows);
+	free(sheet.vars);
+	free(sheet.old);
+	free(sheet.stack);
+	memset(&sheet, 0, sizeof sheet);
+}
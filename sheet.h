@@ -0,0 +1,88 @@
+/*
+ * sheet.h: public functions to track dependencies between rows of the expression list.
+ */
+
+#ifndef KALC_SHEET_H
+#define KALC_SHEET_H
+
+#include "parse.h"
+
+typedef struct SheetRow_t *     SheetRow;
+typedef struct SheetRef_t *     SheetRef;
+typedef struct SheetVar_t *     SheetVar;
+
+SheetRow sheetAddRow(void);
+SheetRow sheetGetRow(int ordinal);
+void     sheetDelRow(int ordinal);
+void     sheetClear(void);
+void     sheetMarkDirty(SheetRow);
+void     sheetTrack(SheetRow, ParseExprData);
+void     sheetCommit(SheetRow, STRPTR expr);
+int      sheetPending(void);
+Bool     sheetIsDirty(SheetRow);
+SheetRow sheetFirstDirty(void);
+SheetRow sheetNextEval(SheetRow target);
+int      sheetReadyRows(SheetRow * rows, int max);
+int      sheetOrdinal(SheetRow);
+void     sheetRestored(SheetRow);
+uint32_t sheetFingerprint(SheetRow, STRPTR expr);
+int      sheetSaveRefs(SheetRow, DATA8 out);
+DATA8    sheetRestoreRefs(SheetRow, DATA8 in, DATA8 eof);
+
+
+struct SheetRow_t
+{
+	int      seq;                /* increase with position in list, never reused */
+	int      dirty;              /* need to be re-evaluated */
+	int      flags;              /* ROW_* */
+	uint32_t fingerprint;        /* of everything the last evaluation depended on, 0 if it can't be cached */
+	int      mark;               /* already visited by sheetNextEval() */
+	int      nbRefs, maxRefs;
+	SheetRef refs;               /* variables read or written by this row */
+	struct ExprCode_t code;      /* expression compiled to byte code */
+};
+
+struct SheetRef_t
+{
+	SheetVar var;
+	int      flags;              /* REF_* */
+	uint32_t hash;               /* fingerprint of value written */
+};
+
+enum /* possible values for SheetRef_t.flags */
+{
+	REF_READ  = 1,
+	REF_WRITE = 2,
+	REF_CALL  = 4
+};
+
+enum /* possible values for SheetRow_t.flags */
+{
+	ROW_VOLATILE = 1             /* result depends on the clock */
+};
+
+struct SheetVar_t
+{
+	SheetVar   next;             /* hash chain */
+	SheetRow   current;          /* row that has written the value currently in symbol table */
+	uint32_t   hash;
+	int        nbRows, maxRows;
+	SheetRow * rows;             /* referencing this var, sorted by seq */
+	TEXT       name[MAX_VAR_NAME];
+};
+
+struct Sheet_t
+{
+	SheetRow * rows;             /* in order of expression rows in list */
+	int        nbRows, maxRows;
+	int        seq, pending;
+	int        firstDirty;       /* seq: no dirty rows before that one */
+	SheetVar * vars;             /* hash table of var names */
+	int        nbVars, capaVars;
+	SheetRef   old;              /* refs of row being re-evaluated */
+	int        nbOld, maxOld;
+	SheetRow * stack;            /* rows to visit in sheetNextEval() */
+	int        nbStack, maxStack, mark;
+};
+
+#endif
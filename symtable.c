@@ -9,8 +9,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <ctype.h>
 #include "UtilityLibLite.h"
 #include "symtable.h"
+#include "vector.h"
 
 /* hash function */
 uint32_t crc32(uint32_t crc, DATA8 buf, int max)
@@ -18,7 +20,8 @@ uint32_t crc32(uint32_t crc, DATA8 buf, int max)
 	static uint32_t crctable[256];
 
 	crc = crc ^ 0xffffffffL;
-	if (crctable[0] == 0)
+	/* crctable[0] is 0 */
+	if (crctable[1] == 0)
 	{
 		int i, k, c;
 		for (i = 0; i < 256; i++)
@@ -45,139 +48,725 @@ uint32_t crc32(uint32_t crc, DATA8 buf, int max)
 	return crc ^ 0xffffffffL;
 }
 
-static void symFreeVar(Result var)
+/* drop what a value owns: a reference, or the references held by the items of an array in the arena */
+static void symFreeVar(Variant v)
 {
-	if ((var->bin.type == TYPE_STR || var->bin.type == TYPE_ARRAY) && VAR_TOFREE(&var->bin))
-		free(var->bin.array);
+	if (v->type == TYPE_ARRAY && VAR_INARENA(v))
+	{
+		Variant item;
+		int     i;
+		for (i = VAR_LENGTH(v), item = v->array; i > 0; VarRelease(item), i --, item ++);
+	}
+	else VarRelease(v);
+}
+
+/*
+ * arena: allocation is a pointer bump in the current block, everything is released at once by
+ * symArenaReset() (blocks are kept for the next use).
+ */
+#define ARENA_HDR          ((sizeof (struct ArenaBlock_t) + 7) & ~7)
+
+APTR symArenaAlloc(SymArena arena, int size)
+{
+	ArenaBlock block = arena->cur;
+
+	size = (size + 7) & ~7;
+	if (block == NULL || block->used + size > block->max)
+	{
+		ArenaBlock next = block ? block->next : arena->first;
+		if (next == NULL || next->max < size)
+		{
+			/* keep smaller blocks for later, they will be used on next reset */
+			int max = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+			ArenaBlock alloc = malloc(ARENA_HDR + max);
+			if (alloc == NULL) return NULL;
+			alloc->max  = max;
+			alloc->next = next;
+			if (block) block->next = alloc;
+			else arena->first = alloc;
+			next = alloc;
+		}
+		next->used = 0;
+		arena->cur = block = next;
+	}
+	DATA8 mem = (DATA8) block + ARENA_HDR + block->used;
+	block->used += size;
+	return mem;
+}
+
+void symArenaReset(SymArena arena)
+{
+	arena->cur = arena->first;
+	if (arena->first)
+		arena->first->used = 0;
+}
+
+/* bytes needed to store content of string or array (not the Variant itself) */
+static int symValueSize(Variant v)
+{
+	int i, size;
+	if (v->type == TYPE_STR)
+		return strlen(v->string) + 1;
+	if (v->type == TYPE_VECTOR)
+		return VAR_LENGTH(v) * VAR_ITEMSIZE(v);
+	for (i = VAR_LENGTH(v), size = sizeof *v * i, i --; i >= 0; i --)
+		if (v->array[i].type == TYPE_STR) size += strlen(v->array[i].string) + 1;
+	return size;
+}
+
+/*
+ * memory for string/array value copied in table's arena. Capacity is stored in the 8 bytes before and grows
+ * geometrically: reassigning in a loop won't eat the whole arena. Second int of header is the free space
+ * before it (see symArrayReserve()).
+ */
+#define ARENA_CAP(mem)           (((int *) (mem))[-2])
+#define ARENA_FRONT(mem)         (((int *) (mem))[-1])
+#define ARENA_INLINESTR          1   /* in ARENA_FRONT: array strings are stored right after the items */
+
+static DATA8 symAlloc(SymTable syms, Result var, int size)
+{
+	DATA8 mem;
+	int   cap = 0;
+	if ((var->bin.type == TYPE_STR || var->bin.type == TYPE_ARRAY || var->bin.type == TYPE_VECTOR) && VAR_INARENA(&var->bin))
+	{
+		mem = var->bin.string;
+		cap = ARENA_CAP(mem);
+		if (size <= cap) return mem;
+		cap *= 2;
+	}
+	if (cap < size) cap = size;
+	mem = symArenaAlloc(syms->arena, cap + 8);
+	if (mem == NULL) return NULL;
+	mem += 8;
+	ARENA_CAP(mem) = cap;
+	ARENA_FRONT(mem) = 0;
+	return mem;
 }
 
-void symTableAssign(Result var, Variant v)
+static void symAssign(SymTable syms, Result var, Variant v)
 {
+	VariantBuf old = var->bin;
+	DATA8      mem;
+	int        i, size;
+
 	switch (v->type) {
 	case TYPE_STR:
-		if (var->bin.type == TYPE_STR && var->bin.string == v->string)
+	case TYPE_ARRAY:
+	case TYPE_VECTOR:
+		if (var->bin.type == v->type && var->bin.string == v->string)
 			/* already done */
 			return;
 
-		symFreeVar(var);
+		/* long strings are refcounted even in arena: they need to carry a character index */
+		if (VAR_HASREF(v) || syms->arena == NULL || (v->type == TYPE_STR && strlen(v->string) >= SZ_SHORTSTR))
+		{
+			/* refcounted content is shared, whatever its size: temporary values are moved in a refcounted block */
+			if (VarCopy(&var->bin, v)) symFreeVar(&old);
+			else var->bin = old;
+			return;
+		}
+		break;
+
+	default:
+		/* overwriting array/string */
+		symFreeVar(&old);
 		var->bin = *v;
-		var->bin.string = strdup(v->string);
-		VAR_SETFREE(&var->bin);
+		return;
+	}
+
+	/* borrowed value in arena table: content is copied, memory of previous value is reused if possible */
+	symFreeVar(&old);
+	size = symValueSize(v);
+	mem = symAlloc(syms, var, size);
+	if (mem == NULL)
+	{
+		memset(&var->bin, 0, sizeof var->bin);
+		return;
+	}
+	var->bin = *v;
+	switch (v->type) {
+	case TYPE_STR:
+		var->bin.string = memmove(mem, v->string, size);
+		var->bin.lengthFree = size - 1;
 		break;
 
 	case TYPE_ARRAY:
-		if (var->bin.type == TYPE_ARRAY && var->bin.array == v->array)
-			return;
-
-		/* need to duplicate whole array */
-		int i, size;
-		for (i = VAR_LENGTH(v), size = sizeof *v * i, i --; i >= 0; i --)
-			if (v->array[i].type == TYPE_STR) size += VAR_LENGTH(v->array+i);
-		symFreeVar(var);
-		var->bin = *v;
-		var->bin.array = malloc(size);
-		VAR_SETFREE(&var->bin);
+		var->bin.array = (Variant) mem;
+		var->bin.lengthFree = VAR_LENGTH(v);
 		DATA8 strbuf = (DATA8) (var->bin.array + VAR_LENGTH(v));
-		for (size = VAR_LENGTH(v), i = 0, v = v->array; i  <size; i ++, v ++)
+		for (size = VAR_LENGTH(v), i = 0, v = v->array; i < size; i ++, v ++)
 		{
-			var->bin.array[i] = *v;
+			Variant item = var->bin.array + i;
 			if (v->type == TYPE_STR)
-				memcpy(strbuf, v->string, VAR_LENGTH(v) + 1), strbuf += VAR_LENGTH(v) + 1;
+			{
+				int len = strlen(v->string);
+				*item = *v;
+				item->string = memcpy(strbuf, v->string, len + 1);
+				item->lengthFree = len;
+				strbuf += len + 1;
+			}
+			/* nested arrays are shared */
+			else VarCopy(item, v);
 		}
+		if (strbuf > (DATA8) (var->bin.array + size))
+			ARENA_FRONT(mem) |= ARENA_INLINESTR;
+		else
+			ARENA_FRONT(mem) &= ~ARENA_INLINESTR;
 		break;
 
+	default: /* flat copy is enough for vectors */
+		var->bin.vector = memmove(mem, v->vector, size);
+		VAR_BORROW(&var->bin);
+	}
+	var->bin.lengthFree |= VAR_ARENABIT;
+}
+
+/*
+ * value index: keyed by type and value. Floating point values are quantized into buckets of SYM_EPSILON
+ * width, values within epsilon will be in the same or a neighbor bucket.
+ */
+static Bool symValueKey(Variant v, uint32_t * key, int bucket)
+{
+	uint32_t hash = 2166136261u ^ v->type;
+	double   quant;
+	DATA8    p;
+	int      len;
+
+	switch (v->type) {
+	case TYPE_INT:   p = (DATA8) &v->int64; len = 8; break;
+	case TYPE_INT32: p = (DATA8) &v->int32; len = 4; break;
+	case TYPE_STR:   p = v->string; len = strlen(p); break;
+	case TYPE_DBL:
+	case TYPE_FLOAT:
+		quant = floor((v->type == TYPE_DBL ? v->real64 : v->real32) / SYM_EPSILON) + bucket; /* also turns -0 into 0 */
+		if (quant != quant) return False; /* NaN */
+		p = (DATA8) &quant; len = 8;
+		break;
 	default:
-		/* overwriting array/string */
-		symFreeVar(var);
-		var->bin = *v;
+		return False;
 	}
+	while (len > 0)
+		hash = (hash ^ *p ++) * 16777619, len --;
+	*key = hash;
+	return True;
 }
 
-#define MAX_HASH_CAPA      19
+static void symValueLink(SymTable syms, Result var)
+{
+	if (syms->arena || ! symValueKey(&var->bin, &var->valueKey, 0))
+		return;
 
-/* note: suppose that a previoius call to symTableFindByName(name) returned NULL */
-Result symTableAdd(SymTable syms, STRPTR name, Variant v)
+	if (syms->count > syms->valueCapa)
+	{
+		/* keep chains short: rehash using keys already computed */
+		int      capa = syms->valueCapa ? syms->valueCapa * 2 : SYM_MINCAPA;
+		Result * values = calloc(capa, sizeof *values);
+		SymBlock block;
+		if (values == NULL) return;
+		for (block = syms->blocks; block; block = block->next)
+		{
+			Result res, eof;
+			for (res = block->vars, eof = res + block->count; res < eof; res ++)
+			{
+				uint32_t key;
+				if (res == var || ! symValueKey(&res->bin, &key, 0)) continue;
+				res->valueNext = values[res->valueKey & (capa - 1)];
+				values[res->valueKey & (capa - 1)] = res;
+			}
+		}
+		free(syms->values);
+		syms->values = values;
+		syms->valueCapa = capa;
+	}
+	Result * head = syms->values + (var->valueKey & (syms->valueCapa - 1));
+	var->valueNext = *head;
+	*head = var;
+}
+
+static void symValueUnlink(SymTable syms, Result var)
 {
-	SymTable slot, prev;
+	uint32_t key;
+	if (syms->arena || syms->values == NULL || ! symValueKey(&var->bin, &key, 0))
+		return;
 
-	if (syms->symbols == NULL)
-		syms->symbols = calloc(sizeof (struct Result_t), MAX_HASH_CAPA);
+	Result * prev;
+	for (prev = syms->values + (var->valueKey & (syms->valueCapa - 1)); *prev && *prev != var; prev = &(*prev)->valueNext);
+	if (*prev) *prev = var->valueNext;
+}
 
-	for (slot = syms, prev = NULL; slot->count == MAX_HASH_CAPA; prev = slot, slot = slot->next);
+void symTableAssign(SymTable syms, Result var, Variant v)
+{
+	symValueUnlink(syms, var);
+	symAssign(syms, var, v);
+	symValueLink(syms, var);
+}
+
+/* var = var + str: string is extended in place, capacity grows geometrically */
+int symTableAppend(SymTable syms, Result var, Variant str)
+{
+	Variant v = &var->bin;
+	int     length, len, need;
+	DATA8   mem;
 
-	if (slot == NULL)
+	if (v->type != TYPE_STR || str->type != TYPE_STR)
+		return PERR_InvalidOperation;
+
+	len = strlen(str->string);
+	if (syms->arena == NULL || VAR_HASREF(v) || VAR_LENGTH(v) + len >= SZ_SHORTSTR)
 	{
-		/* all hash are full: add a new one (symbols cannot be relocated: reference on them will be all over the place) */
-		slot = calloc(sizeof *slot + sizeof (struct Result_t) * MAX_HASH_CAPA, 1);
-		slot->symbols = (Result) (slot + 1);
-		prev->next = slot;
+		symValueUnlink(syms, var);
+		need = VarAppend(v, str->string, len);
+		symValueLink(syms, var);
+		return need ? 0 : PERR_NoMem;
 	}
 
-	Result var = slot->symbols + crc32(0, name, strlen(name)) % MAX_HASH_CAPA;
+	/* value in arena: reuse capacity of symAlloc() */
+	length = VAR_LENGTH(v);
+	need   = length + len + 1;
+	mem    = v->string;
+	if (need > VAR_MAXLENGTH)
+		return PERR_NoMem;
+	if (! VAR_INARENA(v) || ARENA_CAP(mem) < need)
+	{
+		mem = symArenaAlloc(syms->arena, need * 2 + 8);
+		if (mem == NULL) return PERR_NoMem;
+		mem += 8;
+		ARENA_CAP(mem) = need * 2;
+		ARENA_FRONT(mem) = 0;
+		memcpy(mem, v->string, length);
+	}
+	memmove(mem + length, str->string, len + 1);
+	v->string = mem;
+	v->lengthFree = (length + len) | VAR_ARENABIT;
+	return 0;
+}
 
-	/* check for collision */
-	if (var->name[0])
+/*
+ * PUSH/POP/SHIFT/UNSHIFT/REDIM: arrays of an arena table are used as double-ended queues. Free space is kept
+ * on both sides of the items and the capacity header moves along with the first item: content is still
+ * contiguous for everything else. Only for arena tables: values are modified in place, content shared with
+ * other values (or borrowed) is copied in the arena first.
+ */
+static int symItemSize(Variant v)
+{
+	return v->type == TYPE_VECTOR ? VAR_ITEMSIZE(v) : sizeof *v;
+}
+
+/* strings of array items must not be stored in memory that can be relocated */
+static Bool symArenaString(SymTable syms, Variant item)
+{
+	int   len = strlen(item->string);
+	DATA8 mem = symArenaAlloc(syms->arena, len + 1);
+
+	if (mem == NULL) return False;
+	item->string = memcpy(mem, item->string, len + 1);
+	item->lengthFree = len;
+	return True;
+}
+
+/* make room for <count> items at the back or in <front> of array <v> */
+static Bool symArrayReserve(SymTable syms, Variant v, int count, Bool front)
+{
+	DATA8 mem   = v->string;
+	DATA8 block = NULL;
+	int   size  = symItemSize(v);
+	int   used  = VAR_LENGTH(v) * size;
+	int   need  = used + count * size;
+	int   total = 0, spare, i;
+	/* strings stored after the items or borrowed (ARGV) need a copy */
+	Bool  inl   = v->type == TYPE_ARRAY && (! VAR_INARENA(v) || (ARENA_FRONT(mem) & ARENA_INLINESTR));
+
+	if (VAR_INARENA(v))
 	{
-		Result eof = slot->symbols + MAX_HASH_CAPA;
-		Result next = var;
-		int i;
-		for (i = 0; i < MAX_HASH_CAPA; i ++)
+		spare = ARENA_FRONT(mem) & ~ARENA_INLINESTR;
+		total = spare + ARENA_CAP(mem);
+		if (front ? spare >= count * size : total - spare >= need && ! inl)
+			return True;
+		/* half of the block is free: move items back to the middle instead of growing */
+		if (! inl && need * 2 <= total)
+			block = mem - 8 - spare;
+	}
+	if (block == NULL)
+	{
+		if (need > 0x3fffff00) return False;
+		total = need * 2;
+		block = symArenaAlloc(syms->arena, total + 8);
+		if (block == NULL) return False;
+	}
+	spare = (total - need) / 2 / size * size;
+	if (front) spare += count * size;
+	mem = memmove(block + 8 + spare, v->string, used);
+
+	if (inl)
+	{
+		Variant item;
+		for (item = (Variant) mem, i = VAR_LENGTH(v); i > 0; i --, item ++)
 		{
-			next ++;
-			if (next == eof) next = slot->symbols;
-			if (next->name[0] == 0)
-			{
-				/* need a linked list of all entriese with the same hash (to avoid scaning whole table if there is a collision) */
-				next->name[MAX_VAR_NAME-1] = var->name[MAX_VAR_NAME-1];
-				var->name[MAX_VAR_NAME-1] = next - slot->symbols;
-				var = next;
-				break;
-			}
+			if (item->type == TYPE_STR) { if (! symArenaString(syms, item)) return False; }
+			else if (! VAR_INARENA(v)) VarRetain(item);
+		}
+	}
+	/* was shared: the copy is ours now */
+	VarRelease(v);
+	ARENA_CAP(mem) = total - spare;
+	ARENA_FRONT(mem) = spare;
+	v->string = mem;
+	v->lengthFree |= VAR_ARENABIT;
+	return True;
+}
+
+/*
+ * typed array can't hold strings: turn it into an array of Variant (<type> == TYPE_ARRAY). Numbers of
+ * another type than the items will turn it into a vector of boxed numbers (<type> == TYPE_BOXED).
+ */
+static Bool symVectorConvert(SymTable syms, Variant v, int type)
+{
+	int   count = VAR_LENGTH(v), size = type == TYPE_ARRAY ? sizeof *v : 8, i;
+	DATA8 mem   = symArenaAlloc(syms->arena, count * size + 8);
+
+	if (mem == NULL) return False;
+	mem += 8;
+	ARENA_CAP(mem) = count * size;
+	ARENA_FRONT(mem) = 0;
+	if (type == TYPE_ARRAY)
+	{
+		for (i = 0; i < count; i ++)
+			VectorGet(v, i, (Variant) mem + i);
+		v->type = TYPE_ARRAY;
+		v->lengthFree = count | VAR_ARENABIT;
+	}
+	else
+	{
+		vecConvert(mem, TYPE_BOXED, v->vector, VAR_ITEMTYPE(v), count);
+		v->type = TYPE_VECTOR;
+		v->lengthFree = count | VAR_SETITEM(TYPE_BOXED) | VAR_ARENABIT;
+	}
+	v->string = mem;
+	return True;
+}
+
+/* item type needed to store numbers of <item> in vector <v>: TYPE_ARRAY if they can't be boxed */
+static int symVectorType(Variant v, Variant item)
+{
+	VariantBuf num;
+	uint64_t   box;
+	int        type = VAR_ITEMTYPE(v), count, same, fits, i;
+
+	if (item->type == type || (type == TYPE_BOXED && item->type <= TYPE_FLOAT && vecBox(item, &box)))
+		return type;
+
+	count = item->type == TYPE_ARRAY || item->type == TYPE_VECTOR ? VAR_LENGTH(item) : 1;
+	for (i = 0, same = fits = 1; i < count; i ++)
+	{
+		switch (item->type) {
+		case TYPE_ARRAY:  num = item->array[i]; break;
+		case TYPE_VECTOR: VectorGet(item, i, &num); break;
+		default:          num = *item;
 		}
+		if (num.type != type) same = 0;
+		if (! vecBox(&num, &box)) fits = 0;
+	}
+	if (same) return type;
+
+	/* integers already in the vector will have to be boxed too */
+	for (i = type == TYPE_INT ? VAR_LENGTH(v) - 1 : -1; fits && i >= 0; i --)
+	{
+		VectorGet(v, i, &num);
+		fits = vecBox(&num, &box);
+	}
+	return fits ? TYPE_BOXED : TYPE_ARRAY;
+}
+
+/* add <item> at the end or in <front> of array <var>: all its items if <item> is an array */
+int symArrayPush(SymTable syms, Result var, Variant item, Bool front)
+{
+	Variant v = &var->bin;
+	Variant src;
+	DATA8   mem;
+	int     count, index, isStr, i;
+	Bool    self;
+
+	if (v->type != TYPE_ARRAY && v->type != TYPE_VECTOR)
+		return PERR_InvalidOperation;
+	if (! VAR_INARENA(v) && ! symArrayReserve(syms, v, 0, False))
+		return PERR_NoMem;
+
+	switch (item->type) {
+	case TYPE_ARRAY:
+		/* nested arrays are not supported */
+		for (i = count = VAR_LENGTH(item), isStr = 0, src = item->array; i > 0; i --, src ++)
+		{
+			if (src->type == TYPE_STR) isStr = 1;
+			else if (src->type > TYPE_FLOAT) return PERR_InvalidOperation;
+		}
+		break;
+	case TYPE_VECTOR:
+		count = VAR_LENGTH(item);
+		isStr = 0;
+		break;
+	case TYPE_STR:
+		count = isStr = 1;
+		break;
+	default:
+		if (item->type > TYPE_FLOAT)
+			return PERR_InvalidOperation;
+		count = 1;
+		isStr = 0;
+	}
+	if (count == 0) return 0;
+	if (VAR_LENGTH(v) + count > VAR_MAXLENGTH)
+		return PERR_NoMem;
+	if (v->type == TYPE_ARRAY && VAR_LENGTH(v) == 0 && (item->type == TYPE_VECTOR || (item->type <= TYPE_FLOAT && item->unit == 0)))
+	{
+		/* numbers pushed in an empty array: store them in a vector */
+		v->type = TYPE_VECTOR;
+		v->lengthFree = VAR_SETITEM(item->type == TYPE_VECTOR ? VAR_ITEMTYPE(item) : item->type) | VAR_ARENABIT;
+	}
+	if (v->type == TYPE_VECTOR)
+	{
+		/* numbers keep their type: items of another type than the vector need boxing */
+		int type = isStr ? TYPE_ARRAY : symVectorType(v, item);
+		if (type != VAR_ITEMTYPE(v) && ! symVectorConvert(syms, v, type))
+			return PERR_NoMem;
+	}
+
+	/* PUSH a, a: content can be moved by symArrayReserve() */
+	self = item->type == v->type && item->vector == v->vector;
+	if (! symArrayReserve(syms, v, count, front))
+		return PERR_NoMem;
+	if (self) item->vector = v->vector;
+
+	mem = v->string;
+	if (front)
+	{
+		int cap = ARENA_CAP(mem), spare = ARENA_FRONT(mem), size = count * symItemSize(v);
+		mem -= size;
+		ARENA_CAP(mem) = cap + size;
+		ARENA_FRONT(mem) = spare - size;
+		v->string = mem;
+		index = 0;
+	}
+	else index = VAR_LENGTH(v);
+	v->lengthFree += count;
+
+	if (v->type == TYPE_VECTOR)
+	{
+		if (item->type == TYPE_VECTOR)
+			vecConvert((DATA8) v->vector + index * VAR_ITEMSIZE(v), VAR_ITEMTYPE(v), item->vector, VAR_ITEMTYPE(item), count);
+		else if (item->type == TYPE_ARRAY)
+			for (i = 0; i < count; VectorSet(v, index + i, item->array + i), i ++);
+		else
+			VectorSet(v, index, item);
+		return 0;
+	}
+
+	for (i = 0, src = v->array + index; i < count; i ++, src ++)
+	{
+		switch (item->type) {
+		case TYPE_VECTOR: VectorGet(item, i, src); continue;
+		case TYPE_ARRAY:  *src = item->array[i]; break;
+		default:          *src = *item;
+		}
+		if (src->type == TYPE_STR && ! symArenaString(syms, src))
+		{
+			/* keep the array consistent */
+			memset(src, 0, (count - i) * sizeof *src);
+			return PERR_NoMem;
+		}
+	}
+	return 0;
+}
+
+/*
+ * remove last or first item of array <var>: strings in <item> stay valid until the table is cleared, the
+ * reference of a nested array is transferred to <item>.
+ */
+int symArrayPop(SymTable syms, Result var, Variant item, Bool front)
+{
+	Variant v = &var->bin;
+	int     count, size;
+
+	if (v->type != TYPE_ARRAY && v->type != TYPE_VECTOR)
+		return PERR_InvalidOperation;
+	count = VAR_LENGTH(v);
+	if (count == 0)
+		return PERR_IndexOutOfRange;
+	if (! VAR_INARENA(v) && ! symArrayReserve(syms, v, 0, False))
+		return PERR_NoMem;
+
+	size = symItemSize(v);
+	if (v->type == TYPE_VECTOR)
+		VectorGet(v, front ? 0 : count - 1, item);
+	else
+		*item = v->array[front ? 0 : count - 1];
+
+	if (front)
+	{
+		DATA8 mem = v->string;
+		int   cap = ARENA_CAP(mem), spare = ARENA_FRONT(mem);
+		ARENA_CAP(mem + size) = cap - size;
+		ARENA_FRONT(mem + size) = spare + size;
+		v->string = mem + size;
 	}
+	v->lengthFree --;
+	return 0;
+}
+
+/* new items are integer 0, capacity is only increased if needed */
+int symArrayResize(SymTable syms, Result var, int length)
+{
+	Variant v = &var->bin;
+	int     count;
+
+	if (v->type != TYPE_ARRAY && v->type != TYPE_VECTOR)
+		return PERR_InvalidOperation;
+	if (length < 0 || length > VAR_MAXLENGTH)
+		return PERR_IndexOutOfRange;
 
-	// fprintf(stderr, "new var %s at index %d\n", name, var - slot->symbols);
+	count = length - VAR_LENGTH(v);
+	if (! VAR_INARENA(v) && ! symArrayReserve(syms, v, 0, False))
+		return PERR_NoMem;
+	if (v->type == TYPE_ARRAY)
+	{
+		int i;
+		for (i = length; i < VAR_LENGTH(v); VarRelease(v->array + i), i ++);
+	}
+	if (count > 0)
+	{
+		int size = symItemSize(v);
+		if (! symArrayReserve(syms, v, count, False))
+			return PERR_NoMem;
+		memset(v->string + VAR_LENGTH(v) * size, 0, count * size);
+	}
+	v->lengthFree += count;
+	return 0;
+}
 
-	slot->count ++;
-	CopyString(var->name, name, sizeof var->name - 1);
-	symTableAssign(var, v);
+/* case-insensitive FNV-1a: computed once per lookup, stored per slot */
+uint32_t symHashName(STRPTR name)
+{
+	uint32_t hash;
+	for (hash = 2166136261u; *name; name ++)
+		hash = (hash ^ toupper(*name)) * 16777619;
+	return hash;
+}
+
+static APTR symAllocTable(SymTable syms, int size)
+{
+	if (syms->arena)
+	{
+		APTR mem = symArenaAlloc(syms->arena, size);
+		if (mem) memset(mem, 0, size);
+		return mem;
+	}
+	return calloc(size, 1);
+}
+
+/* power of 2 capacity, load factor kept under 3/4: slots only contain hash + pointer, rehash is cheap */
+static Bool symTableGrow(SymTable syms)
+{
+	int     capa = syms->capa ? syms->capa * 2 : SYM_MINCAPA;
+	SymSlot slots = symAllocTable(syms, capa * sizeof *slots);
+	SymSlot old, eof;
+
+	if (slots == NULL) return False;
+
+	for (old = syms->slots, eof = old + syms->capa; old < eof; old ++)
+	{
+		if (old->var == NULL) continue;
+		int i;
+		for (i = old->hash & (capa - 1); slots[i].var; i = (i + 1) & (capa - 1));
+		slots[i] = *old;
+	}
+	if (syms->arena == NULL)
+		free(syms->slots);
+	syms->slots = slots;
+	syms->capa  = capa;
+	return True;
+}
+
+/* note: suppose that a previoius call to symTableFindByName(name) returned NULL */
+Result symTableAdd(SymTable syms, STRPTR name, Variant v)
+{
+	SymBlock block = syms->blocks;
+	Result   var;
+	uint32_t hash;
+	int      i, atom;
+
+	if ((syms->count + 1) * 4 > syms->capa * 3 && ! symTableGrow(syms))
+		return NULL;
+
+	/* names are shared with the byte code of programs */
+	atom = AtomIntern(name, MIN((int) strlen(name), MAX_VAR_NAME - 1));
+	if (atom < 0) return NULL;
+
+	if (block == NULL || block->count == SYM_BLOCK)
+	{
+		/* symbols cannot be relocated: reference on them will be all over the place */
+		block = symAllocTable(syms, sizeof *block);
+		if (block == NULL) return NULL;
+		block->next = syms->blocks;
+		syms->blocks = block;
+	}
+	var = block->vars + block->count ++;
+
+	hash = symHashName(name);
+	for (i = hash & (syms->capa - 1); syms->slots[i].var; i = (i + 1) & (syms->capa - 1));
+	syms->slots[i].hash = hash;
+	syms->slots[i].var  = var;
+	syms->count ++;
+
+	var->name = AtomName(atom);
+	symAssign(syms, var, v);
+	symValueLink(syms, var);
 
 	return var;
 }
 
 void symTableFree(SymTable syms)
 {
-	SymTable list, next;
+	SymBlock block, next;
 
-	for (list = syms; list; list = next)
+	for (block = syms->blocks; block; block = next)
 	{
 		/* need to free strings though */
 		int i;
-		for (i = 0; i < MAX_HASH_CAPA; i ++)
-		{
-			Result res = list->symbols + i;
-			if (VAR_TOFREE(&res->bin))
-				/* array or string actually */
-				free(res->bin.string);
-		}
+		for (i = 0; i < block->count; i ++)
+			symFreeVar(&block->vars[i].bin);
 
-		next = list->next;
-		if (list == syms) free(list->symbols);
-		else free(list);
+		next = block->next;
+		free(block);
 	}
+	free(syms->slots);
+	free(syms->values);
+	memset(syms, 0, sizeof *syms);
+}
 
+/* remove all symbols: table must have an arena, whose memory will be kept for reuse */
+void symTableClear(SymTable syms)
+{
+	SymArena arena = syms->arena;
+	SymBlock block;
+	int      i;
+
+	/* values can still reference shared blocks */
+	for (block = syms->blocks; block; block = block->next)
+		for (i = 0; i < block->count; symFreeVar(&block->vars[i].bin), i ++);
+	symArenaReset(arena);
+	free(syms->values);
 	memset(syms, 0, sizeof *syms);
+	syms->arena = arena;
 }
 
 void synTableDump(SymTable syms)
 {
-	SymTable list;
-	for (list = syms; list; list = list->next)
+	SymBlock block;
+	for (block = syms->blocks; block; block = block->next)
 	{
 		int i;
-		for (i = 0; i < MAX_HASH_CAPA; i ++)
+		for (i = 0; i < block->count; i ++)
 		{
-			Result res = list->symbols + i;
+			Result res = block->vars + i;
 			if (res->bin.type == TYPE_STR)
 				fprintf(stderr, "%s = %s\n", res->name, res->bin.string);
 		}
@@ -187,48 +776,52 @@ void synTableDump(SymTable syms)
 /* check if variable <name> is already defined */
 Result symTableFindByName(SymTable syms, STRPTR varName)
 {
-	while (syms && syms->symbols)
-	{
-		Result var = syms->symbols + crc32(0, varName, strlen(varName)) % MAX_HASH_CAPA;
+	if (syms->capa == 0)
+		return NULL;
 
-		if (strcasecmp(var->name, varName))
-		{
-			while (var->name[MAX_VAR_NAME-1])
-			{
-				/* linked list of symbols with same hash */
-				var = syms->symbols + var->name[MAX_VAR_NAME-1];
-				if (strcasecmp(var->name, varName) == 0)
-					return var;
-			}
-		}
-		else return var;
+	uint32_t hash = symHashName(varName);
+	SymSlot  slot;
+	int      i;
 
-		syms = syms->next;
+	for (i = hash & (syms->capa - 1); (slot = syms->slots + i)->var; i = (i + 1) & (syms->capa - 1))
+	{
+		if (slot->hash == hash && strcasecmp(slot->var->name, varName) == 0)
+			return slot->var;
 	}
 	return NULL;
 }
 
+/* find a variable with the same value than <v> (within epsilon for floating point) */
 Result symTableFindByValue(SymTable syms, Variant v)
 {
-	/* need to scan all entries :-/ */
-	while (syms && syms->symbols)
+	int bucket;
+
+	if (syms->values == NULL)
+		return NULL;
+
+	for (bucket = 0; bucket < 3; bucket ++)
 	{
-		Result res, eof;
-		for (res = syms->symbols, eof = res + MAX_HASH_CAPA; res < eof; res ++)
+		Result   res;
+		uint32_t key;
+
+		/* bucket of value first, then neighbors */
+		if (! symValueKey(v, &key, bucket == 2 ? -1 : bucket))
+			break;
+
+		for (res = syms->values[key & (syms->valueCapa - 1)]; res; res = res->valueNext)
 		{
-			if (res->name[0] && res->bin.type == v->type)
-			{
-				switch (res->bin.type & 15) {
-				case TYPE_DBL:   if (fabs(res->bin.real64 - v->real64) < 0.00001) return res; break;
-				case TYPE_FLOAT: if (fabsf(res->bin.real32 - v->real32) < 0.00001) return res; break;
-				case TYPE_STR:   if (strcmp(res->bin.string, v->string) == 0) return res; break;
-				case TYPE_INT:   if (res->bin.int64 == v->int64) return res; break;
-				case TYPE_INT32: if (res->bin.int32 == v->int32) return res; break;
-				default:         break;
-				}
+			if (res->valueKey != key || res->bin.type != v->type) continue;
+			switch (res->bin.type) {
+			case TYPE_DBL:   if (fabs(res->bin.real64 - v->real64) < SYM_EPSILON) return res; break;
+			case TYPE_FLOAT: if (fabsf(res->bin.real32 - v->real32) < SYM_EPSILON) return res; break;
+			case TYPE_STR:   if (strcmp(res->bin.string, v->string) == 0) return res; break;
+			case TYPE_INT:   if (res->bin.int64 == v->int64) return res; break;
+			case TYPE_INT32: if (res->bin.int32 == v->int32) return res; break;
+			default:         break;
 			}
 		}
-		syms = syms->next;
+		if (v->type != TYPE_DBL && v->type != TYPE_FLOAT)
+			break;
 	}
 	return NULL;
 }
@@ -12,20 +12,68 @@
 
 typedef struct SymTable_t       SymTable_t;
 typedef struct SymTable_t *     SymTable;
+typedef struct SymArena_t       SymArena_t;
+typedef struct SymArena_t *     SymArena;
+typedef struct ArenaBlock_t *   ArenaBlock;
+typedef struct SymSlot_t *      SymSlot;
+typedef struct SymBlock_t *     SymBlock;
 
 struct SymTable_t
 {
-	SymTable next;
-	Result   symbols;
-	int      count;
+	SymSlot  slots;              /* open addressing, <capa> is a power of 2 */
+	SymBlock blocks;             /* where Result_t are stored: they are never relocated */
+	SymArena arena;              /* if not NULL, symbols and values are allocated from here */
+	Result * values;             /* index by value for symTableFindByValue() (not for arena tables) */
+	int      count, capa;
+	int      valueCapa;
 };
 
+struct SymSlot_t
+{
+	uint32_t hash;               /* of var->name, case-insensitive */
+	Result   var;
+};
+
+#define SYM_BLOCK                32
+#define SYM_MINCAPA              16
+#define SYM_EPSILON              0.00001  /* float values closer than that are considered the same */
+
+struct SymBlock_t
+{
+	SymBlock         next;
+	int              count;
+	struct Result_t  vars[SYM_BLOCK];
+};
+
+struct SymArena_t
+{
+	ArenaBlock first, cur;
+};
+
+struct ArenaBlock_t
+{
+	ArenaBlock next;
+	int        used, max;
+};
+
+#define ARENA_BLOCK              4096
+#define VAR_ARENABIT             0x20000000
+#define VAR_INARENA(variant)     ((variant)->lengthFree & VAR_ARENABIT)
+
 Result symTableAdd(SymTable, STRPTR name, Variant);
 void   symTableFree(SymTable);
+void   symTableClear(SymTable);
 Result symTableFindByName(SymTable, STRPTR varName);
 Result symTableFindByValue(SymTable, Variant);
-void   symTableAssign(Result assignTo, Variant value);
+void   symTableAssign(SymTable, Result assignTo, Variant value);
+int    symTableAppend(SymTable, Result var, Variant str);
+APTR   symArenaAlloc(SymArena, int size);
+void   symArenaReset(SymArena);
+int    symArrayPush(SymTable, Result var, Variant item, Bool front);
+int    symArrayPop(SymTable, Result var, Variant item, Bool front);
+int    symArrayResize(SymTable, Result var, int length);
 
+uint32_t symHashName(STRPTR name);
 uint32_t crc32(uint32_t crc, DATA8 buf, int max);
 
 
@@ -15,6 +15,7 @@
 #include "graph.h"
 #include "config.h"
 #include "script.h"
+#include "sheet.h"
 #include "extra.h"
 #include "ui.h"
 
@@ -79,7 +80,13 @@ static struct
 	SIT_Widget expr, graph, prog, light;
 	ListHead   rowTags;
 	int        insertAt;
-}	ctrls;
+	int        replace;              /* result rows of previous evaluation that can be overwritten */
+	int        batch;                /* don't scroll list until all rows are evaluated */
+	int        mapIdx, mapOrd;       /* last list index <-> expression ordinal looked up */
+	int        promote;              /* visible row waiting to be evaluated */
+	int        modified;             /* expression list has to be saved again */
+	ULONG      lastSave;
+}	ctrls = {.promote = -1};
 
 struct SIT_Accel_t defAccels[] = {
 	{SITK_FlagCapture + SITK_Escape, SITE_OnClose},
@@ -178,6 +185,10 @@ static int highlightError(SIT_Widget w, APTR cd, APTR ud)
 	if (tag && tag != TAG_STDOUT && tag->res.type == TYPE_ERR)
 		memcpy(paint->fgColor, "\xff\x00\x00\xff", 4);
 
+	/* not evaluated yet, but visible: do it before the rest */
+	if (tag && tag != TAG_STDOUT && tag->res.type == TYPE_VOID && (ctrls.promote < 0 || ctrls.promote > paint->rowColumn>>8))
+		ctrls.promote = paint->rowColumn>>8;
+
 	return 0;
 }
 
@@ -195,6 +206,27 @@ static int selectLine(int keycode)
 	return 1;
 }
 
+/* add a result row at ctrls.insertAt */
+static void addRowToList(APTR tag, STRPTR text)
+{
+	int item;
+	if (ctrls.replace > 0)
+	{
+		/* overwrite result of previous evaluation: much cheaper than delete + insert */
+		RowTag old;
+		item = ctrls.insertAt;
+		SIT_GetValues(ctrls.list, SIT_RowTag(item), &old, NULL);
+		if (old != TAG_STDOUT) freeRowTag(old);
+		SIT_ListSetCell(ctrls.list, item, 0, tag, DontChange, text);
+		ctrls.replace --;
+	}
+	else item = SIT_ListInsertItem(ctrls.list, ctrls.insertAt, tag, text);
+
+	if (! ctrls.batch)
+		SIT_SetValues(ctrls.list, SIT_MakeVisible, item, NULL);
+	if (ctrls.insertAt >= 0) ctrls.insertAt ++;
+}
+
 /* format <v> to be displayed in list box */
 void formatExprToList(Variant v, STRPTR varName)
 {
@@ -205,8 +237,7 @@ void formatExprToList(Variant v, STRPTR varName)
 	tag->var = varName;
 	formatResult(&tag->res, varName, buffer, sizeof buffer);
 
-	int item = SIT_ListInsertItem(ctrls.list, ctrls.insertAt, tag, buffer);
-	SIT_SetValues(ctrls.list, SIT_MakeVisible, item, NULL);
+	addRowToList(tag, buffer);
 }
 
 void addOutputToList(STRPTR line)
@@ -224,114 +255,199 @@ void addOutputToList(STRPTR line)
 	for (cleanup = line; *cleanup; cleanup ++)
 		if (*cleanup < 32) *cleanup = 32;
 
-	int item = SIT_ListInsertItem(ctrls.list, ctrls.insertAt, TAG_STDOUT, line);
-	SIT_SetValues(ctrls.list, SIT_MakeVisible, item, NULL);
-	if (ctrls.insertAt >= 0) ctrls.insertAt ++;
+	addRowToList(TAG_STDOUT, line);
 }
 
-/* expression on an existing line has changed: redo operation and update results */
-static void redoOperation(STRPTR expr, int startRow)
+/* expression on an existing line has changed: redo operation and update results (<job>: already evaluated) */
+static void redoOperation(STRPTR expr, int startRow, SheetRow row, EvalJob job)
 {
 	struct ParseExprData_t data = {.cb = formatExprToList};
-	/* delete following result rows */
+	RowTag tag;
+	TEXT   tempVar[10];
+	/* following result rows will be overwritten */
 	ctrls.insertAt = ++ startRow;
-	for (;;)
+	for (ctrls.replace = 0; ; ctrls.replace ++)
 	{
-		RowTag tag;
-		SIT_GetValues(ctrls.list, SIT_RowTag(startRow), &tag, NULL);
-		if (tag)
+		SIT_GetValues(ctrls.list, SIT_RowTag(startRow + ctrls.replace), &tag, NULL);
+		if (tag == NULL) break;
+		if (tag != TAG_STDOUT && tag->var && tag->var[0] == '$')
 		{
-			if (tag != TAG_STDOUT && tag->var && tag->var[0] == '$')
-			{
-				/* temp var name: keep it assigned to same name */
-				data.assignTo = tag->var;
-			}
-			SIT_ListDeleteRow(ctrls.list, startRow);
+			/* temp var name: keep it assigned to same name */
+			data.assignTo = tag->var;
+		}
+		else if (tag != TAG_STDOUT && tag->res.type == TYPE_VOID && tag->res.int32 > 0)
+		{
+			/* not evaluated yet: temp var from previous session */
+			sprintf(tempVar, "$%d", tag->res.int32);
+			data.assignTo = tempVar;
 		}
-		else break;
 	}
 
 	/* add new restuls just after */
-	evalExpr(expr, &data);
+	if (row) sheetTrack(row, &data);
+	if (job) evalReplay(job, &data);
+	else     evalExprCode(expr, row ? &row->code : NULL, &data);
+	if (row) sheetCommit(row, expr);
+
+	/* less results than before */
+	for (; ctrls.replace > 0; ctrls.replace --)
+	{
+		SIT_GetValues(ctrls.list, SIT_RowTag(ctrls.insertAt), &tag, NULL);
+		if (tag != TAG_STDOUT) freeRowTag(tag);
+		SIT_ListDeleteRow(ctrls.list, ctrls.insertAt);
+	}
 }
 
-/* doesn't have to be precise, worst case scenario is to recompute an expression which will give the same result */
-static Bool hasVar(STRPTR expr, STRPTR var)
+/* evaluate an expression added at the end of list */
+static SheetRow evalExprRow(STRPTR expr, ParseExprData data)
 {
-	int len = strlen(var);
-	while (expr)
-	{
-		expr = strstr(expr, var);
+	SheetRow row = sheetAddRow();
+	if (row) sheetTrack(row, data);
+	evalExprCode(expr, row ? &row->code : NULL, data);
+	if (row) sheetCommit(row, expr);
+	return row;
+}
 
-		if (expr)
-		{
-			expr += len;
-			if (var[0] == '$')
-			{
-				/* $%d == temp varname */
-				if (! isdigit(expr[0])) return True;
-			}
-			/* [:alpha:][:alnum]* == regular variable name */
-			else if (! isalnum(expr[0]))
-			{
-				return True;
-			}
-		}
+/* list index -> index among expression rows: result rows only change after the last one looked up */
+static int exprOrdinal(int index)
+{
+	int i, ordinal;
+	if (index < ctrls.mapIdx)
+		ctrls.mapIdx = ctrls.mapOrd = 0;
+
+	for (i = ctrls.mapIdx, ordinal = ctrls.mapOrd; i < index; )
+	{
+		RowTag rowtag;
+		SIT_GetValues(ctrls.list, SIT_RowTag(++ i), &rowtag, NULL);
+		if (rowtag == NULL) ordinal ++;
 	}
-	return False;
+	ctrls.mapIdx = index;
+	ctrls.mapOrd = ordinal;
+	return ordinal;
 }
 
-/* modify subsequent row that might depend on previous results */
-static void propagateResult(RowTag tag, int startRow)
+/* inverse of exprOrdinal() */
+static int exprListIndex(int ordinal)
 {
-	STRPTR check[16];
-	int    max, count, i;
+	int index, count, i;
+	if (ordinal < ctrls.mapOrd)
+		ctrls.mapIdx = ctrls.mapOrd = 0;
 
-	/* you can see this as a very rudimentary spreadsheet */
 	SIT_GetValues(ctrls.list, SIT_ItemCount, &count, NULL);
-	check[0] = tag->var;
-	max = 1;
-
-	next: while (startRow < count)
+	for (index = ctrls.mapIdx, i = ctrls.mapOrd; i < ordinal && index < count; )
 	{
 		RowTag rowtag;
-		SIT_GetValues(ctrls.list, SIT_RowTag(startRow), &rowtag, NULL);
-		if (rowtag == NULL)
+		SIT_GetValues(ctrls.list, SIT_RowTag(++ index), &rowtag, NULL);
+		if (rowtag == NULL) i ++;
+	}
+	ctrls.mapIdx = index;
+	ctrls.mapOrd = i;
+	return index;
+}
+
+/* evaluate one row that is needed to get <target> up to date (could be <target> itself) */
+static void evalStep(SheetRow target)
+{
+	SheetRow row   = sheetNextEval(target);
+	int      index = exprListIndex(sheetOrdinal(row));
+
+	scriptReset(NULL);
+	redoOperation(SIT_ListGetCellText(ctrls.list, 0, index), index, row, NULL);
+}
+
+/* rows that do not depend on each other: evaluated by worker threads, results are added in list order */
+static void evalBatch(SheetRow * rows, int count, ULONG end)
+{
+	struct EvalJob_t jobs[EVAL_BATCH];
+	int i;
+
+	for (i = 0; i < count; i ++)
+	{
+		jobs[i].expr = SIT_ListGetCellText(ctrls.list, 0, exprListIndex(sheetOrdinal(rows[i])));
+		jobs[i].code = &rows[i]->code;
+	}
+
+	evalJobs(jobs, count, end);
+
+	for (i = 0; i < count && jobs[i].error >= 0 && ! evalStale(jobs + i); i ++)
+	{
+		/* previous rows may have added or removed results */
+		int index = exprListIndex(sheetOrdinal(rows[i]));
+		redoOperation(SIT_ListGetCellText(ctrls.list, 0, index), index, rows[i], jobs + i);
+	}
+	/* no worker available */
+	if (i == 0) evalStep(rows[0]);
+	/* rows not replayed are still dirty */
+	for (i = 0; i < count; evalFreeJob(jobs + i), i ++);
+}
+
+/* get <row> up to date, including rows it started to depend on once evaluated */
+static void evalRow(SheetRow row)
+{
+	int max;
+	/* should be reached way before the limit */
+	for (max = 0; max < MAX_EVAL_STEP; max ++)
+	{
+		if (sheetIsDirty(row))
+			evalStep(row);
+		else if (sheetNextEval(row) != row)
+			/* it reads something that is not up to date yet */
+			sheetMarkDirty(row);
+		else
+			break;
+	}
+}
+
+/*
+ * rows marked by the dependency graph or not evaluated yet on startup: done in the background, a few at
+ * a time, rows visible in the list first. You can see this as a very rudimentary spreadsheet.
+ */
+static void evalPending(ULONG end)
+{
+	ctrls.batch = 1;
+	ctrls.modified = 1;
+	while (sheetPending() > 0 && TimeMS() < end)
+	{
+		SheetRow target = NULL;
+		RowTag   tag;
+		int      index = ctrls.promote;
+
+		if (index >= 0)
 		{
-			STRPTR expr = SIT_ListGetCellText(ctrls.list, 0, startRow);
-			for (i = 0; i < max; i ++)
+			/* get to expression row */
+			for (index --; index > 0; index --)
 			{
-				if (! hasVar(expr, check[i])) continue;
-
-				redoOperation(expr, startRow);
-				SIT_GetValues(ctrls.list, SIT_ItemCount, &count, NULL);
-				for (startRow ++; startRow < count; startRow ++)
-				{
-					/* add the list of variables modified by this <expr> to the list we need to check for subsequent expression */
-					SIT_GetValues(ctrls.list, SIT_RowTag(startRow), &rowtag, NULL);
-					/* rowtag == NULL => next expression */
-					if (rowtag == NULL) break;
-					if (rowtag->var && max < DIM(check))
-						check[max++] = rowtag->var;
-				}
-				goto next;
+				SIT_GetValues(ctrls.list, SIT_RowTag(index), &tag, NULL);
+				if (tag == NULL) break;
 			}
-			/* this line does not depend on previous lines: skip everything */
-			for (startRow ++; startRow < count; startRow ++)
+			target = sheetGetRow(exprOrdinal(index));
+			if (target && ! sheetIsDirty(target)) target = NULL;
+			ctrls.promote = -1;
+		}
+		if (target == NULL)
+		{
+			SheetRow rows[EVAL_BATCH];
+			int      count = sheetReadyRows(rows, EVAL_BATCH);
+			if (count > 1)
 			{
-				SIT_GetValues(ctrls.list, SIT_RowTag(startRow), &rowtag, NULL);
-				if (rowtag == NULL) break;
+				evalBatch(rows, count, end);
+				continue;
 			}
+			target = sheetFirstDirty();
 		}
-		else startRow ++;
+		if (target)
+			evalStep(target);
 	}
+	ctrls.batch = 0;
 }
 
 /* evaluate what's in the edit box and add result to the list */
 static Bool addExprToList(STRPTR expr)
 {
 	struct ParseExprData_t data = {.cb = formatExprToList};
+	SheetRow row;
 	int index;
+	ctrls.modified = 1;
 	SIT_GetValues(ctrls.list, SIT_SelectedIndex, &index, NULL);
 	if (index >= 0)
 	{
@@ -339,17 +455,15 @@ static Bool addExprToList(STRPTR expr)
 		SIT_GetValues(ctrls.list, SIT_RowTag(index), &tag, NULL);
 		if (tag == NULL)
 		{
-			/* expression selected: modify this line */
+			/* expression selected: modify this line, the ones depending on it will be done in evalPending() */
+			row = sheetGetRow(exprOrdinal(index));
 			SIT_ListSetCell(ctrls.list, index, 0, DontChangePtr, DontChange, expr);
-			redoOperation(expr, index);
-
-			/* check if there was a meaningful result */
-			SIT_GetValues(ctrls.list, SIT_RowTag(index+1), &tag, NULL);
-			if (tag && tag != TAG_STDOUT && tag->res.type != TYPE_ERR && tag->var)
+			if (row)
 			{
-				/* we might have to propagate the result to the following rows */
-				propagateResult(tag, index + 1);
+				sheetMarkDirty(row);
+				evalRow(row);
 			}
+			else redoOperation(expr, index, NULL, NULL);
 
 			/* keep content of edit field */
 			return False;
@@ -358,8 +472,9 @@ static Bool addExprToList(STRPTR expr)
 	ctrls.insertAt = -1;
 	SIT_SetValues(ctrls.list, SIT_SelectedIndex, -1, NULL);
 	SIT_ListInsertItem(ctrls.list, -1, NULL, expr);
-	scriptReset();
-	evalExpr(expr, &data);
+	scriptReset(NULL);
+	row = evalExprRow(expr, &data);
+	if (row) evalRow(row);
 	return True;
 }
 
@@ -376,7 +491,11 @@ static void deleteExpr(int index)
 	}
 
 	/* expression row: delete it */
+	sheetDelRow(exprOrdinal(index));
 	SIT_ListDeleteRow(ctrls.list, index);
+	ctrls.mapIdx = ctrls.mapOrd = 0;
+	ctrls.promote = -1;
+	ctrls.modified = 1;
 
 	/* delete result row(s) */
 	for (;;)
@@ -435,6 +554,10 @@ static int redirectKeys(SIT_Widget w, APTR cd, APTR ud)
 		switch (appcfg.mode) {
 		case MODE_EXPR:
 			SIT_ListDeleteRow(ctrls.list, DeleteAllRows);
+			ctrls.mapIdx = ctrls.mapOrd = 0;
+			ctrls.promote = -1;
+			ctrls.modified = 1;
+			sheetClear();
 			freeAllVars();
 			break;
 		case MODE_GRAPH:
@@ -574,6 +697,9 @@ static int showHelp(SIT_Widget w, APTR cd, APTR ud)
 			"<hdr>PRINT</hdr> expr\n"
 			"<hdr>RETURN</hdr> expr\n"
 			"<hdr>ARGV</hdr> <sec>(array)</sec>\n"
+			"\n"
+			"<sec>DEPTH:</sec> max nested calls\n"
+			"<sec># RETURN prog(...) does not count</sec>\n"
 		;
 
 		SIT_CreateWidgets(diag,
@@ -784,6 +910,165 @@ static int about(SIT_Widget w, APTR cd, APTR ud)
 /*
  * creation of the calculator main user interface
  */
+/*
+ * _RESULTS chunk: what was displayed for each row of _EXPR, and what it depended on. Format is:
+ * [version][nb expr: 2 bytes BE] then for each expr: [fingerprint: 4 bytes BE][refs][nb results][results...]
+ * with a result being [var name][0][type][unit][value: 8 bytes]. A fingerprint of 0 means: evaluate again.
+ */
+#define RESULTS_VERSION     2
+#define RESULT_SIZE         10   /* excluding var name */
+
+static int saveRowResults(int index, int count, SheetRow row, DATA8 out)
+{
+	uint32_t fingerprint = row->fingerprint;
+	RowTag   tag;
+	int      i, nb, size;
+
+	/* only plain numbers are cached: strings, arrays and errors will be evaluated again */
+	for (i = index + 1, nb = 0; i < count; i ++, nb ++)
+	{
+		SIT_GetValues(ctrls.list, SIT_RowTag(i), &tag, NULL);
+		if (tag == NULL) break;
+		if (tag == TAG_STDOUT || tag->res.type > TYPE_FLOAT || tag->var == NULL || nb == 255)
+			fingerprint = 0;
+	}
+	if (fingerprint == 0) nb = 0;
+
+	size = 4 + sheetSaveRefs(row, out ? out + 4 : NULL);
+	if (out)
+	{
+		out[0] = fingerprint >> 24;
+		out[1] = fingerprint >> 16;
+		out[2] = fingerprint >> 8;
+		out[3] = fingerprint;
+		out[size] = nb;
+	}
+	for (size ++, i = index + 1; nb > 0; i ++, nb --)
+	{
+		int len;
+		SIT_GetValues(ctrls.list, SIT_RowTag(i), &tag, NULL);
+		len = strlen(tag->var) + 1;
+		if (out)
+		{
+			DATA8 p = out + size;
+			memcpy(p, tag->var, len);
+			p += len;
+			p[0] = tag->res.type;
+			p[1] = tag->res.unit;
+			memcpy(p + 2, &tag->res.int64, 8);
+		}
+		size += len + RESULT_SIZE;
+	}
+	return size;
+}
+
+/* display results saved by saveRowResults(): if <data> is NULL, only check they are valid */
+static DATA8 restoreRowResults(DATA8 mem, DATA8 eof, ParseExprData data)
+{
+	int count;
+	if (mem >= eof) return NULL;
+	for (count = *mem ++; count > 0; count --)
+	{
+		DATA8 end = memchr(mem, 0, eof - mem);
+		if (end == NULL || end + RESULT_SIZE >= eof || end[1] > TYPE_FLOAT)
+			return NULL;
+		if (data)
+		{
+			VariantBuf v = {.type = end[1], .unit = end[2]};
+			memcpy(&v.int64, end + 3, 8);
+			restoreResult(mem, &v, data);
+		}
+		mem = end + 1 + RESULT_SIZE;
+	}
+	return mem;
+}
+
+extern int tempVarCount;
+
+/* restore expressions from previous session: nothing is evaluated here, see evalPending() */
+static void restoreExpr(void)
+{
+	struct ParseExprData_t data = {.cb = formatExprToList};
+	struct RowCache_t { uint32_t fingerprint; DATA8 results; } * cache;
+	DATA8 exprList = configGetChunk("_EXPR", NULL);
+	DATA8 results, eof, expr;
+	TEXT  tempVar[10];
+	int   nb, i;
+
+	if (exprList == NULL) return;
+
+	/* nb of expressions: only 16bits before config v2 */
+	if (config->version < 2)
+		nb = (exprList[0] << 8) | exprList[1], expr = exprList + 2;
+	else
+		nb = (exprList[0] << 24) | (exprList[1] << 16) | (exprList[2] << 8) | exprList[3], expr = exprList + 4;
+
+	results = configGetChunk("_RESULTS", &i);
+	eof = results + i;
+	cache = calloc(nb, sizeof *cache);
+	if (results == NULL || cache == NULL || i < 5 || results[0] != RESULTS_VERSION ||
+	    ((results[1] << 24) | (results[2] << 16) | (results[3] << 8) | results[4]) != nb)
+		results = NULL;
+	else
+		results += 5;
+
+	/* rebuild dependency graph first: rows evaluated again will be able to mark the ones depending on them */
+	for (i = 0; i < nb; i ++)
+	{
+		SheetRow row = sheetAddRow();
+		DATA8    refs;
+		if (row == NULL || results == NULL || results + 4 > eof) continue;
+		refs = sheetRestoreRefs(row, results + 4, eof);
+		if (refs == NULL) { results = NULL; continue; }
+		cache[i].fingerprint = (results[0] << 24) | (results[1] << 16) | (results[2] << 8) | results[3];
+		cache[i].results = refs;
+		results = restoreRowResults(refs, eof, NULL);
+		if (results == NULL) cache[i].fingerprint = 0;
+	}
+
+	ctrls.batch = 1;
+	for (i = 0; i < nb; i ++, expr = strchr(expr + 1, 0) + 1)
+	{
+		SheetRow row = sheetGetRow(i);
+		ctrls.insertAt = -1;
+		SIT_ListInsertItem(ctrls.list, -1, NULL, expr + 1);
+
+		if (cache && cache[i].fingerprint && row && cache[i].fingerprint == sheetFingerprint(row, expr + 1))
+		{
+			row->fingerprint = cache[i].fingerprint;
+			restoreRowResults(cache[i].results, eof, &data);
+			sheetRestored(row);
+		}
+		else if (row)
+		{
+			/* will be evaluated in evalPending(), don't let anything else take its temp var */
+			RowTag tag = allocRowTag();
+			memset(tag, 0, sizeof *tag);
+			tag->res.type  = TYPE_VOID;
+			tag->res.int32 = expr[0];
+			if (tempVarCount < expr[0])
+				tempVarCount = expr[0];
+			SIT_ListInsertItem(ctrls.list, -1, tag, "   ...");
+			sheetMarkDirty(row);
+		}
+		else /* out of memory: not tracked */
+		{
+			if (expr[0] > 0)
+			{
+				data.assignTo = tempVar;
+				sprintf(tempVar, "$%d", expr[0]);
+			}
+			else data.assignTo = NULL;
+			scriptReset(NULL);
+			evalExpr(expr + 1, &data);
+		}
+	}
+	ctrls.batch = 0;
+	free(cache);
+	SIT_GetValues(ctrls.list, SIT_ItemCount, &nb, NULL);
+	SIT_SetValues(ctrls.list, SIT_MakeVisible, nb - 1, NULL);
+}
+
 static void createUI(SIT_Widget app)
 {
 	static struct SIT_Accel_t accels[] = {
@@ -809,6 +1094,9 @@ static void createUI(SIT_Widget app)
 		{0}
 	};
 
+	if (appcfg.maxCallDepth <= 0 || appcfg.maxCallDepth > MAX_CALL_LIMIT)
+		appcfg.maxCallDepth = MAX_CALL_STACK;
+
 	SIT_CreateWidgets(app,
 		/* default unit for conversion */
 		"<label name=title right=FORM title='" APPNAME " v" VERSION "'>"
@@ -868,7 +1156,10 @@ static void createUI(SIT_Widget app)
 			"<label name=size.danger tabNum=4 title=SIZE: left=WIDGET,posval,0.3em top=MIDDLE,addprog>"
 			"<label name=sizeval tabNum=4 left=WIDGET,size,0.3em top=MIDDLE,addprog>"
 			"<button name=check tabNum=4 title=Check right=FORM top=OPPOSITE,addprog>"
-			"<label name=error tabNum=4 overflow=", SITV_Hidden, "left=WIDGET,delprog,0.3em right=WIDGET,check,0.3em"
+			"<editbox name=depthval tabNum=4 width=4em editType=", SITV_Integer, "minValue=10 maxValue=", MAX_CALL_LIMIT,
+			" curValue=", &appcfg.maxCallDepth, "right=WIDGET,check,0.3em top=MIDDLE,addprog>"
+			"<label name=depth.danger tabNum=4 title=DEPTH: right=WIDGET,depthval,0.3em top=MIDDLE,addprog>"
+			"<label name=error tabNum=4 overflow=", SITV_Hidden, "left=WIDGET,delprog,0.3em right=WIDGET,depth,0.3em"
 			" top=MIDDLE,check visible=0 style='white-space: pre'>"
 
 			"<listbox name=proglist nextCtrl=NONE tabNum=4 left=FORM top=FORM bottom=WIDGET,addprog,0.3em right=OPPOSITE,delprog"
@@ -929,27 +1220,7 @@ static void createUI(SIT_Widget app)
 
 
 	/* restore expressions from previous session */
-	DATA8 exprList = configGetChunk("_EXPR", NULL);
-	if (exprList)
-	{
-		struct ParseExprData_t data = {.cb = formatExprToList};
-		TEXT tempVar[10];
-		int  nb;
-		for (nb = (exprList[0] << 8) | exprList[1], exprList += 2; nb > 0; nb --)
-		{
-			if (exprList[0] > 0)
-			{
-				data.assignTo = tempVar;
-				sprintf(tempVar, "$%d", exprList[0]);
-			}
-			else data.assignTo = NULL;
-			ctrls.insertAt = -1;
-			SIT_ListInsertItem(ctrls.list, -1, NULL, exprList + 1);
-			scriptReset();
-			evalExpr(exprList + 1, &data);
-			exprList = strchr(exprList, 0) + 1;
-		}
-	}
+	restoreExpr();
 
 	/* set keyboard focus on correct input depending on operating mode */
 	switch (appcfg.mode) {
@@ -983,56 +1254,103 @@ static void readPrefs(void)
 	setDefUnit(NULL, NULL, NULL);
 }
 
+/* save what is needed to avoid evaluating everything again on next startup */
+static void saveResults(int count, int nb)
+{
+	struct ConfigWriter_t writer;
+	RowTag tag;
+	DATA8  mem;
+	int    i, ordinal;
+
+	configStartChunk(&writer, "_RESULTS");
+	mem = configWrite(&writer, NULL, 5);
+	if (mem)
+	{
+		mem[0] = RESULTS_VERSION;
+		mem[1] = nb >> 24;
+		mem[2] = nb >> 16;
+		mem[3] = nb >> 8;
+		mem[4] = nb;
+	}
+	for (i = ordinal = 0; i < count && writer.size >= 0; i ++)
+	{
+		SIT_GetValues(ctrls.list, SIT_RowTag(i), &tag, NULL);
+		if (tag == NULL)
+		{
+			SheetRow row = sheetGetRow(ordinal ++);
+			/* out of sync (out of memory): will be evaluated again */
+			if (row == NULL) break;
+			mem = configWrite(&writer, NULL, saveRowResults(i, count, row, NULL));
+			if (mem) saveRowResults(i, count, row, mem);
+		}
+	}
+
+	if (i < count || writer.size < 0)
+	{
+		/* an outdated cache is worse than no cache */
+		free(writer.buffer);
+		configDelChunk("_RESULTS");
+	}
+	else configEndChunk(&writer);
+}
+
 /* save all expression in ctrls.list */
 static void saveExpr(void)
 {
+	struct ConfigWriter_t writer;
 	RowTag tag;
-	DATA8  mem, prev;
-	int    size, count, i, nb;
+	DATA8  mem;
+	int    count, i, nb, prev;
 
 	SIT_GetValues(ctrls.list, SIT_ItemCount, &count, NULL);
 
-	for (i = 0, size = nb = 0; i < count; i ++)
+	for (i = nb = 0; i < count; i ++)
 	{
 		SIT_GetValues(ctrls.list, SIT_RowTag(i), &tag, NULL);
-		if (tag == NULL)
-			size += strlen(SIT_ListGetCellText(ctrls.list, 0, i)) + 2, nb ++;
+		if (tag == NULL) nb ++;
 	}
 
-	if (size > 0)
+	if (nb > 0)
 	{
-		DATA8 start = mem = alloca(size + 2);
-		/* 2 bytes for nb of expr */
-		mem[0] = nb >> 8;
-		mem[1] = nb;
+		configStartChunk(&writer, "_EXPR");
+		/* 4 bytes for nb of expr */
+		mem = configWrite(&writer, NULL, 4);
+		if (mem)
+		{
+			mem[0] = nb >> 24;
+			mem[1] = nb >> 16;
+			mem[2] = nb >> 8;
+			mem[3] = nb;
+		}
 
 		/* expression right after, separated by 0 */
-		for (i = 0, mem += 2, prev = mem; i < count; i ++)
+		for (i = prev = 0; i < count && writer.size >= 0; i ++)
 		{
 			SIT_GetValues(ctrls.list, SIT_RowTag(i), &tag, NULL);
 			if (tag == NULL)
 			{
-				prev = mem;
-				prev[0] = 0;
-				mem += sprintf(mem + 1, "%s", SIT_ListGetCellText(ctrls.list, 0, i)) + 2;
+				STRPTR expr = SIT_ListGetCellText(ctrls.list, 0, i);
+				prev = writer.size;
+				configWrite(&writer, "", 1);
+				configWrite(&writer, expr, strlen(expr) + 1);
 			}
 			else if (tag != TAG_STDOUT && tag->var && tag->var[0] == '$')
 			{
 				/* keep this expression assigned to the same temp var */
-				prev[0] = atoi(tag->var+1);
+				writer.buffer[prev] = atoi(tag->var+1);
+			}
+			else if (tag != TAG_STDOUT && tag->res.type == TYPE_VOID)
+			{
+				/* not evaluated yet */
+				writer.buffer[prev] = tag->res.int32;
 			}
 		}
 
-		DATA8 old = configGetChunk("_EXPR", &nb);
-
-		/* do not overwrite stuff, if we don't have to */
-		if (nb < size + 2 || memcmp(start, old, size + 2))
-		{
-			old = configAddChunk("_EXPR", size + 2);
-			memcpy(old, start, size + 2);
-		}
+		/* out of memory: previous content will be kept, but not its results */
+		if (writer.size < 0) configDelChunk("_RESULTS");
+		else configEndChunk(&writer), saveResults(count, nb);
 	}
-	else configDelChunk("_EXPR");
+	else configDelChunk("_EXPR"), configDelChunk("_RESULTS");
 }
 
 /*
@@ -1147,12 +1465,26 @@ int main(int nb, char * argv[])
 		/* update and render */
 		if (SIT_RenderNodes(FrameGetTime()))
 			SDL_GL_SwapBuffers();
+
+		/* rows that still need to be evaluated: use some of the remaining frame time */
+		if (sheetPending() > 0)
+			evalPending(TimeMS() + EVAL_BUDGET);
+
+		/* append what has changed to config file, in case we crash */
+		if (TimeMS() - ctrls.lastSave > SAVE_DELAY)
+		{
+			if (ctrls.modified)
+				saveExpr(), ctrls.modified = 0;
+			configFlush();
+			ctrls.lastSave = TimeMS();
+		}
 		FrameWaitNext();
 	}
 
 	exit:
 
 	scriptCommitChanges();
+	scriptSaveByteCode();
 	saveExpr();
 	configSave();
 
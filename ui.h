@@ -44,6 +44,10 @@ enum
 #define VERSION       "1.1"
 
 #define TAG_STDOUT    ((APTR)1)
+#define EVAL_BUDGET   10       /* ms per frame for evaluating rows in the background */
+#define MAX_EVAL_STEP 1024
+#define EVAL_BATCH    32       /* dirty rows looked at for evaluation by worker threads */
+#define SAVE_DELAY    5000     /* ms between 2 incremental saves of config */
 
 #ifdef __GNUC__
  #define COMPILER     "gcc " TOSTRING(__GNUC__) "." TOSTRING(__GNUC_MINOR__) "." TOSTRING(__GNUC_PATCHLEVEL__)
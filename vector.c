@@ -0,0 +1,609 @@
+/*
+ * vector.c: element-wise arithmetic on typed arrays. Kernels are selected the first time they are
+ *           needed, according to what the CPU supports: AVX2, SSE2 or plain C.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "UtilityLibLite.h"
+#include "parse.h"
+#include "vector.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define VEC_X86
+#endif
+
+typedef void (*VecKernel)(APTR dst, APTR src1, APTR src2, int count, int scalar);
+
+/* plain C version, also used for remaining items of SIMD kernels */
+#define VEC_LOOP(T, op) \
+	switch (scalar) { \
+	case VEC_BOTH:    for (; i < count; i ++) d[i] = a[i] op b[i]; break; \
+	case VEC_SCALAR1: for (s = a[0]; i < count; i ++) d[i] = s op b[i]; break; \
+	case VEC_SCALAR2: for (s = b[0]; i < count; i ++) d[i] = a[i] op s; \
+	}
+
+#define VEC_KERNEL(name, T, op) \
+static void name(APTR dst, APTR src1, APTR src2, int count, int scalar) \
+{ \
+	T * d = dst, * a = src1, * b = src2, s; \
+	int i = 0; \
+	VEC_LOOP(T, op) \
+}
+
+VEC_KERNEL(addI64, int64_t, +)  VEC_KERNEL(subI64, int64_t, -)  VEC_KERNEL(mulI64, int64_t, *)  VEC_KERNEL(divI64, int64_t, /)
+VEC_KERNEL(addI32, int,     +)  VEC_KERNEL(subI32, int,     -)  VEC_KERNEL(mulI32, int,     *)  VEC_KERNEL(divI32, int,     /)
+VEC_KERNEL(addF64, double,  +)  VEC_KERNEL(subF64, double,  -)  VEC_KERNEL(mulF64, double,  *)  VEC_KERNEL(divF64, double,  /)
+VEC_KERNEL(addF32, float,   +)  VEC_KERNEL(subF32, float,   -)  VEC_KERNEL(mulF32, float,   *)  VEC_KERNEL(divF32, float,   /)
+
+/* [type][op]: will be overwritten by SIMD version if available */
+static VecKernel vecKernels[4][4] = {
+	{addI64, subI64, mulI64, divI64},
+	{addI32, subI32, mulI32, divI32},
+	{addF64, subF64, mulF64, divF64},
+	{addF32, subF32, mulF32, divF32}
+};
+
+#ifdef VEC_X86
+#define VEC_SIMD(name, isa, T, V, width, load, store, set1, vop, op) \
+static __attribute__((target(isa))) void name(APTR dst, APTR src1, APTR src2, int count, int scalar) \
+{ \
+	T * d = dst, * a = src1, * b = src2, s; \
+	V   v; \
+	int i = 0; \
+	switch (scalar) { \
+	case VEC_BOTH: \
+		for (; i + width <= count; i += width) store(d + i, vop(load(a + i), load(b + i))); \
+		break; \
+	case VEC_SCALAR1: \
+		for (v = set1(a[0]); i + width <= count; i += width) store(d + i, vop(v, load(b + i))); \
+		break; \
+	case VEC_SCALAR2: \
+		for (v = set1(b[0]); i + width <= count; i += width) store(d + i, vop(load(a + i), v)); \
+	} \
+	VEC_LOOP(T, op) \
+}
+
+#define LOADI128(p)         _mm_loadu_si128((__m128i *) (p))
+#define STOREI128(p, v)     _mm_storeu_si128((__m128i *) (p), v)
+#define LOADI256(p)         _mm256_loadu_si256((__m256i *) (p))
+#define STOREI256(p, v)     _mm256_storeu_si256((__m256i *) (p), v)
+
+/* SSE2 does not have 32 or 64bit integer multiply, nor integer division */
+VEC_SIMD(addF64_SSE2, "sse2", double,  __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, +)
+VEC_SIMD(subF64_SSE2, "sse2", double,  __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_sub_pd, -)
+VEC_SIMD(mulF64_SSE2, "sse2", double,  __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_mul_pd, *)
+VEC_SIMD(divF64_SSE2, "sse2", double,  __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_div_pd, /)
+VEC_SIMD(addF32_SSE2, "sse2", float,   __m128,  4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, +)
+VEC_SIMD(subF32_SSE2, "sse2", float,   __m128,  4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_sub_ps, -)
+VEC_SIMD(mulF32_SSE2, "sse2", float,   __m128,  4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_mul_ps, *)
+VEC_SIMD(divF32_SSE2, "sse2", float,   __m128,  4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_div_ps, /)
+VEC_SIMD(addI64_SSE2, "sse2", int64_t, __m128i, 2, LOADI128, STOREI128, _mm_set1_epi64x, _mm_add_epi64, +)
+VEC_SIMD(subI64_SSE2, "sse2", int64_t, __m128i, 2, LOADI128, STOREI128, _mm_set1_epi64x, _mm_sub_epi64, -)
+VEC_SIMD(addI32_SSE2, "sse2", int,     __m128i, 4, LOADI128, STOREI128, _mm_set1_epi32,  _mm_add_epi32, +)
+VEC_SIMD(subI32_SSE2, "sse2", int,     __m128i, 4, LOADI128, STOREI128, _mm_set1_epi32,  _mm_sub_epi32, -)
+
+VEC_SIMD(addF64_AVX2, "avx2", double,  __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, +)
+VEC_SIMD(subF64_AVX2, "avx2", double,  __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_sub_pd, -)
+VEC_SIMD(mulF64_AVX2, "avx2", double,  __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_mul_pd, *)
+VEC_SIMD(divF64_AVX2, "avx2", double,  __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_div_pd, /)
+VEC_SIMD(addF32_AVX2, "avx2", float,   __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, +)
+VEC_SIMD(subF32_AVX2, "avx2", float,   __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_sub_ps, -)
+VEC_SIMD(mulF32_AVX2, "avx2", float,   __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_mul_ps, *)
+VEC_SIMD(divF32_AVX2, "avx2", float,   __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_div_ps, /)
+VEC_SIMD(addI64_AVX2, "avx2", int64_t, __m256i, 4, LOADI256, STOREI256, _mm256_set1_epi64x, _mm256_add_epi64,   +)
+VEC_SIMD(subI64_AVX2, "avx2", int64_t, __m256i, 4, LOADI256, STOREI256, _mm256_set1_epi64x, _mm256_sub_epi64,   -)
+VEC_SIMD(addI32_AVX2, "avx2", int,     __m256i, 8, LOADI256, STOREI256, _mm256_set1_epi32,  _mm256_add_epi32,   +)
+VEC_SIMD(subI32_AVX2, "avx2", int,     __m256i, 8, LOADI256, STOREI256, _mm256_set1_epi32,  _mm256_sub_epi32,   -)
+VEC_SIMD(mulI32_AVX2, "avx2", int,     __m256i, 8, LOADI256, STOREI256, _mm256_set1_epi32,  _mm256_mullo_epi32, *)
+#endif
+
+/*
+ * reductions: floating point sums are computed by blocks with Kahan summation using several accumulators,
+ * then blocks are added the same way. Integers are accumulated in 64bit, which is exact, until it overflows.
+ */
+#define VEC_BLOCK       1024         /* items per partial sum */
+#define VEC_MT_MIN      (1 << 20)    /* use threads for arrays larger than this */
+#define VEC_THREADS     4
+
+typedef double (*VecAccum)(APTR src1, APTR src2, int count);
+typedef void   (*VecExtremum)(APTR src, int count, APTR res);
+
+#define VEC_TAIL_SUM(i)              a[i]
+#define VEC_TAIL_DOT(i)              (double) a[i] * b[i]
+#define VEC_TERM_SUM(load, mul, i)   load(a + i)
+#define VEC_TERM_DOT(load, mul, i)   mul(load(a + i), load(b + i))
+
+/* Kahan summation: <err> keeps the low order bits lost by the previous addition */
+#define VEC_KAHAN(sum, err, term) \
+	y = (term) - err, t = sum + y, err = (t - sum) - y, sum = t
+
+#define VEC_ACCUM(name, T, tail) \
+static double name(APTR src1, APTR src2, int count) \
+{ \
+	T *    a = src1, * b = src2; \
+	double sum, err, y, t; \
+	int    i; \
+	for (i = 0, sum = err = 0; i < count; i ++) \
+		VEC_KAHAN(sum, err, tail(i)); \
+	(void) b; \
+	return sum; \
+}
+
+#define VEC_EXTREMUM(name, T, cmp) \
+static void name(APTR src, int count, APTR res) \
+{ \
+	T * p = src, m = p[0]; \
+	int i; \
+	for (i = 1; i < count; i ++) \
+		if (p[i] cmp m) m = p[i]; \
+	* (T *) res = m; \
+}
+
+VEC_ACCUM(sumF64, double, VEC_TAIL_SUM)  VEC_ACCUM(dotF64, double, VEC_TAIL_DOT)
+VEC_ACCUM(sumF32, float,  VEC_TAIL_SUM)  VEC_ACCUM(dotF32, float,  VEC_TAIL_DOT)
+
+VEC_EXTREMUM(minI64, int64_t, <)  VEC_EXTREMUM(maxI64, int64_t, >)
+VEC_EXTREMUM(minI32, int,     <)  VEC_EXTREMUM(maxI32, int,     >)
+VEC_EXTREMUM(minF64, double,  <)  VEC_EXTREMUM(maxF64, double,  >)
+VEC_EXTREMUM(minF32, float,   <)  VEC_EXTREMUM(maxF32, float,   >)
+
+/* [type - TYPE_DBL][sum, dot] */
+static VecAccum vecAccums[2][2] = {
+	{sumF64, dotF64},
+	{sumF32, dotF32}
+};
+
+/* [type][min, max] */
+static VecExtremum vecExtremums[4][2] = {
+	{minI64, maxI64},
+	{minI32, maxI32},
+	{minF64, maxF64},
+	{minF32, maxF32}
+};
+
+#ifdef VEC_X86
+#define VEC_SIMD_KAHAN(sum, err, term, add, sub) \
+	vy = sub(term, err), vt = add(sum, vy), err = sub(sub(vt, sum), vy), sum = vt
+
+/* float are converted to double before being accumulated: 2 Kahan accumulators to hide latency */
+#define VEC_SIMD_ACCUM(name, isa, T, V, width, load, store, zero, add, sub, mul, term, tail) \
+static __attribute__((target(isa))) double name(APTR src1, APTR src2, int count) \
+{ \
+	T *    a = src1, * b = src2; \
+	V      sum0 = zero(), sum1 = zero(), err0 = zero(), err1 = zero(), vy, vt; \
+	double sums[width], errs[width], sum, err, y, t; \
+	int    i, k; \
+	for (i = 0; i + 2 * width <= count; i += 2 * width) \
+	{ \
+		VEC_SIMD_KAHAN(sum0, err0, term(load, mul, i),         add, sub); \
+		VEC_SIMD_KAHAN(sum1, err1, term(load, mul, i + width), add, sub); \
+	} \
+	VEC_SIMD_KAHAN(sum0, err0, sub(sum1, err1), add, sub); \
+	store(sums, sum0); \
+	store(errs, err0); \
+	for (sum = sums[0], err = errs[0], k = 1; k < width; k ++) \
+		VEC_KAHAN(sum, err, sums[k] - errs[k]); \
+	for (; i < count; i ++) \
+		VEC_KAHAN(sum, err, tail(i)); \
+	(void) b; \
+	return sum - err; \
+}
+
+#define VEC_SIMD_EXTREMUM(name, isa, T, V, width, load, store, vop, cmp) \
+static __attribute__((target(isa))) void name(APTR src, int count, APTR res) \
+{ \
+	T * p = src, m = p[0], lanes[width]; \
+	int i = 0, k; \
+	if (count >= 2 * width) \
+	{ \
+		V acc0 = load(p), acc1 = load(p + width); \
+		for (i = 2 * width; i + 2 * width <= count; i += 2 * width) \
+			acc0 = vop(acc0, load(p + i)), acc1 = vop(acc1, load(p + i + width)); \
+		store(lanes, vop(acc0, acc1)); \
+		for (k = 0; k < width; k ++) \
+			if (lanes[k] cmp m) m = lanes[k]; \
+	} \
+	for (; i < count; i ++) \
+		if (p[i] cmp m) m = p[i]; \
+	* (T *) res = m; \
+}
+
+#define LOADPS128(p)        _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((__m128i *) (p))))
+#define LOADPS256(p)        _mm256_cvtps_pd(_mm_loadu_ps(p))
+
+VEC_SIMD_ACCUM(sumF64_SSE2, "sse2", double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_setzero_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, VEC_TERM_SUM, VEC_TAIL_SUM)
+VEC_SIMD_ACCUM(dotF64_SSE2, "sse2", double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_setzero_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, VEC_TERM_DOT, VEC_TAIL_DOT)
+VEC_SIMD_ACCUM(sumF32_SSE2, "sse2", float,  __m128d, 2, LOADPS128,    _mm_storeu_pd, _mm_setzero_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, VEC_TERM_SUM, VEC_TAIL_SUM)
+VEC_SIMD_ACCUM(dotF32_SSE2, "sse2", float,  __m128d, 2, LOADPS128,    _mm_storeu_pd, _mm_setzero_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, VEC_TERM_DOT, VEC_TAIL_DOT)
+VEC_SIMD_ACCUM(sumF64_AVX2, "avx2", double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_setzero_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, VEC_TERM_SUM, VEC_TAIL_SUM)
+VEC_SIMD_ACCUM(dotF64_AVX2, "avx2", double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_setzero_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, VEC_TERM_DOT, VEC_TAIL_DOT)
+VEC_SIMD_ACCUM(sumF32_AVX2, "avx2", float,  __m256d, 4, LOADPS256,       _mm256_storeu_pd, _mm256_setzero_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, VEC_TERM_SUM, VEC_TAIL_SUM)
+VEC_SIMD_ACCUM(dotF32_AVX2, "avx2", float,  __m256d, 4, LOADPS256,       _mm256_storeu_pd, _mm256_setzero_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, VEC_TERM_DOT, VEC_TAIL_DOT)
+
+/* SSE2 does not have 32bit integer min/max, AVX2 does not have 64bit */
+VEC_SIMD_EXTREMUM(minF64_SSE2, "sse2", double, __m128d, 2, _mm_loadu_pd,    _mm_storeu_pd,    _mm_min_pd,    <)
+VEC_SIMD_EXTREMUM(maxF64_SSE2, "sse2", double, __m128d, 2, _mm_loadu_pd,    _mm_storeu_pd,    _mm_max_pd,    >)
+VEC_SIMD_EXTREMUM(minF32_SSE2, "sse2", float,  __m128,  4, _mm_loadu_ps,    _mm_storeu_ps,    _mm_min_ps,    <)
+VEC_SIMD_EXTREMUM(maxF32_SSE2, "sse2", float,  __m128,  4, _mm_loadu_ps,    _mm_storeu_ps,    _mm_max_ps,    >)
+VEC_SIMD_EXTREMUM(minF64_AVX2, "avx2", double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_min_pd, <)
+VEC_SIMD_EXTREMUM(maxF64_AVX2, "avx2", double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_max_pd, >)
+VEC_SIMD_EXTREMUM(minF32_AVX2, "avx2", float,  __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_min_ps, <)
+VEC_SIMD_EXTREMUM(maxF32_AVX2, "avx2", float,  __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_max_ps, >)
+VEC_SIMD_EXTREMUM(minI32_AVX2, "avx2", int,    __m256i, 8, LOADI256,        STOREI256,        _mm256_min_epi32, <)
+VEC_SIMD_EXTREMUM(maxI32_AVX2, "avx2", int,    __m256i, 8, LOADI256,        STOREI256,        _mm256_max_epi32, >)
+#endif
+
+/* must be called before vector functions are used by several threads */
+void vecInit(void)
+{
+	static Bool init;
+	if (init) return;
+	init = True;
+	#ifdef VEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		VecKernel avx2[4][4] = {
+			{addI64_AVX2, subI64_AVX2, mulI64,      divI64},
+			{addI32_AVX2, subI32_AVX2, mulI32_AVX2, divI32},
+			{addF64_AVX2, subF64_AVX2, mulF64_AVX2, divF64_AVX2},
+			{addF32_AVX2, subF32_AVX2, mulF32_AVX2, divF32_AVX2}
+		};
+		VecAccum    accums[2][2] = {{sumF64_AVX2, dotF64_AVX2}, {sumF32_AVX2, dotF32_AVX2}};
+		VecExtremum extremums[4][2] = {
+			{minI64,      maxI64},
+			{minI32_AVX2, maxI32_AVX2},
+			{minF64_AVX2, maxF64_AVX2},
+			{minF32_AVX2, maxF32_AVX2}
+		};
+		memcpy(vecKernels, avx2, sizeof avx2);
+		memcpy(vecAccums, accums, sizeof accums);
+		memcpy(vecExtremums, extremums, sizeof extremums);
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		VecKernel sse2[4][4] = {
+			{addI64_SSE2, subI64_SSE2, mulI64,      divI64},
+			{addI32_SSE2, subI32_SSE2, mulI32,      divI32},
+			{addF64_SSE2, subF64_SSE2, mulF64_SSE2, divF64_SSE2},
+			{addF32_SSE2, subF32_SSE2, mulF32_SSE2, divF32_SSE2}
+		};
+		VecAccum    accums[2][2] = {{sumF64_SSE2, dotF64_SSE2}, {sumF32_SSE2, dotF32_SSE2}};
+		VecExtremum extremums[4][2] = {
+			{minI64,      maxI64},
+			{minI32,      maxI32},
+			{minF64_SSE2, maxF64_SSE2},
+			{minF32_SSE2, maxF32_SSE2}
+		};
+		memcpy(vecKernels, sse2, sizeof sse2);
+		memcpy(vecAccums, accums, sizeof accums);
+		memcpy(vecExtremums, extremums, sizeof extremums);
+	}
+	#endif
+}
+
+/* <dst> can be the same as <src1> or <src2>, unless it is the broadcast one */
+void vecOp(int op, int type, APTR dst, APTR src1, APTR src2, int count, int scalar)
+{
+	vecInit();
+	vecKernels[type][op](dst, src1, src2, count, scalar);
+}
+
+#define VEC_FROM(T) \
+	switch (srcType) { \
+	case TYPE_INT:   for (i = 0; i < count; i ++) ((T *) dst)[i] = ((int64_t *) src)[i]; break; \
+	case TYPE_INT32: for (i = 0; i < count; i ++) ((T *) dst)[i] = ((int *)     src)[i]; break; \
+	case TYPE_DBL:   for (i = 0; i < count; i ++) ((T *) dst)[i] = ((double *)  src)[i]; break; \
+	case TYPE_FLOAT: for (i = 0; i < count; i ++) ((T *) dst)[i] = ((float *)   src)[i]; \
+	}
+
+/*
+ * NaN-boxing: vectors of mixed number types store every item in 8 bytes. Doubles are stored as is (NaN are
+ * made canonical), other types are stored in the payload of a negative quiet NaN, whose top 16 bits are
+ * the tag. Integers must fit in 48 bits, wider ones can't be boxed. Boxes are xor'ed with the integer tag:
+ * zeroed memory reads as integer 0.
+ */
+#define BOX_INT         0xfff9000000000000ULL
+#define BOX_INT32       0xfffa000000000000ULL
+#define BOX_FLOAT       0xfffb000000000000ULL
+#define BOX_NAN         0x7ff8000000000000ULL
+#define BOX_PAYLOAD     0x0000ffffffffffffULL
+
+Bool vecBox(Variant item, uint64_t * box)
+{
+	uint64_t bits;
+	uint32_t real32;
+
+	switch (item->type) {
+	case TYPE_INT:
+		if (item->int64 < -(1LL << 47) || item->int64 >= (1LL << 47))
+			return False;
+		bits = BOX_INT | (item->int64 & BOX_PAYLOAD);
+		break;
+	case TYPE_INT32:
+		bits = BOX_INT32 | (uint32_t) item->int32;
+		break;
+	case TYPE_DBL:
+		if (item->real64 != item->real64) bits = BOX_NAN;
+		else memcpy(&bits, &item->real64, 8);
+		break;
+	case TYPE_FLOAT:
+		memcpy(&real32, &item->real32, 4);
+		bits = BOX_FLOAT | real32;
+		break;
+	default:
+		return False;
+	}
+	*box = bits ^ BOX_INT;
+	return True;
+}
+
+void vecUnbox(uint64_t box, Variant item)
+{
+	uint32_t real32;
+
+	memset(item, 0, sizeof *item);
+	box ^= BOX_INT;
+	switch (box >> 48) {
+	case BOX_INT >> 48:
+		item->type  = TYPE_INT;
+		item->int64 = (int64_t) (box << 16) >> 16;
+		break;
+	case BOX_INT32 >> 48:
+		item->type  = TYPE_INT32;
+		item->int32 = (int) box;
+		break;
+	case BOX_FLOAT >> 48:
+		real32 = box;
+		item->type = TYPE_FLOAT;
+		memcpy(&item->real32, &real32, 4);
+		break;
+	default:
+		item->type = TYPE_DBL;
+		memcpy(&item->real64, &box, 8);
+	}
+}
+
+/* widest number type of the items of a boxed vector */
+int vecBoxedType(APTR src, int count)
+{
+	int type, i;
+	for (i = 0, type = TYPE_INT32; i < count; i ++)
+	{
+		switch ((((uint64_t *) src)[i] ^ BOX_INT) >> 48) {
+		case BOX_INT32 >> 48: break;
+		case BOX_INT >> 48:   type = WidestType(type, TYPE_INT); break;
+		case BOX_FLOAT >> 48: type = WidestType(type, TYPE_FLOAT); break;
+		default:              return TYPE_DBL;
+		}
+	}
+	return type;
+}
+
+#define VEC_UNBOX(T) \
+	for (i = 0; i < count; i ++) { \
+		uint64_t box = ((uint64_t *) src)[i] ^ BOX_INT; \
+		switch (box >> 48) { \
+		case BOX_INT >> 48:   ((T *) dst)[i] = (int64_t) (box << 16) >> 16; break; \
+		case BOX_INT32 >> 48: ((T *) dst)[i] = (int) box; break; \
+		case BOX_FLOAT >> 48: { uint32_t bits = box; float real32; memcpy(&real32, &bits, 4); ((T *) dst)[i] = real32; } break; \
+		default:              { double real64; memcpy(&real64, &box, 8); ((T *) dst)[i] = real64; } \
+		} \
+	}
+
+/* <dst> and <src> cannot overlap */
+void vecConvert(APTR dst, int type, APTR src, int srcType, int count)
+{
+	int i;
+	if (srcType == TYPE_BOXED && type != TYPE_BOXED)
+	{
+		switch (type) {
+		case TYPE_INT:   VEC_UNBOX(int64_t); break;
+		case TYPE_INT32: VEC_UNBOX(int);     break;
+		case TYPE_DBL:   VEC_UNBOX(double);  break;
+		case TYPE_FLOAT: VEC_UNBOX(float);
+		}
+		return;
+	}
+	if (type == TYPE_BOXED)
+	{
+		/* items of boxed vectors can be of any type: one at a time */
+		VariantBuf from = {.type = TYPE_VECTOR, .lengthFree = count | VAR_SETITEM(srcType), .vector = src};
+		VariantBuf to   = {.type = TYPE_VECTOR, .lengthFree = count | VAR_SETITEM(type), .vector = dst};
+		VariantBuf item;
+		for (i = 0; i < count; i ++)
+			VectorGet(&from, i, &item), VectorSet(&to, i, &item);
+		return;
+	}
+	switch (type) {
+	case TYPE_INT:   VEC_FROM(int64_t); break;
+	case TYPE_INT32: VEC_FROM(int);     break;
+	case TYPE_DBL:   VEC_FROM(double);  break;
+	case TYPE_FLOAT: VEC_FROM(float);
+	}
+}
+
+/* integer division by 0 will cause a CPU exception */
+Bool vecHasZero(APTR src, int type, int count)
+{
+	int i;
+	switch (type) {
+	case TYPE_INT:   for (i = 0; i < count && ((int64_t *) src)[i]; i ++); break;
+	case TYPE_INT32: for (i = 0; i < count && ((int *)     src)[i]; i ++); break;
+	default:         return False;
+	}
+	return i < count;
+}
+
+typedef struct VecJob_t *     VecJob;
+
+struct VecJob_t                /* part of an array reduced by one thread */
+{
+	int       op, type;
+	DATA8     src1, src2;
+	int       count, index;      /* index: start of slice, then result of VEC_ARGMIN/ARGMAX */
+	int64_t   int64;             /* result for integer items */
+	double    real64;            /* result for floating point items */
+	Semaphore done;
+};
+
+#define VEC_FIND(T, value) \
+	for (i = 0; i < count && ((T *) src1)[i] != value; i ++)
+
+static void vecReduceJob(APTR arg)
+{
+	VecJob job = arg;
+	DATA8  src1 = job->src1, src2 = job->src2;
+	int    count = job->count, size = job->type & 1 ? 4 : 8, i;
+	union {
+		int64_t int64;
+		int     int32;
+		double  real64;
+		float   real32;
+	}      m;
+
+	switch (job->op) {
+	case VEC_SUM:
+	case VEC_DOT:
+		if (job->type >= TYPE_DBL)
+		{
+			VecAccum accum = vecAccums[job->type - TYPE_DBL][job->op == VEC_DOT];
+			double   sum, err, part, tmp;
+			for (i = 0, sum = err = 0; i < count; i += VEC_BLOCK)
+			{
+				part = accum(src1 + i * size, src2 + i * size, MIN(VEC_BLOCK, count - i)) - err;
+				tmp  = sum + part;
+				err  = (tmp - sum) - part;
+				sum  = tmp;
+			}
+			job->real64 = sum;
+		}
+		else if (job->op == VEC_DOT)
+		{
+			if (job->type == TYPE_INT)
+				for (i = 0; i < count; job->int64 += ((int64_t *) src1)[i] * ((int64_t *) src2)[i], i ++);
+			else
+				for (i = 0; i < count; job->int64 += (int64_t) ((int *) src1)[i] * ((int *) src2)[i], i ++);
+		}
+		else if (job->type == TYPE_INT)
+			for (i = 0; i < count; job->int64 += ((int64_t *) src1)[i], i ++);
+		else
+			for (i = 0; i < count; job->int64 += ((int *) src1)[i], i ++);
+		break;
+	case VEC_PROD:
+		job->int64 = 1;
+		job->real64 = 1;
+		switch (job->type) {
+		case TYPE_INT:   for (i = 0; i < count; job->int64  *= ((int64_t *) src1)[i], i ++); break;
+		case TYPE_INT32: for (i = 0; i < count; job->int64  *= ((int *)     src1)[i], i ++); break;
+		case TYPE_DBL:   for (i = 0; i < count; job->real64 *= ((double *)  src1)[i], i ++); break;
+		case TYPE_FLOAT: for (i = 0; i < count; job->real64 *= ((float *)   src1)[i], i ++);
+		}
+		break;
+	default: /* VEC_MIN - VEC_ARGMAX */
+		if (count == 0) break;
+		vecExtremums[job->type][job->op == VEC_MAX || job->op == VEC_ARGMAX](src1, count, &m);
+		switch (job->type) {
+		case TYPE_INT:   job->int64  = m.int64;  VEC_FIND(int64_t, m.int64);  break;
+		case TYPE_INT32: job->int64  = m.int32;  VEC_FIND(int,     m.int32);  break;
+		case TYPE_DBL:   job->real64 = m.real64; VEC_FIND(double,  m.real64); break;
+		case TYPE_FLOAT: job->real64 = m.real32; VEC_FIND(float,   m.real32); break;
+		default:         i = 0;
+		}
+		/* NaN will not be found */
+		job->index += i < count ? i : 0;
+	}
+	if (job->done)
+		SemAdd(job->done, 1);
+}
+
+/*
+ * <src2> is only used by VEC_DOT. Result will be stored in <res> with the type of items, except for
+ * VEC_ARGMIN/ARGMAX (index) and sums of floats (kept as double).
+ */
+void vecReduce(int op, int type, APTR src1, APTR src2, int count, Variant res)
+{
+	struct VecJob_t jobs[VEC_THREADS];
+	Semaphore done;
+	VecJob    job;
+	int       nb, slice, size, i;
+
+	vecInit();
+	memset(jobs, 0, sizeof jobs);
+	done = count >= VEC_MT_MIN ? SemInit(0) : NULL;
+	nb = done ? VEC_THREADS : 1;
+	size = type & 1 ? 4 : 8;
+	slice = (count / nb + VEC_BLOCK - 1) & ~(VEC_BLOCK - 1);
+	if (src2 == NULL)
+		src2 = src1;
+
+	for (job = jobs, i = 0; i < nb; i ++, job ++)
+	{
+		job->op    = op;
+		job->type  = type;
+		job->index = i * slice;
+		job->count = i < nb - 1 ? slice : count - job->index;
+		job->src1  = (DATA8) src1 + job->index * size;
+		job->src2  = (DATA8) src2 + job->index * size;
+		job->done  = done;
+	}
+
+	/* first slice is handled by this thread */
+	for (i = 1; i < nb; i ++)
+		if (ThreadCreate(vecReduceJob, jobs + i) == 0)
+			jobs[i].done = NULL, vecReduceJob(jobs + i), SemAdd(done, 1);
+	jobs[0].done = NULL;
+	vecReduceJob(jobs);
+
+	if (done)
+	{
+		for (i = 1; i < nb; i ++)
+			SemWait(done);
+		SemClose(done);
+	}
+
+	/* combine result of each slice */
+	for (job = jobs + 1; job < jobs + nb; job ++)
+	{
+		switch (op) {
+		case VEC_SUM:
+		case VEC_DOT:
+			jobs->int64  += job->int64;
+			jobs->real64 += job->real64;
+			break;
+		case VEC_PROD:
+			jobs->int64  *= job->int64;
+			jobs->real64 *= job->real64;
+			break;
+		case VEC_MIN:
+		case VEC_ARGMIN:
+			if (type < TYPE_DBL ? job->int64 < jobs->int64 : job->real64 < jobs->real64)
+				jobs->int64 = job->int64, jobs->real64 = job->real64, jobs->index = job->index;
+			break;
+		default:
+			if (type < TYPE_DBL ? job->int64 > jobs->int64 : job->real64 > jobs->real64)
+				jobs->int64 = job->int64, jobs->real64 = job->real64, jobs->index = job->index;
+		}
+	}
+
+	memset(res, 0, sizeof *res);
+	if (op == VEC_ARGMIN || op == VEC_ARGMAX)
+	{
+		res->type  = TYPE_INT;
+		res->int64 = jobs->index;
+	}
+	else
+	{
+		res->type = type;
+		switch (type) {
+		case TYPE_INT:   res->int64  = jobs->int64; break;
+		case TYPE_INT32: res->int32  = jobs->int64; break;
+		case TYPE_DBL:   res->real64 = jobs->real64; break;
+		case TYPE_FLOAT:
+			if (op == VEC_MIN || op == VEC_MAX) res->real32 = jobs->real64;
+			else res->real64 = jobs->real64, res->type = TYPE_DBL;
+		}
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * vector.h: public functions to perform arithmetic on typed arrays.
+ */
+
+#ifndef KALC_VECTOR_H
+#define KALC_VECTOR_H
+
+enum /* possible values for <op> parameter of vecOp */
+{
+	VEC_ADD,
+	VEC_SUB,
+	VEC_MUL,
+	VEC_DIV
+};
+
+enum /* possible values for <scalar> parameter of vecOp */
+{
+	VEC_BOTH,                    /* both operands have <count> items */
+	VEC_SCALAR1,                 /* first operand is one item, broadcast to all items of the second */
+	VEC_SCALAR2                  /* second operand is one item */
+};
+
+enum /* possible values for <op> parameter of vecReduce */
+{
+	VEC_SUM,
+	VEC_PROD,
+	VEC_DOT,
+	VEC_MIN,
+	VEC_MAX,
+	VEC_ARGMIN,
+	VEC_ARGMAX
+};
+
+/* <type> and <srcType> are TYPE_INT - TYPE_FLOAT, vecConvert() also accepts TYPE_BOXED */
+void vecInit(void);
+void vecOp(int op, int type, APTR dst, APTR src1, APTR src2, int count, int scalar);
+void vecConvert(APTR dst, int type, APTR src, int srcType, int count);
+Bool vecBox(Variant item, uint64_t * box);
+void vecUnbox(uint64_t box, Variant item);
+int  vecBoxedType(APTR src, int count);
+Bool vecHasZero(APTR src, int type, int count);
+void vecReduce(int op, int type, APTR src1, APTR src2, int count, Variant res);
+
+#endif